@@ -0,0 +1,115 @@
+#pragma once
+
+#include <vector>
+#include <chrono>
+#include <cstdio>
+
+#include <math.h>
+
+#include "Vector.h"
+
+/** Micro-benchmark of the Vec3 expression chain of Fluid::computeForce **/
+// The same pair loop runs on arrays of Vec3 and on separate x, y, z arrays of doubles, both must give the same sums.
+// The loops are kept out of line so their code can be read, e.g.
+//     objdump -d --no-show-raw-insn FluidSimulation | awk '/forceChainVec3/,/ret/'
+// Packed instructions (addpd, mulpd, or vaddpd / vmulpd on ymm registers with AVX) mean the chain stays in vector registers.
+class VectorBenchmark
+{
+public:
+    static void run(int count, int rounds)
+    {
+        std::vector<Vec3> position(count), velocity(count), pressure(count), viscosity(count);
+        std::vector<double> density(count);
+        std::vector<double> px(count), py(count), pz(count), vx(count), vy(count), vz(count);
+        std::vector<double> fx(count), fy(count), fz(count), gx(count), gy(count), gz(count);
+        for (int i = 0; i < count; i ++) { // A jittered lattice at the initial spacing of the fluid
+            position[i] = Vec3((i % 16) * 0.5 + 0.01 * (i % 7), (i / 16 % 16) * 0.5 + 0.01 * (i % 5), (i / 256) * 0.5 + 0.01 * (i % 3));
+            velocity[i] = Vec3(sin(i * 0.1), cos(i * 0.1), sin(i * 0.3));
+            density[i] = 8 + 0.1 * sin(i * 0.7);
+            px[i] = position[i].x; py[i] = position[i].y; pz[i] = position[i].z;
+            vx[i] = velocity[i].x; vy[i] = velocity[i].y; vz[i] = velocity[i].z;
+        }
+
+        printf("VectorBenchmark: %d particles, %d neighbors each, %d rounds, Vec3 is %d bytes aligned to %d%s\n",
+               count, 2*window + 1, rounds, (int)sizeof(Vec3), (int)alignof(Vec3),
+#if defined(__AVX__)
+               ", built with AVX"
+#elif defined(__SSE2__)
+               ", built with SSE2"
+#else
+               ""
+#endif
+               );
+        double vec3Time = 1e30, scalarTime = 1e30;
+        double vec3Sum = 0, scalarSum = 0;
+        for (int r = 0; r < rounds; r ++) {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            vec3Sum = forceChainVec3(count, &position[0], &velocity[0], &density[0], &pressure[0], &viscosity[0]);
+            std::chrono::steady_clock::time_point middle = std::chrono::steady_clock::now();
+            scalarSum = forceChainScalar(count, &px[0], &py[0], &pz[0], &vx[0], &vy[0], &vz[0], &density[0], &fx[0], &fy[0], &fz[0], &gx[0], &gy[0], &gz[0]);
+            std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+            vec3Time = fmin(vec3Time, std::chrono::duration<double>(middle - start).count());
+            scalarTime = fmin(scalarTime, std::chrono::duration<double>(end - middle).count());
+        }
+        double pairs = (double)count * (2*window + 1);
+        printf("\tVec3   %8.3f ns per pair\n", vec3Time / pairs * 1e9);
+        printf("\tscalar %8.3f ns per pair\n", scalarTime / pairs * 1e9);
+        printf("VectorBenchmark: sums %s (%.17g, %.17g)\n", vec3Sum == scalarSum ? "match" : "DIFFER", vec3Sum, scalarSum);
+    }
+
+private:
+    static const int window = 32; // Neighbors are the particles within window places in the arrays
+    static constexpr double radius2 = 1.0;
+    static constexpr double gradientCoef = -945.0 / (32.0 * M_PI);
+    static constexpr double gasConst = 50, restDensity = 8;
+
+    __attribute__((noinline))
+    static double forceChainVec3(int count, const Vec3* position, const Vec3* velocity, const double* density, Vec3* pressure, Vec3* viscosity)
+    {
+        double sum = 0;
+        for (int i = 0; i < count; i ++) {
+            Vec3 fPressure, fViscosity;
+            for (int j = i - window; j <= i + window; j ++) {
+                int n = j < 0 ? j + count : (j >= count ? j - count : j);
+                Vec3 diff = position[i] - position[n];
+                double t = fmax(radius2 - diff.lengthSquared(), 0.0);
+                Vec3 gradient = diff * (gradientCoef * t*t);
+                double temp = (gasConst * ((density[i]-restDensity) + density[n] - restDensity)) / (2.0 * density[n]);
+                fPressure = Vec3::Fma(gradient, temp, fPressure);
+                fViscosity = Vec3::Fma(velocity[i] - velocity[n], gradientCoef * t * (3*radius2 - 7*(radius2 - t)) / density[n], fViscosity);
+            }
+            pressure[i] = -fPressure;
+            viscosity[i] = fViscosity;
+            sum += pressure[i].x + pressure[i].y + pressure[i].z + viscosity[i].x + viscosity[i].y + viscosity[i].z;
+        }
+        return sum;
+    }
+
+    __attribute__((noinline))
+    static double forceChainScalar(int count, const double* px, const double* py, const double* pz, const double* vx, const double* vy, const double* vz,
+                                   const double* density, double* fx, double* fy, double* fz, double* gx, double* gy, double* gz)
+    {
+        double sum = 0;
+        for (int i = 0; i < count; i ++) {
+            double pressureX = 0, pressureY = 0, pressureZ = 0, viscosityX = 0, viscosityY = 0, viscosityZ = 0;
+            for (int j = i - window; j <= i + window; j ++) {
+                int n = j < 0 ? j + count : (j >= count ? j - count : j);
+                double dx = px[i] - px[n], dy = py[i] - py[n], dz = pz[i] - pz[n];
+                double t = fmax(radius2 - (dx*dx + dy*dy + dz*dz), 0.0);
+                double slope = gradientCoef * t*t;
+                double temp = (gasConst * ((density[i]-restDensity) + density[n] - restDensity)) / (2.0 * density[n]);
+                pressureX = dx * slope * temp + pressureX;
+                pressureY = dy * slope * temp + pressureY;
+                pressureZ = dz * slope * temp + pressureZ;
+                double laplacian = gradientCoef * t * (3*radius2 - 7*(radius2 - t)) / density[n];
+                viscosityX = (vx[i] - vx[n]) * laplacian + viscosityX;
+                viscosityY = (vy[i] - vy[n]) * laplacian + viscosityY;
+                viscosityZ = (vz[i] - vz[n]) * laplacian + viscosityZ;
+            }
+            fx[i] = -pressureX; fy[i] = -pressureY; fz[i] = -pressureZ;
+            gx[i] = viscosityX; gy[i] = viscosityY; gz[i] = viscosityZ;
+            sum += fx[i] + fy[i] + fz[i] + gx[i] + gy[i] + gz[i];
+        }
+        return sum;
+    }
+};
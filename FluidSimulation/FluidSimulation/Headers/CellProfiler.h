@@ -0,0 +1,124 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <functional>
+#include <cstdio>
+
+#include "Fluid.h"
+
+/** Cost of every grid cell, to see how unevenly the work of a step is spread **/
+// Turns on Fluid::profileCells and averages particles, pairs and time of every cell over interval steps. Then the means
+// are written as a VTK image of the grid (prefix_#####.vtk, open it in ParaView), and a summary of the imbalance is printed.
+class CellProfiler : public FluidObserver
+{
+public:
+    int interval; // Steps averaged in every export
+    std::string prefix;
+    // Means of the last export, cells indexed (z*gridSize.y + y)*gridSize.x + x
+    std::vector<double> meanParticles, meanPairs, meanSeconds;
+
+private:
+    Fluid* fluid;
+    std::vector<double> sumParticles, sumPairs, sumSeconds;
+    int steps; // Summed since the last export
+    long long totalSteps;
+
+public:
+    CellProfiler(Fluid* fluid, int interval, std::string prefix = "cells") : interval(interval), prefix(prefix), fluid(fluid), steps(0), totalSteps(0)
+    {
+        int numCells = fluid->gridSize.x * fluid->gridSize.y * fluid->gridSize.z;
+        sumParticles.assign(numCells, 0.0);
+        sumPairs.assign(numCells, 0.0);
+        sumSeconds.assign(numCells, 0.0);
+        meanParticles = meanPairs = meanSeconds = sumParticles;
+        fluid->profileCells = true;
+    }
+    ~CellProfiler()
+    {
+        fluid->profileCells = false;
+    }
+
+    void stepDone(Fluid* fluid, double timestep)
+    {
+        if (fluid->cellParticles.size() != sumParticles.size()) return; // No hash table yet
+        for (int i = 0; i < sumParticles.size(); i ++) {
+            sumParticles[i] += fluid->cellParticles[i];
+            sumPairs[i] += fluid->cellPairs[i];
+            sumSeconds[i] += fluid->cellSeconds[i];
+        }
+        steps ++;
+        totalSteps ++;
+        if (steps < interval) return;
+
+        for (int i = 0; i < sumParticles.size(); i ++) {
+            meanParticles[i] = sumParticles[i] / steps;
+            meanPairs[i] = sumPairs[i] / steps;
+            meanSeconds[i] = sumSeconds[i] / steps;
+        }
+        std::fill(sumParticles.begin(), sumParticles.end(), 0.0);
+        std::fill(sumPairs.begin(), sumPairs.end(), 0.0);
+        std::fill(sumSeconds.begin(), sumSeconds.end(), 0.0);
+        steps = 0;
+
+        char path[256];
+        snprintf(path, sizeof(path), "%s_%05lld.vtk", prefix.c_str(), totalSteps);
+        writeVtk(path);
+        summarize(path);
+    }
+
+    // Legacy VTK structured points : one value per cell of each field, x runs fastest as in Fluid
+    bool writeVtk(const char* path)
+    {
+        FILE* file = fopen(path, "w");
+        if (!file) {
+            printf("CellProfiler: can't write %s\n", path);
+            return false;
+        }
+        int gx = fluid->gridSize.x, gy = fluid->gridSize.y, gz = fluid->gridSize.z;
+        Vec3 origin = fluid->boundary->position;
+        fprintf(file, "# vtk DataFile Version 3.0\n");
+        fprintf(file, "Fluid cell costs, mean of %d steps up to step %lld\n", interval, totalSteps);
+        fprintf(file, "ASCII\nDATASET STRUCTURED_POINTS\n");
+        fprintf(file, "DIMENSIONS %d %d %d\nORIGIN %g %g %g\nSPACING 1 1 1\n", gx + 1, gy + 1, gz + 1, origin.x, origin.y, origin.z);
+        fprintf(file, "CELL_DATA %d\n", gx * gy * gz);
+        writeField(file, "particles", meanParticles, 1);
+        writeField(file, "pairs", meanPairs, 1);
+        writeField(file, "microseconds", meanSeconds, 1e6);
+        fclose(file);
+        return true;
+    }
+
+private:
+    static void writeField(FILE* file, const char* name, const std::vector<double>& values, double scale)
+    {
+        fprintf(file, "SCALARS %s float 1\nLOOKUP_TABLE default\n", name);
+        for (int i = 0; i < values.size(); i ++) {
+            fprintf(file, "%g%c", values[i] * scale, i % 16 == 15 ? '\n' : ' ');
+        }
+        fprintf(file, "\n");
+    }
+
+    // Busy cells, how far the costliest cell is above the mean busy cell, and the share of time in the costliest 10% of busy cells
+    void summarize(const char* path)
+    {
+        std::vector<double> busy;
+        double total = 0;
+        for (int i = 0; i < meanSeconds.size(); i ++) {
+            if (meanSeconds[i] <= 0) continue;
+            busy.push_back(meanSeconds[i]);
+            total += meanSeconds[i];
+        }
+        if (busy.empty()) {
+            printf("CellProfiler: %s, no busy cells\n", path);
+            return;
+        }
+        std::sort(busy.begin(), busy.end(), std::greater<double>());
+        int top = std::max((int)busy.size() / 10, 1);
+        double topTime = 0;
+        for (int i = 0; i < top; i ++) topTime += busy[i];
+        printf("CellProfiler: %s, %d of %d cells busy, %.3f ms per step, costliest cell %.1fx the mean, top 10%% of cells take %.0f%% of the time\n",
+               path, (int)busy.size(), (int)meanSeconds.size(), total * 1e3, busy[0] / (total / busy.size()), 100.0 * topTime / total);
+    }
+};
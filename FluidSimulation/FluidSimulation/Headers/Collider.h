@@ -0,0 +1,198 @@
+#pragma once
+
+#include <vector>
+#include <float.h>
+
+#include <math.h>
+
+#include "Vector.h"
+#include "Rigid.h"
+
+/** Colliders work in world coordinates **/
+class Collider
+{
+public:
+    virtual ~Collider() { }
+
+    // Axis aligned box of the region where resolve() may move a point
+    virtual void getBounds(double margin, Vec3& lower, Vec3& upper) = 0;
+    // Push pos out of the collider so that it keeps margin to the surface, return false if nothing changed
+    virtual bool resolve(Vec3& pos, double margin) = 0;
+};
+
+class SphereCollider : public Collider
+{
+public:
+    const double skin = 1.05; // Safe distance is slightly bigger than radius + margin
+
+    Vec3 center;
+    double radius;
+
+    SphereCollider(Vec3 center, double radius) : center(center), radius(radius) { }
+    SphereCollider(Ball* ball) : center(ball->center), radius(ball->radius) { }
+
+    void getBounds(double margin, Vec3& lower, Vec3& upper)
+    {
+        double r = (radius + margin) * skin;
+        lower = center - Vec3(r, r, r);
+        upper = center + Vec3(r, r, r);
+    }
+    bool resolve(Vec3& pos, double margin)
+    {
+        Vec3 distVec = pos - center;
+        double distLen = distVec.len();
+        double safeDist = (radius + margin) * skin;
+        if (distLen >= safeDist) {
+            return false;
+        }
+        distVec.nor();
+        pos = distVec*safeDist + center;
+        return true;
+    }
+};
+
+class BoxCollider : public Collider
+{
+public:
+    Vec3 lower;
+    Vec3 upper;
+
+    BoxCollider(Vec3 position, Vec3 size) : lower(position), upper(position + size) { }
+
+    void getBounds(double margin, Vec3& l, Vec3& u)
+    {
+        l = lower - Vec3(margin, margin, margin);
+        u = upper + Vec3(margin, margin, margin);
+    }
+    bool resolve(Vec3& pos, double margin)
+    {
+        // Penetration depth to each face of the expanded box, push out through the shallowest one
+        double depth[6] = {
+            pos.x - (lower.x-margin), (upper.x+margin) - pos.x,
+            pos.y - (lower.y-margin), (upper.y+margin) - pos.y,
+            pos.z - (lower.z-margin), (upper.z+margin) - pos.z
+        };
+        int face = 0;
+        for (int i = 0; i < 6; i ++) {
+            if (depth[i] <= 0) return false;
+            if (depth[i] < depth[face]) face = i;
+        }
+        switch (face) {
+            case 0: pos.x = lower.x - margin; break;
+            case 1: pos.x = upper.x + margin; break;
+            case 2: pos.y = lower.y - margin; break;
+            case 3: pos.y = upper.y + margin; break;
+            case 4: pos.z = lower.z - margin; break;
+            case 5: pos.z = upper.z + margin; break;
+        }
+        return true;
+    }
+};
+
+class PlaneCollider : public Collider // Solid half space behind the plane
+{
+public:
+    Vec3 point;
+    Vec3 normal;
+
+    PlaneCollider(Vec3 point, Vec3 normal) : point(point), normal(normal) { this->normal.nor(); }
+    PlaneCollider(Ground* ground) : point(ground->position), normal(0.0, 1.0, 0.0) { }
+
+    void getBounds(double margin, Vec3& lower, Vec3& upper)
+    {
+        lower = Vec3(-DBL_MAX, -DBL_MAX, -DBL_MAX);
+        upper = Vec3(DBL_MAX, DBL_MAX, DBL_MAX);
+        // Only an axis aligned plane can be bounded on one side
+        if (normal.y == 0 && normal.z == 0) {
+            if (normal.x > 0) upper.x = point.x + margin; else lower.x = point.x - margin;
+        } else if (normal.x == 0 && normal.z == 0) {
+            if (normal.y > 0) upper.y = point.y + margin; else lower.y = point.y - margin;
+        } else if (normal.x == 0 && normal.y == 0) {
+            if (normal.z > 0) upper.z = point.z + margin; else lower.z = point.z - margin;
+        }
+    }
+    bool resolve(Vec3& pos, double margin)
+    {
+        double dist = Vec3::Dot(pos - point, normal);
+        if (dist >= margin) {
+            return false;
+        }
+        pos += normal * (margin - dist);
+        return true;
+    }
+};
+
+/** A set of colliders with a cell based broadphase **/
+class ColliderSet
+{
+public:
+    std::vector<Collider*> colliders; // Owned by the set
+    int revision; // Goes up every time colliders are binned again, so sleeping fluid cells know to wake
+
+private:
+    bool binned;
+    Vec3 gridOrigin; // World coordinate of the corner of cell (0, 0, 0)
+    int gridX, gridY, gridZ;
+    double gridMargin;
+    std::vector< std::vector<Collider*> > cells; // Colliders whose bounds overlap each cell
+
+public:
+    ColliderSet() : revision(0), binned(false), gridX(0), gridY(0), gridZ(0), gridMargin(0) { }
+    ~ColliderSet()
+    {
+        for (int i = 0; i < colliders.size(); i ++) { delete colliders[i]; }
+        colliders.clear();
+    }
+
+    void add(Collider* collider)
+    {
+        colliders.push_back(collider);
+        binned = false;
+    }
+    // Call after moving or resizing a collider
+    void moved() { binned = false; }
+
+    // Sort colliders into unit cells of the grid, nothing happens if it's already done for the same grid
+    void bin(Vec3 origin, int sizeX, int sizeY, int sizeZ, double margin)
+    {
+        if (binned && origin == gridOrigin && sizeX == gridX && sizeY == gridY && sizeZ == gridZ && margin == gridMargin) {
+            return;
+        }
+        gridOrigin = origin;
+        gridX = sizeX;
+        gridY = sizeY;
+        gridZ = sizeZ;
+        gridMargin = margin;
+
+        cells.clear();
+        cells.resize(gridX * gridY * gridZ);
+        for (int n = 0; n < colliders.size(); n ++) {
+            Vec3 lower, upper;
+            colliders[n]->getBounds(margin, lower, upper);
+
+            // Particles out of grid are clamped to the border cells, so do the bounds
+            int xMin = clampCell(lower.x - gridOrigin.x, gridX), xMax = clampCell(upper.x - gridOrigin.x, gridX);
+            int yMin = clampCell(lower.y - gridOrigin.y, gridY), yMax = clampCell(upper.y - gridOrigin.y, gridY);
+            int zMin = clampCell(lower.z - gridOrigin.z, gridZ), zMax = clampCell(upper.z - gridOrigin.z, gridZ);
+            for (int z = zMin; z <= zMax; z ++) {
+                for (int y = yMin; y <= yMax; y ++) {
+                    for (int x = xMin; x <= xMax; x ++) {
+                        cells[(z*gridY + y)*gridX + x].push_back(colliders[n]);
+                    }
+                }
+            }
+        }
+        binned = true;
+        revision ++;
+    }
+
+    const std::vector<Collider*>& getCell(int x, int y, int z) { return cells[(z*gridY + y)*gridX + x]; }
+
+private:
+    static int clampCell(double coord, int size)
+    {
+        if (coord < 0) return 0;
+        if (coord >= size) return size - 1;
+        return (int)coord;
+    }
+};
@@ -6,6 +6,7 @@
 #include "Fluid.h"
 #include "Rigid.h"
 #include "Program.h"
+#include "Log.h"
 
 struct Camera
 {
@@ -56,10 +57,19 @@ class BoundaryRender
     
     GLint aPtrPos;
     GLint aPtrNor;
+    
+    /** Heatmap overlay **/ // A point at the center of every cell with a value, colored from blue (low) to red (highest)
+    int numHeat;
+    glm::vec3 *heatPos;
+    glm::vec3 *heatCol;
+    GLuint heatProgramID;
+    GLuint heatVaoID;
+    GLuint heatVboIDs[2];
 
 public:
     BoundaryRender(Boundary* boundary)
     {
+        this->boundary = boundary;
         uniBoundaryColor = glm::vec4(0.5, 0.5, 0.5, 0.5);
         Vertex v1(Vec3(boundary->xMin, boundary->yMin, boundary->zMin));
         Vertex v2(Vec3(boundary->xMax, boundary->yMin, boundary->zMin));
@@ -111,7 +121,7 @@ public:
         
         numLines = (int)(lines.size()) / 2;
         if (numLines <= 0) {
-            std::cout << "ERROR::BoundaryRender : No boundary exists." << std::endl;
+            Log::error("ERROR::BoundaryRender : No boundary exists.");
             exit(-1);
         }
         
@@ -129,7 +139,7 @@ public:
         /** Build render program **/
         Program program("Shaders/BoundaryVS.glsl", "Shaders/BoundaryFS.glsl");
         programID = program.ID;
-        std::cout << "Boundary Program ID: " << programID << std::endl;
+        Log::info("Boundary Program ID: %u", programID);
 
         // Generate ID of VAO and VBOs
         glGenVertexArrays(1, &vaoID);
@@ -175,12 +185,50 @@ public:
         // Cleanup
         glBindBuffer(GL_ARRAY_BUFFER, 0); // Unbined VBO
         glBindVertexArray(0); // Unbined VAO
+        
+        /** Heatmap overlay : colored points, drawn with the fluid's shaders **/
+        int numCells = (int)boundary->size.x * (int)boundary->size.y * (int)boundary->size.z;
+        numHeat = 0;
+        heatPos = new glm::vec3[numCells];
+        heatCol = new glm::vec3[numCells];
+        Program heatProgram("Shaders/FluidVS.glsl", "Shaders/FluidFS.glsl");
+        heatProgramID = heatProgram.ID;
+        glGenVertexArrays(1, &heatVaoID);
+        glGenBuffers(2, heatVboIDs);
+        glBindVertexArray(heatVaoID);
+        glBindBuffer(GL_ARRAY_BUFFER, heatVboIDs[0]);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
+        glBufferData(GL_ARRAY_BUFFER, numCells*sizeof(glm::vec3), heatPos, GL_DYNAMIC_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, heatVboIDs[1]);
+        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
+        glBufferData(GL_ARRAY_BUFFER, numCells*sizeof(glm::vec3), heatCol, GL_DYNAMIC_DRAW);
+        glEnableVertexAttribArray(0);
+        glEnableVertexAttribArray(1);
+        glUseProgram(heatProgramID);
+        glUniformMatrix4fv(glGetUniformLocation(heatProgramID, "uniProjMatrix"), 1, GL_FALSE, &cam.uniProjMatrix[0][0]);
+        glUniformMatrix4fv(glGetUniformLocation(heatProgramID, "uniModelMatrix"), 1, GL_FALSE, &uniModelMatrix[0][0]);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        glBindVertexArray(0);
     }
     
     ~BoundaryRender()
     {
         delete [] vboPos;
         delete [] vboNor;
+        delete [] heatPos;
+        delete [] heatCol;
+        
+        if (heatVaoID)
+        {
+            glDeleteVertexArrays(1, &heatVaoID);
+            glDeleteBuffers(2, heatVboIDs);
+            heatVaoID = 0;
+        }
+        if (heatProgramID)
+        {
+            glDeleteProgram(heatProgramID);
+            heatProgramID = 0;
+        }
         
         if (vaoID)
         {
@@ -222,72 +270,144 @@ public:
         glBindBuffer(GL_ARRAY_BUFFER, 0);
         glBindVertexArray(0);
         glUseProgram(0);
+        
+        if (numHeat > 0) {
+            glUseProgram(heatProgramID);
+            glBindVertexArray(heatVaoID);
+            glBindBuffer(GL_ARRAY_BUFFER, heatVboIDs[0]);
+            glBufferSubData(GL_ARRAY_BUFFER, 0, numHeat*sizeof(glm::vec3), heatPos);
+            glBindBuffer(GL_ARRAY_BUFFER, heatVboIDs[1]);
+            glBufferSubData(GL_ARRAY_BUFFER, 0, numHeat*sizeof(glm::vec3), heatCol);
+            glUniformMatrix4fv(glGetUniformLocation(heatProgramID, "uniViewMatrix"), 1, GL_FALSE, &cam.uniViewMatrix[0][0]);
+            glEnable(GL_BLEND);
+            glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+            glEnable(GL_PROGRAM_POINT_SIZE);
+            glVertexAttrib1f(2, heatPointSize); // Size attribute of the fluid program, the same for every cell
+            glDrawArrays(GL_POINTS, 0, numHeat);
+            glDisable(GL_PROGRAM_POINT_SIZE);
+            glDisable(GL_BLEND);
+            glBindBuffer(GL_ARRAY_BUFFER, 0);
+            glBindVertexArray(0);
+            glUseProgram(0);
+        }
+    }
+    
+    // Show one value per grid cell (cells indexed (z*size.y + y)*size.x + x, e.g. CellProfiler::meanSeconds), cells at 0 are left out.
+    // An empty vector hides the overlay.
+    void setHeatmap(const std::vector<double>& values)
+    {
+        int sizeX = boundary->size.x, sizeY = boundary->size.y;
+        double highest = 0;
+        for (int i = 0; i < values.size(); i ++) highest = fmax(highest, values[i]);
+        numHeat = 0;
+        for (int i = 0; i < values.size() && highest > 0; i ++) {
+            if (values[i] <= 0) continue;
+            int x = i % sizeX, y = i / sizeX % sizeY, z = i / sizeX / sizeY;
+            heatPos[numHeat] = glm::vec3(boundary->position.x + x + 0.5, boundary->position.y + y + 0.5, boundary->position.z + z + 0.5);
+            float t = (float)(values[i] / highest); // Blue, cyan, green, yellow, red
+            heatCol[numHeat] = glm::vec3(glm::clamp(4*t - 2, 0.0f, 1.0f), glm::clamp(t < 0.5f ? 4*t : 4 - 4*t, 0.0f, 1.0f), glm::clamp(2 - 4*t, 0.0f, 1.0f));
+            numHeat ++;
+        }
     }
+    
+private:
+    const float heatPointSize = 12;
 };
 
 class FluidRender
 {
     const Fluid* fluid;
-    int numParticles;
+    // Buffers grow to twice their size whenever the fluid outgrows them, and only shrink after the fluid compacts
+    // its particles while a quarter of them or less is used, so changing counts reallocate a logarithmic number of times
+    const int minCapacity = 1024;
+    int capacity; // Points the buffers hold, the fluid's particle count bounds the points of a flush
+    int numParticles; // Points drawn in the last flush
+    int compactions; // Fluid::compactions at the last flush
     
     GLuint programID;
     GLuint vaoID;
-    GLuint vboIDs[2];
+    GLuint vboIDs[3];
     
     GLint aPtrPos;
     GLint aPtrCol;
+    GLint aPtrSize;
     
     glm::vec3 *vboPos; // Position
     glm::vec3 *vboCol; // Color
+    float *vboSize; // Point size in pixels
+    
+    glm::mat4 uniModelMatrix;
     
 public:
+    int reallocations; // Times the buffers were resized
+    
+    /** Culling and level of detail **/ // Work at grid cell granularity, see gather
+    bool culling; // Cells outside the camera frustum aren't drawn
+    float lodDistance; // Cells farther than this from the camera are drawn as one point, 0 : never
+    // Only cells at the surface of the fluid or against a wall are drawn, blending hides the rest. A cell is inside when
+    // the density pass found at least surfaceFraction of Fluid::getFullNeighbors particles around it, see Fluid::cellNeighbors.
+    bool surfaceOnly;
+    const float surfaceFraction = 0.8f;
+    int drawnParticles, drawnImpostors, culledCells, interiorCells; // Of the last flush
+    
     FluidRender(Fluid* fluid)
     {
         numParticles = (int)(fluid->particles.size());
-        if (numParticles <= 0) {
-            // TODO: Formatting all the print out
-            std::cout << "ERROR::FluidRender : No particles exists." << std::endl;
-            exit(-1);
-        }
+        capacity = std::max(numParticles, minCapacity);
+        compactions = fluid->compactions;
+        reallocations = 0;
+        culling = true;
+        lodDistance = 0;
+        surfaceOnly = false;
+        drawnParticles = drawnImpostors = culledCells = interiorCells = 0;
         
         this->fluid = fluid;
         
-        vboPos = new glm::vec3[numParticles];
-        vboCol = new glm::vec3[numParticles];
+        vboPos = new glm::vec3[capacity];
+        vboCol = new glm::vec3[capacity];
+        vboSize = new float[capacity];
         for (int i = 0; i < numParticles; i ++) {
             Particle* p = fluid->particles[i];
             vboPos[i] = glm::vec3(p->position.x, p->position.y, p->position.z);
-            vboCol[i] = glm::vec3(p->color.x, p->color.y, p->color.z);
-            printf("[%d] %f, %f, %f\n", p->index, p->color.x, p->color.y, p->color.z);
+            Vec3 color = fluid->getColor(p);
+            vboCol[i] = glm::vec3(color.x, color.y, color.z);
+            vboSize[i] = fluid->particleSize;
+            Log::debug("[%d] %f, %f, %f", p->index, color.x, color.y, color.z);
         }
         
         /** Build render program **/
         Program program("Shaders/FluidVS.glsl", "Shaders/FluidFS.glsl");
         programID = program.ID;
-        std::cout << "Fluid Program ID: " << programID << std::endl;
+        Log::info("Fluid Program ID: %u", programID);
 
         // Generate ID of VAO and VBOs
         glGenVertexArrays(1, &vaoID);
-        glGenBuffers(2, vboIDs);
+        glGenBuffers(3, vboIDs);
         
         // Attribute pointers of VAO
         aPtrPos = 0;
         aPtrCol = 1;
+        aPtrSize = 2;
         // Bind VAO
         glBindVertexArray(vaoID);
         
         // Position buffer
         glBindBuffer(GL_ARRAY_BUFFER, vboIDs[0]);
         glVertexAttribPointer(aPtrPos, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
-        glBufferData(GL_ARRAY_BUFFER, numParticles*sizeof(glm::vec3), vboPos, GL_DYNAMIC_DRAW);
+        glBufferData(GL_ARRAY_BUFFER, capacity*sizeof(glm::vec3), vboPos, GL_DYNAMIC_DRAW);
         // Color buffer
         glBindBuffer(GL_ARRAY_BUFFER, vboIDs[1]);
         glVertexAttribPointer(aPtrCol, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
-        glBufferData(GL_ARRAY_BUFFER, numParticles*sizeof(glm::vec3), vboCol, GL_DYNAMIC_DRAW);
+        glBufferData(GL_ARRAY_BUFFER, capacity*sizeof(glm::vec3), vboCol, GL_DYNAMIC_DRAW);
+        // Size buffer
+        glBindBuffer(GL_ARRAY_BUFFER, vboIDs[2]);
+        glVertexAttribPointer(aPtrSize, 1, GL_FLOAT, GL_FALSE, 0, (void*)0);
+        glBufferData(GL_ARRAY_BUFFER, capacity*sizeof(float), vboSize, GL_DYNAMIC_DRAW);
         
         // Enable it's attribute pointers since they were set well
         glEnableVertexAttribArray(aPtrPos);
         glEnableVertexAttribArray(aPtrCol);
+        glEnableVertexAttribArray(aPtrSize);
         
         /** Set uniform **/
         glUseProgram(programID); // Active shader before set uniform
@@ -297,7 +417,7 @@ public:
         glUniformMatrix4fv(glGetUniformLocation(programID, "uniProjMatrix"), 1, GL_FALSE, &cam.uniProjMatrix[0][0]);
         
         /** Model Matrix : Put cloth into the world **/
-        glm::mat4 uniModelMatrix = glm::mat4(1.0f);
+        uniModelMatrix = glm::mat4(1.0f);
         uniModelMatrix = glm::translate(uniModelMatrix, glm::vec3(fluid->boundary->position.x, fluid->boundary->position.y, fluid->boundary->position.z));
         glUniformMatrix4fv(glGetUniformLocation(programID, "uniModelMatrix"), 1, GL_FALSE, &uniModelMatrix[0][0]);
         
@@ -312,11 +432,13 @@ public:
     ~FluidRender()
     {
         delete [] vboPos;
+        delete [] vboCol;
+        delete [] vboSize;
         
         if (vaoID)
         {
             glDeleteVertexArrays(1, &vaoID);
-            glDeleteBuffers(2, vboIDs);
+            glDeleteBuffers(3, vboIDs);
             vaoID = 0;
         }
         if (programID)
@@ -328,11 +450,18 @@ public:
     
     void flush()
     {
-        for (int i = 0; i < numParticles; i ++) {
-            Particle* p = fluid->particles[i];
-            vboPos[i] = glm::vec3(p->position.x, p->position.y, p->position.z);
-//            vboCol[i] = glm::vec3(p->color.x, p->color.y, p->color.z);
+        // Emitters, sinks and adaptive resolution change the number of particles every step
+        int count = (int)fluid->particles.size();
+        if (count > capacity) {
+            resize(std::max(capacity * 2, count));
+        } else if (fluid->compactions != compactions && count * 4 <= capacity && capacity > minCapacity) {
+            resize(std::max(count * 2, minCapacity));
         }
+        compactions = fluid->compactions;
+        
+        /** View Matrix : The camera **/
+        cam.uniViewMatrix = glm::lookAt(cam.pos, cam.pos + cam.front, cam.up);
+        numParticles = gather(cam.uniProjMatrix * cam.uniViewMatrix * uniModelMatrix);
         
         glUseProgram(programID);
         
@@ -342,9 +471,9 @@ public:
         glBufferSubData(GL_ARRAY_BUFFER, 0, numParticles*sizeof(glm::vec3), vboPos);
         glBindBuffer(GL_ARRAY_BUFFER, vboIDs[1]);
         glBufferSubData(GL_ARRAY_BUFFER, 0, numParticles*sizeof(glm::vec3), vboCol);
+        glBindBuffer(GL_ARRAY_BUFFER, vboIDs[2]);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, numParticles*sizeof(float), vboSize);
         
-        /** View Matrix : The camera **/
-        cam.uniViewMatrix = glm::lookAt(cam.pos, cam.pos + cam.front, cam.up);
         glUniformMatrix4fv(glGetUniformLocation(programID, "uniViewMatrix"), 1, GL_FALSE, &cam.uniViewMatrix[0][0]);
         
         glEnable(GL_BLEND);
@@ -352,15 +481,134 @@ public:
 //        glBlendFunc(GL_ONE, GL_ONE);
         
         /** Draw **/
-        glPointSize(fluid->particleSize);
+        glEnable(GL_PROGRAM_POINT_SIZE); // Sizes come from vboSize
         glDrawArrays(GL_POINTS, 0, numParticles);
         
         // End flushing
+        glDisable(GL_PROGRAM_POINT_SIZE);
         glDisable(GL_BLEND);
         glBindBuffer(GL_ARRAY_BUFFER, 0);
         glBindVertexArray(0);
         glUseProgram(0);
     }
+    
+private:
+    // Buffers for size particles, what they held is dropped, flush fills them again
+    void resize(int size)
+    {
+        delete [] vboPos;
+        delete [] vboCol;
+        delete [] vboSize;
+        vboPos = new glm::vec3[size];
+        vboCol = new glm::vec3[size];
+        vboSize = new float[size];
+        capacity = size;
+        reallocations ++;
+        
+        glBindBuffer(GL_ARRAY_BUFFER, vboIDs[0]);
+        glBufferData(GL_ARRAY_BUFFER, capacity*sizeof(glm::vec3), NULL, GL_DYNAMIC_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, vboIDs[1]);
+        glBufferData(GL_ARRAY_BUFFER, capacity*sizeof(glm::vec3), NULL, GL_DYNAMIC_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, vboIDs[2]);
+        glBufferData(GL_ARRAY_BUFFER, capacity*sizeof(float), NULL, GL_DYNAMIC_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+    
+    // Fill the buffers with what has to be drawn, return the number of points. Particles are taken cell by cell from
+    // the fluid's hash grid : cells whose box (grown by cellMargin, particles moved since hashing) is outside the
+    // frustum are skipped, cells beyond lodDistance become one impostor at the mean position and color of their
+    // particles, as wide as their particles would be packed together. In surfaceOnly mode cells inside the fluid are
+    // skipped too, that only costs a comparison per cell since the simulation counted their neighbors in parallel
+    // while computing density. Before the first step there is no grid yet and every particle is drawn.
+    int gather(const glm::mat4& clip)
+    {
+        const float cellMargin = 1.0f;
+        int count = (int)fluid->particles.size();
+        int gx = fluid->gridSize.x, gy = fluid->gridSize.y, gz = fluid->gridSize.z;
+        int hashed = 0;
+        for (int z = 0; z < gz; z ++) {
+            for (int y = 0; y < gy; y ++) {
+                for (int x = 0; x < gx; x ++) hashed += (int)fluid->hashGrid[z][y][x].size();
+            }
+        }
+        drawnParticles = drawnImpostors = culledCells = interiorCells = 0;
+        int n = 0;
+        if (hashed != count) {
+            for (int i = 0; i < count; i ++) add(n, fluid->particles[i]);
+            drawnParticles = n;
+            return n;
+        }
+        
+        // Planes of the frustum in particle coordinates : a point is inside when a*x + b*y + c*z + d >= 0 for all of them
+        glm::vec4 planes[6];
+        for (int i = 0; i < 3; i ++) {
+            for (int k = 0; k < 4; k ++) {
+                planes[2*i][k] = clip[k][3] + clip[k][i];
+                planes[2*i + 1][k] = clip[k][3] - clip[k][i];
+            }
+        }
+        int interior = (int)ceil(surfaceFraction * fluid->getFullNeighbors());
+        Vec3 origin = fluid->boundary->position;
+        glm::vec3 eye = cam.pos - glm::vec3(origin.x, origin.y, origin.z); // Camera in particle coordinates, see uniModelMatrix
+        for (int z = 0; z < gz; z ++) {
+            for (int y = 0; y < gy; y ++) {
+                for (int x = 0; x < gx; x ++) {
+                    const std::vector<Particle*>& cell = fluid->hashGrid[z][y][x];
+                    if (cell.empty()) continue;
+                    if (surfaceOnly && fluid->cellNeighbors[(z*gy + y)*gx + x] >= interior) {
+                        interiorCells ++;
+                        continue;
+                    }
+                    glm::vec3 low(origin.x + x - cellMargin, origin.y + y - cellMargin, origin.z + z - cellMargin);
+                    glm::vec3 high(origin.x + x + 1 + cellMargin, origin.y + y + 1 + cellMargin, origin.z + z + 1 + cellMargin);
+                    if (culling && !isVisible(planes, low, high)) {
+                        culledCells ++;
+                        continue;
+                    }
+                    glm::vec3 center(origin.x + x + 0.5f, origin.y + y + 0.5f, origin.z + z + 0.5f);
+                    glm::vec3 toCell = center - eye;
+                    if (lodDistance > 0 && glm::dot(toCell, toCell) > lodDistance * lodDistance) {
+                        Vec3 position(0, 0, 0), color(0, 0, 0);
+                        for (int i = 0; i < cell.size(); i ++) {
+                            position += cell[i]->position;
+                            color += fluid->getColor(cell[i]);
+                        }
+                        position = position / cell.size();
+                        color = color / cell.size();
+                        vboPos[n] = glm::vec3(position.x, position.y, position.z);
+                        vboCol[n] = glm::vec3(color.x, color.y, color.z);
+                        vboSize[n] = fluid->particleSize * cbrt((float)cell.size());
+                        n ++;
+                        drawnImpostors ++;
+                        continue;
+                    }
+                    for (int i = 0; i < cell.size(); i ++) add(n, cell[i]);
+                    drawnParticles += (int)cell.size();
+                }
+            }
+        }
+        return n;
+    }
+    void add(int& n, const Particle* p)
+    {
+        vboPos[n] = glm::vec3(p->position.x, p->position.y, p->position.z);
+        Vec3 color = fluid->getColor(p);
+        vboCol[n] = glm::vec3(color.x, color.y, color.z);
+        vboSize[n] = fluid->particleSize;
+        n ++;
+    }
+    // Box is outside when all its corners are behind one plane, testing the corner farthest along the plane's normal is enough
+    static bool isVisible(const glm::vec4* planes, glm::vec3 low, glm::vec3 high)
+    {
+        for (int i = 0; i < 6; i ++) {
+            const glm::vec4& plane = planes[i];
+            float x = plane.x >= 0 ? high.x : low.x;
+            float y = plane.y >= 0 ? high.y : low.y;
+            float z = plane.z >= 0 ? high.z : low.z;
+            if (plane.x * x + plane.y * y + plane.z * z + plane.w < 0) return false;
+        }
+        return true;
+    }
 };
 
 class RigidRender // Single color & Lighting
@@ -386,7 +634,7 @@ public:
         faces = f;
         vertexCount = (int)(faces.size());
         if (vertexCount <= 0) {
-            std::cout << "ERROR::RigidRender : No vertex exists." << std::endl;
+            Log::error("ERROR::RigidRender : No vertex exists.");
             exit(-1);
         }
         
@@ -403,7 +651,7 @@ public:
         /** Build render program **/
         Program program("Shaders/RigidVS.glsl", "Shaders/RigidFS.glsl");
         programID = program.ID;
-        std::cout << "Rigid Program ID: " << programID << std::endl;
+        Log::info("Rigid Program ID: %u", programID);
 
         // Generate ID of VAO and VBOs
         glGenVertexArrays(1, &vaoID);
@@ -508,6 +756,10 @@ public:
         ground = g;
         render = new RigidRender(ground->faces, ground->color, glm::vec3(ground->position.x, ground->position.y, ground->position.z));
     }
+    ~GroundRender()
+    {
+        delete render;
+    }
     
     void flush() { render->flush(); }
 };
@@ -522,6 +774,10 @@ struct BallRender
         ball = b;
         render = new RigidRender(ball->sphere->faces, ball->color, glm::vec3(ball->center.x, ball->center.y, ball->center.z));
     }
+    ~BallRender()
+    {
+        delete render;
+    }
     
     void flush() { render->flush(); }
 };
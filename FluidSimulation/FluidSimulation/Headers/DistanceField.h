@@ -0,0 +1,398 @@
+#pragma once
+
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <stdint.h>
+
+#include <math.h>
+
+#include "Point.h"
+#include "Collider.h"
+#include "Log.h"
+
+/** Signed distance field of a closed static triangle mesh, negative inside **/
+// Baked once on a voxel grid (exact distances near the surface, closest triangle propagated by sweeping,
+// sign by counting ray crossings along x), then optionally cached on disk.
+class DistanceField
+{
+public:
+    const int exactBand = 1; // Cells around each triangle where distance is computed exactly
+
+    Vec3 origin; // World coordinate of node (0, 0, 0)
+    double dx; // Node interval
+    int ni, nj, nk; // Number of nodes along x, y, z
+    std::vector<float> phi;
+
+public:
+    // faces : Every 3 vertexes make up a triangle, just like the faces of Sphere and Ground
+    // offset : Translation from mesh coordinates to world coordinates
+    DistanceField(const std::vector<Vertex*>& faces, Vec3 offset, double dx, int padding, const char* cachePath = NULL) : dx(dx)
+    {
+        if (faces.size() < 3 || faces.size() % 3 != 0) {
+            Log::error("DistanceField needs triangles.");
+            exit(-1);
+        }
+        if (dx <= 0) {
+            Log::error("DistanceField interval should be positive.");
+            exit(-1);
+        }
+
+        // World coordinates of all triangle corners
+        std::vector<Vec3> corners(faces.size());
+        Vec3 lower(DBL_MAX, DBL_MAX, DBL_MAX), upper(-DBL_MAX, -DBL_MAX, -DBL_MAX);
+        for (int i = 0; i < faces.size(); i ++) {
+            corners[i] = faces[i]->position + offset;
+            lower = Vec3(fmin(lower.x, corners[i].x), fmin(lower.y, corners[i].y), fmin(lower.z, corners[i].z));
+            upper = Vec3(fmax(upper.x, corners[i].x), fmax(upper.y, corners[i].y), fmax(upper.z, corners[i].z));
+        }
+        origin = lower - Vec3(padding*dx, padding*dx, padding*dx);
+        ni = (int)ceil((upper.x - lower.x) / dx) + 2*padding + 1;
+        nj = (int)ceil((upper.y - lower.y) / dx) + 2*padding + 1;
+        nk = (int)ceil((upper.z - lower.z) / dx) + 2*padding + 1;
+
+        uint64_t key = hashMesh(corners, padding);
+        if (cachePath && load(cachePath, key)) {
+            Log::info("DistanceField: %d x %d x %d loaded from %s", ni, nj, nk, cachePath);
+            return;
+        }
+        bake(corners);
+        Log::info("DistanceField: %d x %d x %d baked", ni, nj, nk);
+        if (cachePath) {
+            save(cachePath, key);
+        }
+    }
+    ~DistanceField() { }
+
+    // Triangles of an OBJ file, 3 corners each : "v x y z" vertexes and "f" faces of 3 or more of them (fanned),
+    // indexes may be negative (from the end) and carry /texture/normal parts
+    static bool readObj(const char* path, std::vector<Vertex>& corners)
+    {
+        FILE* file = fopen(path, "r");
+        if (!file) return false;
+        std::vector<Vec3> vertexes;
+        char line[1024];
+        bool ok = true;
+        while (ok && fgets(line, sizeof(line), file)) {
+            if (line[0] == 'v' && line[1] == ' ') {
+                double x, y, z;
+                ok = sscanf(line + 2, "%lf %lf %lf", &x, &y, &z) == 3;
+                vertexes.push_back(Vec3(x, y, z));
+            } else if (line[0] == 'f' && line[1] == ' ') {
+                std::vector<int> face;
+                for (char* token = strtok(line + 2, " \t\r\n"); token; token = strtok(NULL, " \t\r\n")) {
+                    int index = atoi(token);
+                    index = index < 0 ? (int)vertexes.size() + index : index - 1;
+                    ok &= index >= 0 && index < vertexes.size();
+                    face.push_back(index);
+                }
+                ok &= face.size() >= 3;
+                for (int i = 1; ok && i+1 < face.size(); i ++) {
+                    corners.push_back(Vertex(vertexes[face[0]]));
+                    corners.push_back(Vertex(vertexes[face[i]]));
+                    corners.push_back(Vertex(vertexes[face[i+1]]));
+                }
+            }
+        }
+        fclose(file);
+        return ok && !corners.empty();
+    }
+
+    Vec3 getLower() { return origin; }
+    Vec3 getUpper() { return origin + Vec3((ni-1)*dx, (nj-1)*dx, (nk-1)*dx); }
+
+    // Trilinear interpolation of distance and its gradient from the same 8 nodes
+    // Return false if pos is out of the field
+    bool sample(Vec3 pos, double& dist, Vec3& gradient)
+    {
+        double fi = (pos.x - origin.x) / dx;
+        double fj = (pos.y - origin.y) / dx;
+        double fk = (pos.z - origin.z) / dx;
+        if (fi < 0 || fj < 0 || fk < 0 || fi > ni-1 || fj > nj-1 || fk > nk-1) {
+            return false;
+        }
+        int i = fi < ni-1 ? (int)fi : ni-2;
+        int j = fj < nj-1 ? (int)fj : nj-2;
+        int k = fk < nk-1 ? (int)fk : nk-2;
+        double tx = fi - i, ty = fj - j, tz = fk - k;
+
+        double c000 = at(i, j, k), c100 = at(i+1, j, k), c010 = at(i, j+1, k), c110 = at(i+1, j+1, k);
+        double c001 = at(i, j, k+1), c101 = at(i+1, j, k+1), c011 = at(i, j+1, k+1), c111 = at(i+1, j+1, k+1);
+
+        double c00 = c000 + (c100-c000)*tx, c10 = c010 + (c110-c010)*tx;
+        double c01 = c001 + (c101-c001)*tx, c11 = c011 + (c111-c011)*tx;
+        double c0 = c00 + (c10-c00)*ty, c1 = c01 + (c11-c01)*ty;
+        dist = c0 + (c1-c0)*tz;
+
+        double dx00 = c100-c000, dx10 = c110-c010, dx01 = c101-c001, dx11 = c111-c011;
+        double gx = (dx00 + (dx10-dx00)*ty)*(1-tz) + (dx01 + (dx11-dx01)*ty)*tz;
+        double gy = (c10-c00)*(1-tz) + (c11-c01)*tz;
+        double gz = c1 - c0;
+        gradient = Vec3(gx, gy, gz) / dx;
+        return true;
+    }
+
+private:
+    float& at(int i, int j, int k) { return phi[i + ni*(j + nj*k)]; }
+    Vec3 nodePos(int i, int j, int k) { return origin + Vec3(i*dx, j*dx, k*dx); }
+
+    void bake(const std::vector<Vec3>& corners)
+    {
+        int numTriangles = (int)corners.size() / 3;
+        phi.assign(ni*nj*nk, (float)((ni+nj+nk)*dx));
+        std::vector<int> closest(ni*nj*nk, -1);
+        std::vector<int> crossings(ni*nj*nk, 0);
+
+        for (int t = 0; t < numTriangles; t ++) {
+            Vec3 p = corners[t*3], q = corners[t*3+1], r = corners[t*3+2];
+            // Grid coordinates of the corners
+            double fip = (p.x-origin.x)/dx, fjp = (p.y-origin.y)/dx, fkp = (p.z-origin.z)/dx;
+            double fiq = (q.x-origin.x)/dx, fjq = (q.y-origin.y)/dx, fkq = (q.z-origin.z)/dx;
+            double fir = (r.x-origin.x)/dx, fjr = (r.y-origin.y)/dx, fkr = (r.z-origin.z)/dx;
+
+            // Exact distances in the band around triangle
+            int i0 = clampIndex((int)fmin(fip, fmin(fiq, fir)) - exactBand, ni), i1 = clampIndex((int)fmax(fip, fmax(fiq, fir)) + exactBand + 1, ni);
+            int j0 = clampIndex((int)fmin(fjp, fmin(fjq, fjr)) - exactBand, nj), j1 = clampIndex((int)fmax(fjp, fmax(fjq, fjr)) + exactBand + 1, nj);
+            int k0 = clampIndex((int)fmin(fkp, fmin(fkq, fkr)) - exactBand, nk), k1 = clampIndex((int)fmax(fkp, fmax(fkq, fkr)) + exactBand + 1, nk);
+            for (int k = k0; k <= k1; k ++) {
+                for (int j = j0; j <= j1; j ++) {
+                    for (int i = i0; i <= i1; i ++) {
+                        double d = pointTriangleDistance(nodePos(i, j, k), p, q, r);
+                        if (d < at(i, j, k)) {
+                            at(i, j, k) = (float)d;
+                            closest[i + ni*(j + nj*k)] = t;
+                        }
+                    }
+                }
+            }
+
+            // Crossings of the grid lines along x, for the sign
+            j0 = (int)ceil(fmin(fjp, fmin(fjq, fjr)));
+            j1 = (int)floor(fmax(fjp, fmax(fjq, fjr)));
+            k0 = (int)ceil(fmin(fkp, fmin(fkq, fkr)));
+            k1 = (int)floor(fmax(fkp, fmax(fkq, fkr)));
+            for (int k = k0 > 0 ? k0 : 0; k <= k1 && k < nk; k ++) {
+                for (int j = j0 > 0 ? j0 : 0; j <= j1 && j < nj; j ++) {
+                    double a, b, c;
+                    if (pointInTriangle2D(j, k, fjp, fkp, fjq, fkq, fjr, fkr, a, b, c)) {
+                        double fi = a*fip + b*fiq + c*fir;
+                        int iCross = (int)ceil(fi);
+                        if (iCross < 0) {
+                            crossings[ni*(j + nj*k)] ++;
+                        } else if (iCross < ni) {
+                            crossings[iCross + ni*(j + nj*k)] ++;
+                        }
+                    }
+                }
+            }
+        }
+
+        // Propagate closest triangles through the rest of grid
+        for (int pass = 0; pass < 2; pass ++) {
+            sweep(corners, closest, +1, +1, +1);
+            sweep(corners, closest, -1, -1, -1);
+            sweep(corners, closest, +1, +1, -1);
+            sweep(corners, closest, -1, -1, +1);
+            sweep(corners, closest, +1, -1, +1);
+            sweep(corners, closest, -1, +1, -1);
+            sweep(corners, closest, +1, -1, -1);
+            sweep(corners, closest, -1, +1, +1);
+        }
+
+        // Odd number of crossings before a node means it's inside
+        for (int k = 0; k < nk; k ++) {
+            for (int j = 0; j < nj; j ++) {
+                int total = 0;
+                for (int i = 0; i < ni; i ++) {
+                    total += crossings[i + ni*(j + nj*k)];
+                    if (total % 2 == 1) {
+                        at(i, j, k) = -at(i, j, k);
+                    }
+                }
+            }
+        }
+    }
+    void sweep(const std::vector<Vec3>& corners, std::vector<int>& closest, int di, int dj, int dk)
+    {
+        int i0 = di > 0 ? 1 : ni-2, i1 = di > 0 ? ni : -1;
+        int j0 = dj > 0 ? 1 : nj-2, j1 = dj > 0 ? nj : -1;
+        int k0 = dk > 0 ? 1 : nk-2, k1 = dk > 0 ? nk : -1;
+        for (int k = k0; k != k1; k += dk) {
+            for (int j = j0; j != j1; j += dj) {
+                for (int i = i0; i != i1; i += di) {
+                    Vec3 pos = nodePos(i, j, k);
+                    checkNeighbor(corners, closest, pos, i, j, k, i-di, j, k);
+                    checkNeighbor(corners, closest, pos, i, j, k, i, j-dj, k);
+                    checkNeighbor(corners, closest, pos, i, j, k, i-di, j-dj, k);
+                    checkNeighbor(corners, closest, pos, i, j, k, i, j, k-dk);
+                    checkNeighbor(corners, closest, pos, i, j, k, i-di, j, k-dk);
+                    checkNeighbor(corners, closest, pos, i, j, k, i, j-dj, k-dk);
+                    checkNeighbor(corners, closest, pos, i, j, k, i-di, j-dj, k-dk);
+                }
+            }
+        }
+    }
+    void checkNeighbor(const std::vector<Vec3>& corners, std::vector<int>& closest, Vec3 pos, int i, int j, int k, int ni0, int nj0, int nk0)
+    {
+        int t = closest[ni0 + ni*(nj0 + nj*nk0)];
+        if (t < 0) return;
+        double d = pointTriangleDistance(pos, corners[t*3], corners[t*3+1], corners[t*3+2]);
+        if (d < at(i, j, k)) {
+            at(i, j, k) = (float)d;
+            closest[i + ni*(j + nj*k)] = t;
+        }
+    }
+
+    static int clampIndex(int i, int n) { return i < 0 ? 0 : (i >= n ? n-1 : i); }
+
+    static double pointTriangleDistance(Vec3 x, Vec3 a, Vec3 b, Vec3 c)
+    {
+        // Closest point by Voronoi regions of the triangle
+        Vec3 ab = b - a, ac = c - a, ax = x - a;
+        double d1 = Vec3::Dot(ab, ax), d2 = Vec3::Dot(ac, ax);
+        if (d1 <= 0 && d2 <= 0) return ax.len();
+
+        Vec3 bx = x - b;
+        double d3 = Vec3::Dot(ab, bx), d4 = Vec3::Dot(ac, bx);
+        if (d3 >= 0 && d4 <= d3) return bx.len();
+
+        double vc = d1*d4 - d3*d2;
+        if (vc <= 0 && d1 >= 0 && d3 <= 0) {
+            return (x - (a + ab*(d1/(d1-d3)))).len();
+        }
+
+        Vec3 cx = x - c;
+        double d5 = Vec3::Dot(ab, cx), d6 = Vec3::Dot(ac, cx);
+        if (d6 >= 0 && d5 <= d6) return cx.len();
+
+        double vb = d5*d2 - d1*d6;
+        if (vb <= 0 && d2 >= 0 && d6 <= 0) {
+            return (x - (a + ac*(d2/(d2-d6)))).len();
+        }
+
+        double va = d3*d6 - d5*d4;
+        if (va <= 0 && (d4-d3) >= 0 && (d5-d6) >= 0) {
+            return (x - (b + (c-b)*((d4-d3)/((d4-d3)+(d5-d6))))).len();
+        }
+
+        double denom = 1.0 / (va + vb + vc);
+        return (x - (a + ab*(vb*denom) + ac*(vc*denom))).len();
+    }
+
+    // Orientation with consistent tie breaking, so a grid line through a shared edge is counted exactly once
+    static int orientation(double x1, double y1, double x2, double y2, double& twiceSignedArea)
+    {
+        twiceSignedArea = y1*x2 - x1*y2;
+        if (twiceSignedArea > 0) return 1;
+        if (twiceSignedArea < 0) return -1;
+        if (y2 > y1) return 1;
+        if (y2 < y1) return -1;
+        if (x1 > x2) return 1;
+        if (x1 < x2) return -1;
+        return 0;
+    }
+    static bool pointInTriangle2D(double x0, double y0, double x1, double y1, double x2, double y2, double x3, double y3, double& a, double& b, double& c)
+    {
+        x1 -= x0; x2 -= x0; x3 -= x0;
+        y1 -= y0; y2 -= y0; y3 -= y0;
+        int signA = orientation(x2, y2, x3, y3, a);
+        if (signA == 0) return false;
+        int signB = orientation(x3, y3, x1, y1, b);
+        if (signB != signA) return false;
+        int signC = orientation(x1, y1, x2, y2, c);
+        if (signC != signA) return false;
+        double sum = a + b + c;
+        if (sum == 0) return false;
+        a /= sum;
+        b /= sum;
+        c /= sum;
+        return true;
+    }
+
+    /** Disk cache **/
+    uint64_t hashMesh(const std::vector<Vec3>& corners, int padding)
+    {
+        // FNV-1a over everything the field depends on
+        uint64_t h = 14695981039346656037ULL;
+        for (int i = 0; i < corners.size(); i ++) {
+            h = hashBytes(h, &corners[i].x, sizeof(double));
+            h = hashBytes(h, &corners[i].y, sizeof(double));
+            h = hashBytes(h, &corners[i].z, sizeof(double));
+        }
+        h = hashBytes(h, &dx, sizeof(dx));
+        h = hashBytes(h, &padding, sizeof(padding));
+        return h;
+    }
+    static uint64_t hashBytes(uint64_t h, const void* data, size_t size)
+    {
+        const unsigned char* bytes = (const unsigned char*)data;
+        for (size_t i = 0; i < size; i ++) {
+            h ^= bytes[i];
+            h *= 1099511628211ULL;
+        }
+        return h;
+    }
+    bool load(const char* path, uint64_t key)
+    {
+        FILE* file = fopen(path, "rb");
+        if (!file) return false;
+
+        char magic[4];
+        uint64_t fileKey;
+        int dims[3];
+        bool ok = fread(magic, 1, 4, file) == 4 && memcmp(magic, "SDF1", 4) == 0 &&
+                  fread(&fileKey, sizeof(fileKey), 1, file) == 1 && fileKey == key &&
+                  fread(dims, sizeof(int), 3, file) == 3 && dims[0] == ni && dims[1] == nj && dims[2] == nk;
+        if (ok) {
+            phi.resize(ni*nj*nk);
+            ok = fread(&phi[0], sizeof(float), phi.size(), file) == phi.size();
+        }
+        fclose(file);
+        if (!ok) phi.clear();
+        return ok;
+    }
+    void save(const char* path, uint64_t key)
+    {
+        FILE* file = fopen(path, "wb");
+        if (!file) {
+            Log::error("DistanceField: can't write cache %s", path);
+            return;
+        }
+        int dims[3] = { ni, nj, nk };
+        fwrite("SDF1", 1, 4, file);
+        fwrite(&key, sizeof(key), 1, file);
+        fwrite(dims, sizeof(int), 3, file);
+        fwrite(&phi[0], sizeof(float), phi.size(), file);
+        fclose(file);
+    }
+};
+
+class DistanceFieldCollider : public Collider
+{
+public:
+    DistanceField* field; // Owned by the collider
+
+    DistanceFieldCollider(DistanceField* field) : field(field) { }
+    ~DistanceFieldCollider() { delete field; }
+
+    void getBounds(double margin, Vec3& lower, Vec3& upper)
+    {
+        lower = field->getLower();
+        upper = field->getUpper();
+    }
+    bool resolve(Vec3& pos, double margin)
+    {
+        double dist;
+        Vec3 gradient;
+        if (!field->sample(pos, dist, gradient) || dist >= margin) {
+            return false;
+        }
+        double gradLen = gradient.len();
+        if (gradLen < 0.00001) {
+            return false;
+        }
+        pos += gradient * ((margin - dist) / gradLen);
+        return true;
+    }
+};
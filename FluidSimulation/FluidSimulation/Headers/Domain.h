@@ -0,0 +1,276 @@
+#pragma once
+
+#ifdef FLUID_USE_MPI
+
+#include <mpi.h>
+
+#include <vector>
+#include <cstdio>
+
+#include "Fluid.h"
+#include "Collider.h"
+
+/** Slab decomposition of the boundary over MPI ranks **/
+// Every rank owns the particles in a range of grid cells along the longest axis of boundary.
+// Before density and force, particles within kernel range of another slab are sent there as ghosts,
+// after integration particles that left the slab migrate to their new owner.
+class DomainDecomposition
+{
+public:
+    const int reportFreq = 100; // Steps between load imbalance reports
+
+    Fluid* fluid;
+    int rank;
+    int numRanks;
+
+private:
+    struct PackedParticle // Everything a particle needs to live in another process
+    {
+        int index, origin;
+        double mass, density, radius;
+        double position[3], velocity[3];
+    };
+
+    int haloCells; // Width of halo in grid cells
+    std::vector<int> cellOwner; // Rank owning each cell along the split axis
+    std::vector< std::vector<Particle*> > haloSend; // Particles sent to each rank as ghosts this step
+    std::vector<Particle> ghostStorage;
+
+    int steps;
+    double computeTime, exchangeTime; // Since last report
+
+public:
+    // Subdomain owned by this rank, construct the local Fluid with it
+    static Subdomain split(Boundary* boundary, int rank, int numRanks)
+    {
+        Vec3 size = boundary->size;
+        int axis = (size.x >= size.y && size.x >= size.z) ? 0 : (size.y >= size.z ? 1 : 2);
+        int cells = axis == 0 ? (int)size.x : (axis == 1 ? (int)size.y : (int)size.z);
+        if (cells < numRanks) {
+            printf("DomainDecomposition: %d cells can't be split into %d slabs.\n", cells, numRanks);
+            MPI_Abort(MPI_COMM_WORLD, -1);
+        }
+        int cellBegin = cells * rank / numRanks;
+        int cellEnd = cells * (rank+1) / numRanks;
+        return Subdomain(axis, cellBegin, cellEnd);
+    }
+
+    DomainDecomposition(Fluid* fluid) : fluid(fluid), steps(0), computeTime(0), exchangeTime(0)
+    {
+        MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+        MPI_Comm_size(MPI_COMM_WORLD, &numRanks);
+        haloCells = fluid->getNeighborRange();
+        haloSend.resize(numRanks);
+        for (int r = 0; r < numRanks; r ++) {
+            Subdomain sub = split(fluid->boundary, r, numRanks);
+            cellOwner.resize(sub.cellEnd, r);
+        }
+        int me = rank;
+        fluid->countSinkCandidates = [me](int count, int& before, int& total) { // Sinks spend one budget over all ranks
+            MPI_Exscan(&count, &before, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+            if (me == 0) before = 0; // Exscan leaves rank 0's undefined
+            MPI_Allreduce(&count, &total, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+        };
+
+        int total = 0, local = (int)fluid->particles.size();
+        MPI_Reduce(&local, &total, 1, MPI_INT, MPI_SUM, 0, MPI_COMM_WORLD);
+        if (rank == 0) {
+            printf("DomainDecomposition: %d ranks, %d particles, slabs along %c\n", numRanks, total, "xyz"[fluid->subdomain.axis]);
+        }
+    }
+    ~DomainDecomposition() { fluid->countSinkCandidates = nullptr; }
+
+    void update(float timestep, Vec3 gravity, ColliderSet* colliders)
+    {
+        double t0 = MPI_Wtime();
+        if (!fluid->emitters.empty() || !fluid->sinks.empty()) { // Before the halo, so ghosts see what was spawned
+            fluid->updateSources(timestep);
+        }
+        exchangeHalo();
+        double t1 = MPI_Wtime();
+        fluid->makeHashTable();
+        fluid->computeDensity();
+        double t2 = MPI_Wtime();
+        exchangeDensity();
+        double t3 = MPI_Wtime();
+        fluid->computeForce();
+        fluid->integrate(timestep, gravity, colliders);
+        double t4 = MPI_Wtime();
+        migrate();
+        double t5 = MPI_Wtime();
+
+        computeTime += (t2-t1) + (t4-t3);
+        exchangeTime += (t1-t0) + (t3-t2) + (t5-t4);
+        steps ++;
+        fluid->stepDone(timestep);
+        if (fluid->placeInterval > 0 && steps % fluid->placeInterval == 0) { // Migrated particles were allocated by this thread
+            fluid->placeParticles();
+        }
+        if (steps % reportFreq == 0) {
+            report();
+        }
+    }
+
+    // Particles sinks removed over all ranks, on every rank
+    long long sinkRemoved()
+    {
+        long long local = fluid->sinkRemoved, total = 0;
+        MPI_Allreduce(&local, &total, 1, MPI_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+        return total;
+    }
+
+    // Print particle count and compute time of every rank, imbalance is max / mean
+    void report()
+    {
+        double local[2] = { (double)fluid->particles.size(), computeTime };
+        std::vector<double> all(numRanks*2);
+        MPI_Gather(local, 2, MPI_DOUBLE, &all[0], 2, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+        double exchangeMax = 0;
+        MPI_Reduce(&exchangeTime, &exchangeMax, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+
+        if (rank == 0) {
+            double countSum = 0, countMax = 0, timeSum = 0, timeMax = 0;
+            printf("DomainDecomposition: step %d\n", steps);
+            for (int r = 0; r < numRanks; r ++) {
+                double count = all[r*2], time = all[r*2+1];
+                printf("\trank %d : %d particles, %f s compute\n", r, (int)count, time);
+                countSum += count;
+                timeSum += time;
+                countMax = fmax(countMax, count);
+                timeMax = fmax(timeMax, time);
+            }
+            printf("\timbalance : particles %f, compute %f, max exchange %f s\n",
+                   countSum > 0 ? countMax / (countSum/numRanks) : 1.0, timeSum > 0 ? timeMax / (timeSum/numRanks) : 1.0, exchangeMax);
+        }
+        computeTime = 0;
+        exchangeTime = 0;
+    }
+
+private:
+    int getCell(Particle* p)
+    {
+        int gridX, gridY, gridZ;
+        fluid->getGridCoord(p->position, gridX, gridY, gridZ);
+        int axis = fluid->subdomain.axis;
+        return axis == 0 ? gridX : (axis == 1 ? gridY : gridZ);
+    }
+    int getOwner(int cell) { return cellOwner[cell]; }
+
+    static PackedParticle pack(Particle* p)
+    {
+        PackedParticle packed;
+        packed.index = p->index;
+        packed.origin = p->origin;
+        packed.mass = p->mass;
+        packed.density = p->density;
+        packed.radius = p->radius;
+        packed.position[0] = p->position.x; packed.position[1] = p->position.y; packed.position[2] = p->position.z;
+        packed.velocity[0] = p->velocity.x; packed.velocity[1] = p->velocity.y; packed.velocity[2] = p->velocity.z;
+        return packed;
+    }
+    static void unpack(const PackedParticle& packed, Particle* p)
+    {
+        *p = Particle(packed.index, Vec3(packed.position[0], packed.position[1], packed.position[2]));
+        p->origin = packed.origin;
+        p->mass = packed.mass;
+        p->density = packed.density;
+        p->radius = packed.radius;
+        p->velocity = Vec3(packed.velocity[0], packed.velocity[1], packed.velocity[2]);
+    }
+
+    // Send a list of items to every rank, and receive what every rank sends here
+    template <typename T>
+    void exchange(std::vector< std::vector<T> >& send, std::vector<T>& recv)
+    {
+        std::vector<int> sendCounts(numRanks), recvCounts(numRanks), sendDispls(numRanks), recvDispls(numRanks);
+        std::vector<T> sendBuffer;
+        for (int r = 0; r < numRanks; r ++) {
+            sendCounts[r] = (int)(send[r].size() * sizeof(T));
+            sendDispls[r] = (int)(sendBuffer.size() * sizeof(T));
+            sendBuffer.insert(sendBuffer.end(), send[r].begin(), send[r].end());
+        }
+        MPI_Alltoall(&sendCounts[0], 1, MPI_INT, &recvCounts[0], 1, MPI_INT, MPI_COMM_WORLD);
+        int recvBytes = 0;
+        for (int r = 0; r < numRanks; r ++) {
+            recvDispls[r] = recvBytes;
+            recvBytes += recvCounts[r];
+        }
+        recv.resize(recvBytes / sizeof(T));
+        MPI_Alltoallv(sendBuffer.empty() ? NULL : &sendBuffer[0], &sendCounts[0], &sendDispls[0], MPI_BYTE,
+                      recv.empty() ? NULL : &recv[0], &recvCounts[0], &recvDispls[0], MPI_BYTE, MPI_COMM_WORLD);
+    }
+
+    // Ghosts are received in rank order, and the same order is kept by exchangeDensity()
+    void exchangeHalo()
+    {
+        std::vector< std::vector<PackedParticle> > send(numRanks);
+        for (int r = 0; r < numRanks; r ++) haloSend[r].clear();
+
+        for (int i = 0; i < fluid->particles.size(); i ++) {
+            Particle* p = fluid->particles[i];
+            int cell = getCell(p);
+            // Every other rank owning a cell within kernel range needs this particle
+            int lastOwner = -1;
+            for (int c = cell - haloCells; c <= cell + haloCells; c ++) {
+                if (c < 0 || c >= cellOwner.size()) continue;
+                int owner = getOwner(c);
+                if (owner == rank || owner == lastOwner) continue;
+                lastOwner = owner;
+                send[owner].push_back(pack(p));
+                haloSend[owner].push_back(p);
+            }
+        }
+
+        std::vector<PackedParticle> recv;
+        exchange(send, recv);
+
+        ghostStorage.resize(recv.size());
+        fluid->ghosts.resize(recv.size());
+        for (int i = 0; i < recv.size(); i ++) {
+            unpack(recv[i], &ghostStorage[i]);
+            fluid->ghosts[i] = &ghostStorage[i];
+        }
+    }
+    void exchangeDensity()
+    {
+        std::vector< std::vector<double> > send(numRanks);
+        for (int r = 0; r < numRanks; r ++) {
+            for (int i = 0; i < haloSend[r].size(); i ++) {
+                send[r].push_back(haloSend[r][i]->density);
+            }
+        }
+
+        std::vector<double> recv;
+        exchange(send, recv);
+        for (int i = 0; i < recv.size(); i ++) {
+            fluid->ghosts[i]->density = recv[i];
+        }
+    }
+    void migrate()
+    {
+        std::vector< std::vector<PackedParticle> > send(numRanks);
+        std::vector<Particle*> kept;
+        for (int i = 0; i < fluid->particles.size(); i ++) {
+            Particle* p = fluid->particles[i];
+            int owner = getOwner(getCell(p));
+            if (owner == rank) {
+                kept.push_back(p);
+            } else {
+                send[owner].push_back(pack(p));
+                fluid->deleteParticle(p);
+            }
+        }
+
+        std::vector<PackedParticle> recv;
+        exchange(send, recv);
+        for (int i = 0; i < recv.size(); i ++) {
+            Particle* p = fluid->newParticle();
+            unpack(recv[i], p);
+            kept.push_back(p);
+        }
+        fluid->particles = kept;
+        fluid->ghosts.clear();
+    }
+};
+
+#endif
@@ -2,11 +2,23 @@
 
 #include <vector>
 #include <iostream>
+#include <limits.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <new>
+#include <memory>
+#include <functional>
 
 #include <math.h>
 
 #include "Point.h"
 #include "Rigid.h"
+#include "Collider.h"
+#include "Parallel.h"
+#include "Kernels.h"
+#include "TaskGraph.h"
+#include "Log.h"
 
 struct Boundary
 {
@@ -19,7 +31,7 @@ struct Boundary
     
     Boundary(Vec3 position, Vec3 size) : position(position), size(size) {
         if (size.x <= 0 || size.y <= 0 || size.z <= 0) {
-            std::cout << "Boundary size can't be negative." << std::endl;
+            Log::error("Boundary size can't be negative.");
             exit(-1);
         }
         
@@ -30,41 +42,227 @@ struct Boundary
         zMin = position.z;
         zMax = position.z + size.z;
         
-        printf("Boundary:\n");
-        printf("\tx(%f, %f) -> %f\n", xMin, xMax, size.x);
-        printf("\ty(%f, %f) -> %f\n", yMin, yMax, size.y);
-        printf("\tz(%f, %f) -> %f\n", zMin, zMax, size.z);
+        Log::info("Boundary:");
+        Log::info("\tx(%f, %f) -> %f", xMin, xMax, size.x);
+        Log::info("\ty(%f, %f) -> %f", yMin, yMax, size.y);
+        Log::info("\tz(%f, %f) -> %f", zMin, zMax, size.z);
     }
     ~Boundary() { }
 };
 
+struct Subdomain // Range of grid cells along one axis owned by this process
+{
+    int axis; // 0 : x, 1 : y, 2 : z
+    int cellBegin, cellEnd;
+    
+    Subdomain() : axis(0), cellBegin(0), cellEnd(INT_MAX) { }
+    Subdomain(int axis, int cellBegin, int cellEnd) : axis(axis), cellBegin(cellBegin), cellEnd(cellEnd) { }
+    
+    bool owns(int gridX, int gridY, int gridZ)
+    {
+        int cell = axis == 0 ? gridX : (axis == 1 ? gridY : gridZ);
+        return cell >= cellBegin && cell < cellEnd;
+    }
+};
+
+struct Emitter // Box spawning particles at a rate, like the fluid it's placed by its offset from boundary.position
+{
+    Vec3 offset;
+    Vec3 size;
+    Vec3 velocity; // Of every particle it spawns
+    double rate; // Particles per unit of simulation time
+    double due; // Fraction of a particle owed from earlier steps
+    int next; // Point of the box's lattice the next particle is spawned at, they are taken in turn
+    int cycle; // Times every point has been taken, shifts the lattice so particles don't land on the ones before
+    
+    Emitter(Vec3 offset, Vec3 size, Vec3 velocity, double rate) : offset(offset), size(size), velocity(velocity), rate(rate), due(0), next(0), cycle(0) { }
+};
+
+struct Sink // Box removing the particles that enter it
+{
+    Vec3 offset;
+    Vec3 size;
+    double rate; // Most particles removed per unit of simulation time, 0 : every particle inside
+    double due;
+    
+    Sink(Vec3 offset, Vec3 size, double rate = 0) : offset(offset), size(size), rate(rate), due(0) { }
+};
+
+struct FluidParams // Physical constants of a fluid, loaded from a scene file or left as defaults
+{
+    double gasConst;
+    double restDensity;
+    double viscosity;
+    double kernelRadius; // Grid cells are always 1 wide, neighbors are searched ceil(kernelRadius) cells away
+    int kernel; // KernelType
+    int kernelTable; // Intervals of the kernel table, 0 : kernels are computed
+    int sleepSteps; // Steps a cell and its neighbors have to stay quiet before it sleeps, 0 : cells never sleep
+    double sleepVelocity; // Quiet : every particle's speed and change of velocity in a step are below this
+    double sleepDensity; // and so is every change of density in a step, relative to rest density
+    int mergeMass; // Heaviest particle adaptive resolution makes, in initial particle masses, 1 : resolution is fixed
+    int mergeDistance; // Particles merge more than this many cells away from the surface and colliders, and split closer than this
+    double jitter; // Initial particles are moved off the lattice by up to this fraction of its spacing along each axis
+    int relaxSteps; // Then pushed apart this many times where they are closer than the spacing, see Fluid::relaxParticles
+    
+    FluidParams() : gasConst(50), restDensity(8), viscosity(0.8), kernelRadius(1.0), kernel(KERNEL_MULLER), kernelTable(0),
+                    sleepSteps(0), sleepVelocity(0.05), sleepDensity(0.01), mergeMass(1), mergeDistance(2), jitter(0), relaxSteps(0) { }
+    
+    bool isValid() const
+    {
+        return gasConst > 0 && restDensity > 0 && viscosity >= 0 && kernelRadius > 0 && kernel >= KERNEL_MULLER && kernel <= KERNEL_WENDLAND && kernelTable >= 0 &&
+               sleepSteps >= 0 && sleepVelocity >= 0 && sleepDensity >= 0 && mergeMass >= 1 && mergeDistance >= 1 && jitter >= 0 && relaxSteps >= 0;
+    }
+};
+
+struct FluidStats // Reductions over all particles
+{
+    int particles;
+    double kineticEnergy;
+    double maxSpeed;
+    double meanDensity;
+    Vec3 momentum;
+    int sleeping; // Particles in sleeping cells
+};
+
+enum FluidPhase // Phases of a step observers are told about
+{
+    PHASE_HASH,
+    PHASE_ADAPT,
+    PHASE_DENSITY,
+    PHASE_FORCE,
+    PHASE_INTEGRATE,
+    PHASE_TASKS, // Density, force and integration run together as a task graph
+    PHASE_SOURCES, // Emitters and sinks
+    NUM_PHASES
+};
+static const char* const phaseNames[NUM_PHASES] = { "hash", "adapt", "density", "force", "integrate", "tasks", "sources" };
+
+class Fluid;
+
+/** Observer of the phases and steps of a fluid **/
+// Called on the thread that runs the step, so they should return quickly
+class FluidObserver
+{
+public:
+    virtual ~FluidObserver() { }
+    virtual void phaseBegin(int phase) { }
+    virtual void phaseEnd(int phase) { }
+    virtual void stepDone(Fluid* fluid, double timestep) { }
+};
+
 class Fluid
 {
+    friend class SurfaceExtractor;
+    
 private:
     const int resolution = 2; // TODO: Renaming - resolution? particleRadius?
     const int iterationFreq = 10;
-    const int gasConst = 50;
-    const double restDensity = 8;
-    const double viscosity = 0.8;
-    const double kernelRadius = 1.0;
+    const double restitution = 0.5; // Of every particle against the boundary
+    std::vector<double> latticeX, latticeY, latticeZ; // Initial particle coordinates along each axis, index runs along x fastest
+    const double gasConst;
+    const double restDensity;
+    const double viscosity;
+    const double kernelRadius;
+    const int kernelType;
+    const int kernelTableSize;
+    const int sleepSteps;
+    const double sleepVelocity;
+    const double sleepDensity;
+    const int mergeMass;
+    const int mergeDistance;
 public:
     const int particleSize = 20;
     Boundary* boundary;
     Vec3 position; // Left bottom back point's init position of fluid cube
     Vec3 size; // Size of fluid cube
     std::vector<Particle*> particles;
+    std::vector<Particle*> ghosts; // Particles owned by other processes, they are neighbors but never updated here
+    Subdomain subdomain;
     Vec3 gridSize;
     std::vector< std::vector< std::vector< std::vector<Particle*> > > > hashGrid;
+    std::vector< std::vector< std::vector< std::vector<Particle*> > > > ghostGrid;
+    // Pressure plus viscosity of every particle in the hash grid, from computeForce to integrate. Cell by cell in grid order,
+    // the particles of cell c start at cellStart[c] in the order of hashGrid, so they stay out of the particles themselves.
+    std::vector<Vec3> forces;
+    std::vector<int> cellStart;
+    
+    KernelTable kernelTable; // Built on first use when kernelTableSize > 0, and again whenever the radius changes
+    
+    ThreadPool* threadPool; // Density and force are computed over grid rows in parallel, NULL runs on the calling thread
+    // Keep grid cells in particle index order and reduce stats in fixed chunks with compensated sums,
+    // so results don't depend on thread count, particle order or process split
+    bool deterministic;
+    bool taskGraph; // Update runs density, force and integration of blocks of cells as tasks without barriers between phases, see updateTasks
+    
+    /** Sleeping cells **/ // Only tracked when sleepSteps > 0, cells are indexed (z*gridSize.y + y)*gridSize.x + x
+    // A cell sleeps while it and every neighbor cell have been quiet for sleepSteps steps : its particles keep their
+    // cached density and aren't moved. It wakes as soon as a neighbor isn't quiet, or when colliders change.
+    std::vector<int> quietSteps; // Steps in a row each cell has been quiet, up to sleepSteps
+    std::vector<char> awake;
+    int sleepingParticles;
+    
+    double maxRadius; // Longest smoothing length of any particle, no neighbor is more than ceil(maxRadius) cells away
+    // Particles in the cells around each cell (itself included) when density was last computed on it, cells indexed like awake.
+    // Compared to getFullNeighbors it tells cells inside the fluid from cells at its surface or walls, see FluidRender.
+    std::vector<int> cellNeighbors;
+    
+    std::vector<FluidObserver*> observers; // Told when every phase begins and ends, and when a step is done
+    
+    /** Cell profile **/ // Cost of every cell in the last step when profileCells is set, cells indexed like awake, see CellProfiler
+    bool profileCells;
+    std::vector<int> cellParticles;
+    std::vector<double> cellPairs; // Pairs density and force looped over
+    std::vector<double> cellSeconds; // Time density and force spent on the cell, gathering neighbors included
+    
+    /** Step sample **/ // The density pass of a step started with sampleStep set also measures what getSample reduces
+    bool sampleStep;
+    
+    /** NUMA placement **/ // See placeParticles
+    int placeInterval; // Steps between placements in update, 0 : particles are never placed and rows of cells go to whichever thread is free
+    bool hugePages; // Placement advises transparent huge pages for the particles of every thread
+    
+    /** Emitters and sinks **/ // Run at the start of every update, see updateSources
+    std::vector<Emitter> emitters;
+    std::vector<Sink> sinks;
+    int compactions; // Times compactParticles ran, renderers give back spare buffer space after one
+    long long sinkRemoved; // Particles sinks removed from this process
+    // Candidates of a rate limited sink in other processes : given how many this process has, sets how many processes
+    // before it have and how many all have. Empty when this process is alone, see DomainDecomposition.
+    std::function<void(int count, int& before, int& total)> countSinkCandidates;
+    
+    /** Field arrays **/ // Contiguous copies of the particles for readers that want plain arrays, see getFields
+    struct ParticleFields
+    {
+        int step; // Steps the fluid had taken
+        std::vector<double> positions; // x, y, z of every particle, in the order of particles
+        std::vector<double> velocities;
+        std::vector<double> densities;
+        std::vector<int> indices;
+    };
+    std::shared_ptr<ParticleFields> fields; // Arrays of the last getFields, NULL until the first one
     
 public:
-    Fluid(Boundary* boundary, Vec3 size, Vec3 posOffset, Vec3 initV) : boundary(boundary), size(size)
+    // Only the particles inside subdomain are created, the default one is the whole boundary.
+    // threadPool creates them in parallel and is kept for update, it can be set later too.
+    Fluid(Boundary* boundary, Vec3 size, Vec3 posOffset, Vec3 initV, FluidParams params = FluidParams(), Subdomain subdomain = Subdomain(),
+          ThreadPool* threadPool = NULL)
+        : gasConst(params.gasConst), restDensity(params.restDensity), viscosity(params.viscosity),
+          kernelRadius(params.kernelRadius), kernelType(params.kernel), kernelTableSize(params.kernelTable),
+          sleepSteps(params.sleepSteps), sleepVelocity(params.sleepVelocity), sleepDensity(params.sleepDensity),
+          mergeMass(params.mergeMass), mergeDistance(params.mergeDistance),
+          boundary(boundary), size(size), subdomain(subdomain), threadPool(threadPool), deterministic(false), taskGraph(false),
+          sleepingParticles(0), maxRadius(params.kernelRadius), profileCells(false), sampleStep(false), placeInterval(0), hugePages(false), compactions(0), sinkRemoved(0), unusedSlots(0), tasksRange(-1), collidersRevision(-1), numSteps(0)
     {
         if (size.x <= 0 || size.y <= 0 || size.z <= 0) {
-            std::cout << "Fluid size can't be negative." << std::endl;
+            Log::error("Fluid size can't be negative.");
             exit(-1);
         }
         if (posOffset.x < 0 || posOffset.y < 0 || posOffset.z < 0) {
-            std::cout << "Fluid offset can't be negative." << std::endl;
+            Log::error("Fluid offset can't be negative.");
+            exit(-1);
+        }
+        if (!params.isValid()) {
+            Log::error("Fluid constants out of range.");
             exit(-1);
         }
         
@@ -77,65 +275,504 @@ public:
                 hashGrid[i][j].resize(gridSize.x);
             }
         }
+        ghostGrid = hashGrid;
+        int numCells = gridSize.x * gridSize.y * gridSize.z;
+        quietSteps.assign(numCells, 0);
+        awake.assign(numCells, 1);
+        densityChange.assign(numCells, 0.0);
+        velocityChange.assign(numCells, 0.0);
+        cellNeighbors.assign(numCells, 0);
+        cellStart.assign(numCells + 1, 0);
         
         // Get the world coordinate of fluid
         position = boundary->position + posOffset;
-        printf("Fluid:\n");
-        printf("\tx(%f, %f)\n", position.x, position.x+size.x);
-        printf("\ty(%f, %f)\n", position.y, position.y+size.y);
-        printf("\tz(%f, %f)\n", position.z, position.z+size.z);
+        Log::info("Fluid:");
+        Log::info("\tx(%f, %f)", position.x, position.x+size.x);
+        Log::info("\ty(%f, %f)", position.y, position.y+size.y);
+        Log::info("\tz(%f, %f)", position.z, position.z+size.z);
         if (position.x+size.x > boundary->xMax || position.y+size.y > boundary->yMax ||
             position.z+size.z > boundary->zMax)
         {
-            std::cout << "Fluid out of boundary." << std::endl;
+            Log::error("Fluid out of boundary.");
             exit(-1);
         }
         
-        initParticles(initV);
+        initParticles(initV, params.jitter);
+        relaxParticles(params.relaxSteps);
         
-        std::cout << "Fluid : " << particles.size() << " Paricles" << std::endl;
-        printf("\t(%f, %f, %f)\n", particles[0]->position.x, particles[0]->position.y, particles[0]->position.z);
+        Log::info("Fluid : %d Paricles, %d bytes each", (int)particles.size(), (int)sizeof(Particle));
+        if (!particles.empty()) {
+            Log::info("\t(%f, %f, %f)", particles[0]->position.x, particles[0]->position.y, particles[0]->position.z);
+        }
     }
-    ~Fluid()
+    ~Fluid() // Ghosts belong to whoever made them, see DomainDecomposition
     {
-        while (!particles.empty())
-        {
-            particles.pop_back();
-        }
+        for (int i = 0; i < blocks.size(); i ++) { ::operator delete(blocks[i].slots); }
+        blocks.clear();
         particles.clear();
+        freeParticles.clear();
     }
     
-    void update(float timestep, Vec3 gravity, Ball* ball)
+    void update(float timestep, Vec3 gravity, ColliderSet* colliders)
     {
+        if (!emitters.empty() || !sinks.empty()) {
+            updateSources(timestep);
+        }
+        if (placeInterval > 0 && numSteps > 0 && numSteps % placeInterval == 0) {
+            placeParticles();
+        }
         makeHashTable();
-        computeDensity();
-        computeForce();
-        integrate(timestep, gravity, ball);
+        if (mergeMass > 1 && numSteps % iterationFreq == 0) {
+            {
+                Phase phase(this, PHASE_ADAPT);
+                adaptResolution(colliders);
+            }
+            makeHashTable();
+        }
+        if (threadPool && taskGraph) {
+            updateTasks(timestep, gravity, colliders);
+        } else {
+            computeDensity();
+            computeForce();
+            integrate(timestep, gravity, colliders);
+        }
+        stepDone(timestep);
+    }
+    // Count the step and tell observers, for callers that run the phases themselves
+    void stepDone(double timestep)
+    {
+        numSteps ++;
+        if (numSteps % compactInterval == 0) {
+            compactParticles();
+        }
+        for (int i = 0; i < observers.size(); i ++) observers[i]->stepDone(this, timestep);
+    }
+    // Arrays of position, velocity, density and index of every particle at the current step. They are copied in parallel
+    // on the first call after a step, steps nobody asks for cost nothing. Arrays someone else still holds are left alone
+    // and replaced by new ones, so a reader keeps the step it took until it lets go. Call it between steps.
+    std::shared_ptr<ParticleFields> getFields()
+    {
+        if (fields && fields->step == numSteps) return fields;
+        std::shared_ptr<ParticleFields> next = fields && fields.use_count() == 1 ? fields : std::make_shared<ParticleFields>();
+        int count = (int)particles.size();
+        next->step = numSteps;
+        next->positions.resize((size_t)count * 3);
+        next->velocities.resize((size_t)count * 3);
+        next->densities.resize(count);
+        next->indices.resize(count);
+        parallelFor(count, [&](int begin, int end, int thread) {
+            for (int i = begin; i < end; i ++) {
+                const Particle* p = particles[i];
+                double* position = &next->positions[(size_t)i * 3];
+                double* velocity = &next->velocities[(size_t)i * 3];
+                position[0] = p->position.x; position[1] = p->position.y; position[2] = p->position.z;
+                velocity[0] = p->velocity.x; velocity[1] = p->velocity.y; velocity[2] = p->velocity.z;
+                next->densities[i] = p->density;
+                next->indices[i] = p->index;
+            }
+        });
+        fields = next;
+        return fields;
+    }
+    
+    void getGridCoord(Vec3 position, int& gridX, int& gridY, int& gridZ)
+    {
+        gridX = (int)(position.x - boundary->position.x);
+        gridY = (int)(position.y - boundary->position.y);
+        gridZ = (int)(position.z - boundary->position.z);
+
+        if (gridX < 0) gridX = 0;
+        if (gridX >= gridSize.x) gridX = gridSize.x - 1;
+        if (gridY < 0) gridY = 0;
+        if (gridY >= gridSize.y) gridY = gridSize.y - 1;
+        if (gridZ < 0) gridZ = 0;
+        if (gridZ >= gridSize.z) gridZ = gridSize.z - 1;
+    }
+    int getNeighborRange() { return (int)ceil(maxRadius); } // In grid cells
+    int getFullNeighbors() const // cellNeighbors of a cell deep in fluid at initial spacing, with the kernel radius of the fluid
+    {
+        int cells = 2 * (int)ceil(kernelRadius) + 1;
+        return cells*cells*cells * resolution*resolution*resolution;
+    }
+    double getRestDensity() { return restDensity; }
+    
+    // Color of a particle follows from where it started, particles made by splits keep the color of their origin
+    // and emitted ones take the color of the initial particle nearest to where they were spawned
+    Vec3 getColor(const Particle* p) const
+    {
+        int i = p->origin % latticeX.size();
+        int j = p->origin / latticeX.size() % latticeY.size();
+        int k = p->origin / latticeX.size() / latticeY.size();
+        return Vec3((latticeX[i]-boundary->position.x)/boundary->size.x*1.9, (latticeY[j]-boundary->position.y)/boundary->size.y/1.5, (latticeZ[k]-boundary->position.z)/boundary->size.z/1.2);
     }
 
 private:
-    void initParticles(Vec3 initV)
+    // The lattice fills the fluid box at 1 / resolution spacing, its size is known up front. Particle index runs along x fastest
+    // over the whole lattice, so it's the same whatever the process split. Only points in owned cells get a particle : ownership
+    // depends on one axis, so they are every combination of owned coordinates along each axis and particle t is found from t
+    // alone. Every thread of threadPool creates its own range of particles, and first touches their memory.
+    void initParticles(Vec3 initV, double jitter)
     {
-        int index = 0; // TODO: ?? necessery?
         double distInterval = 1.0 / resolution;
-        printf("Particle Interval: %f\n", distInterval);
-        for (double z = position.z; z < position.z+size.z; z += distInterval) {
-            for (double y = position.y; y < position.y+size.y; y += distInterval) {
-                for (double x = position.x; x < position.x+size.x; x += distInterval) {
-                    Particle *p = new Particle(index, Vec3((x-boundary->position.x)/boundary->size.x*1.9, (y-boundary->position.y)/boundary->size.y/1.5, (z-boundary->position.z)/boundary->size.z/1.2), Vec3(x, y, z)); // TODO: set color
-                    p->velocity = initV;
-                    particles.push_back(p);
-                    index ++;
+        Log::info("Particle Interval: %f", distInterval);
+        int counts[3] = { (int)ceil(size.x * resolution), (int)ceil(size.y * resolution), (int)ceil(size.z * resolution) };
+        latticeX.resize(counts[0]);
+        latticeY.resize(counts[1]);
+        latticeZ.resize(counts[2]);
+        for (int i = 0; i < counts[0]; i ++) latticeX[i] = position.x + i * distInterval;
+        for (int j = 0; j < counts[1]; j ++) latticeY[j] = position.y + j * distInterval;
+        for (int k = 0; k < counts[2]; k ++) latticeZ[k] = position.z + k * distInterval;
+        
+        std::vector<int> owned[3]; // Lattice coordinates along each axis of the cells this process owns
+        for (int a = 0; a < 3; a ++) {
+            for (int i = 0; i < counts[a]; i ++) {
+                int gridX, gridY, gridZ;
+                getGridCoord(Vec3(latticeX[a == 0 ? i : 0], latticeY[a == 1 ? i : 0], latticeZ[a == 2 ? i : 0]), gridX, gridY, gridZ);
+                if (a != subdomain.axis || subdomain.owns(gridX, gridY, gridZ)) owned[a].push_back(i);
+            }
+        }
+        int nx = (int)owned[0].size(), ny = (int)owned[1].size(), nz = (int)owned[2].size();
+        particles.resize(nx * ny * nz);
+        Particle* slots = particles.empty() ? NULL : allocateBlock((int)particles.size()); // One block, each thread touches its particles first
+        std::function<void(int, int, int)> fill = [&](int begin, int end, int thread) {
+            for (int t = begin; t < end; t ++) {
+                int i = owned[0][t % nx], j = owned[1][t / nx % ny], k = owned[2][t / nx / ny];
+                int index = (k*counts[1] + j)*counts[0] + i;
+                Vec3 point(latticeX[i], latticeY[j], latticeZ[k]);
+                if (jitter > 0) {
+                    point = clampToFluid(point + getJitter(index) * (jitter * distInterval));
                 }
+                Particle *p = new (&slots[t]) Particle(index, point);
+                p->velocity = initV;
+                p->radius = kernelRadius;
+                particles[t] = p;
             }
+        };
+        if (threadPool) {
+            threadPool->parallelFor((int)particles.size(), fill);
+        } else {
+            fill(0, (int)particles.size(), 0);
         }
+        nextIndex = counts[0] * counts[1] * counts[2]; // Keep index global among processes
+        baseMass = particles.empty() ? 1.0 : particles[0]->mass;
     }
+    // Every coordinate in [-1, 1), pseudo random from the particle index alone (splitmix64), so threads and processes agree
+    static Vec3 getJitter(int index)
+    {
+        double offsets[3];
+        uint64_t state = (uint64_t)index * 3;
+        for (int a = 0; a < 3; a ++) {
+            uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+            z ^= z >> 31;
+            offsets[a] = (z >> 11) * (2.0 / 9007199254740992.0) - 1.0;
+        }
+        return Vec3(offsets[0], offsets[1], offsets[2]);
+    }
+    Vec3 clampToFluid(Vec3 point)
+    {
+        return Vec3(fmin(fmax(point.x, position.x), position.x + size.x),
+                    fmin(fmax(point.y, position.y), position.y + size.y),
+                    fmin(fmax(point.z, position.z), position.z + size.z));
+    }
+    // Particles closer than the lattice spacing are pushed apart by half of the gap each, every move of a round is found
+    // before any is made. Neighbors come from the hash grid like density's, in parallel. Only particles of this process
+    // are seen, at a subdomain's faces the first steps finish the job.
+    void relaxParticles(int steps)
+    {
+        double spacing = 1.0 / resolution;
+        for (int s = 0; s < steps; s ++) {
+            makeHashTable();
+            forEachCell(-1, [this, spacing](int cell, std::vector<Particle*>& mine, std::vector<Particle*>& neighbors) {
+                for (int i = 0; i < mine.size(); i ++) {
+                    Particle* pi = mine[i];
+                    Vec3 push(0, 0, 0);
+                    for (int j = 0; j < neighbors.size(); j ++) {
+                        Vec3 diff = pi->position - neighbors[j]->position;
+                        double distance = diff.len();
+                        if (distance > 0 && distance < spacing) {
+                            push += diff * (0.5 * (spacing - distance) / distance);
+                        }
+                    }
+                    forces[cellStart[cell] + i] = push; // Free until the first computeForce
+                }
+            });
+            forEachHashed([this](Particle* p, const Vec3& push) { p->position = clampToFluid(p->position + push); });
+        }
+    }
+    
+public:
+    /** NUMA placement **/
+    // Memory is placed on the node of the thread that first touches it. Every thread copies the particles of its rows
+    // of cells into one block it allocates and touches, the old blocks and their free slots are released, and the grid
+    // cells of each block of rows are allocated again by their thread. Particles keep their order, results don't change.
+    // Pin the threads first (ThreadPool::pinThreads), update places particles again every placeInterval steps as they flow.
+    void placeParticles()
+    {
+        if (!threadPool) return;
+        int rows = gridSize.z * gridSize.y;
+        int numThreads = threadPool->numThreads;
+        std::vector<int> rowThread(rows);
+        for (int t = 0; t < numThreads; t ++) {
+            for (int r = ThreadPool::blockBegin(rows, t, numThreads); r < ThreadPool::blockBegin(rows, t+1, numThreads); r ++) rowThread[r] = t;
+        }
+        std::vector<int> owner(particles.size());
+        threadPool->parallelFor((int)particles.size(), [&](int begin, int end, int thread) {
+            for (int i = begin; i < end; i ++) {
+                int gridX, gridY, gridZ;
+                getGridCoord(particles[i]->position, gridX, gridY, gridZ);
+                owner[i] = rowThread[gridZ*(int)gridSize.y + gridY];
+            }
+        });
+        std::vector<ParticleBlock> placed(numThreads, ParticleBlock { NULL, 0 });
+        threadPool->run([&](int thread) {
+            int count = 0;
+            for (int i = 0; i < particles.size(); i ++) count += owner[i] == thread;
+            if (count > 0) {
+                placed[thread] = ParticleBlock { (Particle*)::operator new(count * sizeof(Particle)), count };
+                Particle* slot = placed[thread].slots;
+                for (int i = 0; i < particles.size(); i ++) {
+                    if (owner[i] != thread) continue;
+                    particles[i] = new (slot ++) Particle(*particles[i]);
+                }
+                if (hugePages) {
+                    Numa::adviseHugePages(placed[thread].slots, count * sizeof(Particle));
+                }
+            }
+            for (int r = ThreadPool::blockBegin(rows, thread, numThreads); r < ThreadPool::blockBegin(rows, thread+1, numThreads); r ++) {
+                int z = r / (int)gridSize.y, y = r % (int)gridSize.y;
+                for (int x = 0; x < gridSize.x; x ++) {
+                    reallocate(hashGrid[z][y][x]);
+                    reallocate(ghostGrid[z][y][x]);
+                }
+            }
+        });
+        for (int i = 0; i < blocks.size(); i ++) { ::operator delete(blocks[i].slots); }
+        blocks.clear();
+        for (int t = 0; t < numThreads; t ++) {
+            if (placed[t].count > 0) blocks.push_back(placed[t]);
+        }
+        freeParticles.clear();
+        unusedSlots = 0;
+    }
+    
+    // Print the node of every thread and how the pages of particles and grid cells are spread over nodes
+    void reportPlacement()
+    {
+        int numThreads = threadPool ? threadPool->numThreads : 1;
+        int rows = gridSize.z * gridSize.y;
+        printf("Numa: %d nodes, %d threads\n", Numa::numNodes(), numThreads);
+        for (int t = 0; t < numThreads; t ++) {
+            printf("\tthread %d : rows %d - %d", t, ThreadPool::blockBegin(rows, t, numThreads), ThreadPool::blockBegin(rows, t+1, numThreads) - 1);
+            if (threadPool && t < threadPool->cores.size()) {
+                printf(", core %d, node %d\n", threadPool->cores[t], Numa::nodeOfCpu(threadPool->cores[t]));
+            } else {
+                printf(", not pinned\n");
+            }
+        }
+        std::vector<const void*> addresses(particles.begin(), particles.end());
+        Numa::report("particles", addresses);
+        addresses.clear();
+        for (int i = 0; i < gridSize.z; i ++) {
+            for (int j = 0; j < gridSize.y; j ++) {
+                for (int k = 0; k < gridSize.x; k ++) {
+                    if (hashGrid[i][j][k].capacity() > 0) addresses.push_back(hashGrid[i][j][k].data());
+                }
+            }
+        }
+        Numa::report("grid cells", addresses);
+    }
+    
+private:
+    // Same contents and capacity in memory allocated by the calling thread
+    static void reallocate(std::vector<Particle*>& cell)
+    {
+        std::vector<Particle*> copy;
+        copy.reserve(std::max(cell.capacity(), (size_t)8));
+        copy.assign(cell.begin(), cell.end());
+        cell.swap(copy);
+    }
+    
+public:
+    /** Particle slots **/
+    // Particles live in blocks of slots : the initial ones in one block, the ones made later in blocks of blockSlots.
+    // Particles removed by sinks, merges and migration keep their slot in a free list, and particles made later
+    // take it from there before allocating, so a steady inflow and outflow doesn't allocate. Every compactInterval
+    // steps the blocks whose slots all stayed free the whole interval are released, and so is spare capacity of particles.
+    Particle* newParticle()
+    {
+        if (freeParticles.empty()) {
+            Particle* slots = allocateBlock(blockSlots);
+            for (int i = blockSlots - 1; i > 0; i --) freeParticles.push_back(&slots[i]); // Taken in address order
+            return &slots[0];
+        }
+        Particle* p = freeParticles.back();
+        freeParticles.pop_back();
+        unusedSlots = std::min(unusedSlots, (int)freeParticles.size());
+        return p;
+    }
+    void deleteParticle(Particle* p) { freeParticles.push_back(p); }
+    int getFreeSlots() { return (int)freeParticles.size(); }
+    
+    void compactParticles()
+    {
+        // Unused slots are the bottom of the stack, the most recently freed slots are on top
+        std::vector<ParticleBlock> sorted(blocks);
+        std::sort(sorted.begin(), sorted.end(), [](const ParticleBlock& a, const ParticleBlock& b) { return a.slots < b.slots; });
+        std::vector<int> unused(sorted.size(), 0);
+        for (int i = 0; i < unusedSlots; i ++) unused[findBlock(sorted, freeParticles[i])] ++;
+        int kept = 0;
+        for (int i = 0; i < freeParticles.size(); i ++) {
+            int b = findBlock(sorted, freeParticles[i]);
+            if (unused[b] < sorted[b].count) freeParticles[kept ++] = freeParticles[i];
+        }
+        freeParticles.resize(kept);
+        blocks.clear();
+        for (int b = 0; b < sorted.size(); b ++) {
+            if (unused[b] == sorted[b].count) ::operator delete(sorted[b].slots);
+            else blocks.push_back(sorted[b]);
+        }
+        unusedSlots = (int)freeParticles.size();
+        if (particles.capacity() > 2 * particles.size() + 64) {
+            std::vector<Particle*>(particles).swap(particles);
+        }
+        compactions ++;
+    }
+    
+    /** Emitters and sinks **/
+    // Sinks remove the particles inside them, then emitters spawn theirs on the lattice of their box. Only cells owned
+    // by subdomain get particles, but every process walks the same lattice points, so together they spawn what a single
+    // process would with the same indices. A rate limited sink's budget is shared the same way : processes take it in
+    // rank order, each up to its own candidates. Cells that gain or lose particles wake up.
+    void updateSources(double timestep)
+    {
+        Phase phase(this, PHASE_SOURCES);
+        if (!sinks.empty()) {
+            std::vector<char> removed(particles.size(), 0);
+            for (int s = 0; s < sinks.size(); s ++) { // A particle inside several sinks goes to the first one with budget left
+                Sink& sink = sinks[s];
+                std::vector<int> inside;
+                for (int i = 0; i < particles.size(); i ++) {
+                    if (!removed[i] && isInside(particles[i]->position, sink.offset, sink.size)) inside.push_back(i);
+                }
+                int take = (int)inside.size();
+                if (sink.rate > 0) {
+                    sink.due += sink.rate * timestep;
+                    int budget = (int)sink.due;
+                    int before = 0, total = take;
+                    if (countSinkCandidates) countSinkCandidates(take, before, total);
+                    take = std::min(std::max(budget - before, 0), take);
+                    sink.due = fmin(sink.due - std::min(budget, total), 1.0); // Nothing saved up while the sink is empty
+                }
+                for (int n = 0; n < take; n ++) removed[inside[n]] = 1;
+            }
+            int kept = 0;
+            for (int i = 0; i < particles.size(); i ++) {
+                Particle* p = particles[i];
+                if (!removed[i]) {
+                    particles[kept ++] = p;
+                    continue;
+                }
+                sinkRemoved ++;
+                wakeCell(p->position);
+                deleteParticle(p);
+            }
+            particles.resize(kept);
+        }
+        
+        double spacing = 1.0 / resolution;
+        for (int e = 0; e < emitters.size(); e ++) {
+            Emitter& emitter = emitters[e];
+            int nx = std::max((int)ceil(emitter.size.x * resolution), 1);
+            int ny = std::max((int)ceil(emitter.size.y * resolution), 1);
+            int nz = std::max((int)ceil(emitter.size.z * resolution), 1);
+            emitter.due += emitter.rate * timestep;
+            int count = (int)emitter.due;
+            emitter.due -= count;
+            for (int n = 0; n < count; n ++) {
+                int i = emitter.next % nx, j = emitter.next / nx % ny, k = emitter.next / nx / ny;
+                double shift = spacing * 0.5 * (fmod(emitter.cycle * 0.6180339887, 1.0) - 0.5);
+                Vec3 pos = boundary->position + emitter.offset + Vec3((i + 0.5) * spacing + shift, (j + 0.5) * spacing + shift, (k + 0.5) * spacing + shift);
+                if (++ emitter.next == nx * ny * nz) {
+                    emitter.next = 0;
+                    emitter.cycle ++;
+                }
+                int index = nextIndex ++; // Keep index global among processes
+                int gridX, gridY, gridZ;
+                getGridCoord(pos, gridX, gridY, gridZ);
+                if (!subdomain.owns(gridX, gridY, gridZ)) {
+                    continue;
+                }
+                Particle* p = newParticle();
+                *p = Particle(index, pos);
+                p->velocity = emitter.velocity;
+                p->radius = kernelRadius;
+                p->origin = getLatticeIndex(pos);
+                particles.push_back(p);
+                wakeCell(pos);
+            }
+        }
+    }
+    
+private:
+    const int compactInterval = 100;
+    const int blockSlots = 256;
+    struct ParticleBlock { Particle* slots; int count; };
+    std::vector<ParticleBlock> blocks;
+    std::vector<Particle*> freeParticles;
+    int unusedSlots; // Fewest free slots since the last compaction, those were never needed
+    
+    // Raw memory for count particles, released with the block
+    Particle* allocateBlock(int count)
+    {
+        Particle* slots = (Particle*)::operator new(count * sizeof(Particle));
+        blocks.push_back(ParticleBlock { slots, count });
+        return slots;
+    }
+    // Block of sorted that holds p
+    static int findBlock(const std::vector<ParticleBlock>& sorted, Particle* p)
+    {
+        int low = 0, high = (int)sorted.size() - 1;
+        while (low < high) {
+            int middle = (low + high + 1) / 2;
+            if (sorted[middle].slots <= p) low = middle; else high = middle - 1;
+        }
+        return low;
+    }
+    
+    // Box given by its offset from boundary.position
+    bool isInside(Vec3 pos, Vec3 offset, Vec3 size)
+    {
+        Vec3 local = pos - boundary->position - offset;
+        return local.x >= 0 && local.x < size.x && local.y >= 0 && local.y < size.y && local.z >= 0 && local.z < size.z;
+    }
+    // Initial particle nearest to pos
+    int getLatticeIndex(Vec3 pos)
+    {
+        int i = std::min(std::max((int)round((pos.x - position.x) * resolution), 0), (int)latticeX.size() - 1);
+        int j = std::min(std::max((int)round((pos.y - position.y) * resolution), 0), (int)latticeY.size() - 1);
+        int k = std::min(std::max((int)round((pos.z - position.z) * resolution), 0), (int)latticeZ.size() - 1);
+        return (k * (int)latticeY.size() + j) * (int)latticeX.size() + i;
+    }
+    void wakeCell(Vec3 pos)
+    {
+        if (sleepSteps > 0) {
+            int gridX, gridY, gridZ;
+            getGridCoord(pos, gridX, gridY, gridZ);
+            quietSteps[getCellIndex(gridX, gridY, gridZ)] = 0;
+        }
+    }
+    
+public: // Phases of update, they can be run one by one when something needs to happen in between
     void makeHashTable() // TODO: how to slice grid? use boundary?
     {
+        Phase phase(this, PHASE_HASH);
         for (int i = 0; i < gridSize.z; i ++) {
             for (int j = 0; j < gridSize.y; j ++) {
                 for (int k = 0; k < gridSize.x; k ++) {
                     hashGrid[i][j][k].clear();
+                    ghostGrid[i][j][k].clear();
                 }
             }
         }
@@ -144,184 +781,850 @@ private:
         for (int i = 0; i < particles.size(); i ++)
         {
             Particle *p = particles[i];
-            int gridX = (int)(p->position.x - boundary->position.x);
-            int gridY = (int)(p->position.y - boundary->position.y);
-            int gridZ = (int)(p->position.z - boundary->position.z);
-
-            if (gridX < 0) gridX = 0;
-            if (gridX >= gridSize.x) gridX = gridSize.x - 1;
-            if (gridY < 0) gridY = 0;
-            if (gridY >= gridSize.y) gridY = gridSize.y - 1;
-            if (gridZ < 0) gridZ = 0;
-            if (gridZ >= gridSize.z) gridZ = gridSize.z - 1;
+            int gridX, gridY, gridZ;
+            getGridCoord(p->position, gridX, gridY, gridZ);
 
             hashGrid[gridZ][gridY][gridX].push_back(p);
         }
-    }
-    std::vector<Particle *> getNeighbors(int gridZ, int gridY, int gridX, std::vector<Particle*>& mine, double radius)
-    {
-        std::vector<Particle *> neighbors;
-        mine.clear();
-        for (int i = gridZ - (int)radius; i <= gridZ + (int)radius; i ++) {
-            for (int j = gridY - (int)radius; j <= gridY + (int)radius; j ++) {
-                for (int k = gridX - (int)radius; k <= gridX + (int)radius; k ++) {
-                    if (i < 0 || i >= gridSize.z || j < 0 || j >= gridSize.y || k < 0 || k >= gridSize.x)
-                        continue;
-
-                    for (int index = 0; index < hashGrid[i][j][k].size(); index ++) {
-                        neighbors.push_back(hashGrid[i][j][k][index]);
+        for (int i = 0; i < ghosts.size(); i ++)
+        {
+            Particle *p = ghosts[i];
+            int gridX, gridY, gridZ;
+            getGridCoord(p->position, gridX, gridY, gridZ);
 
-                        if (i == gridZ && j == gridY && k == gridX) { mine.push_back(hashGrid[i][j][k][index]);
-                        }
+            ghostGrid[gridZ][gridY][gridX].push_back(p);
+        }
+        
+        if (deterministic) { // Cells in index order, getNeighbors() merges ghosts in the same order
+            for (int i = 0; i < gridSize.z; i ++) {
+                for (int j = 0; j < gridSize.y; j ++) {
+                    for (int k = 0; k < gridSize.x; k ++) {
+                        std::sort(hashGrid[i][j][k].begin(), hashGrid[i][j][k].end(), lessIndex);
+                        std::sort(ghostGrid[i][j][k].begin(), ghostGrid[i][j][k].end(), lessIndex);
                     }
                 }
             }
         }
-        return neighbors;
+        
+        for (int i = 0; i < gridSize.z; i ++) {
+            for (int j = 0; j < gridSize.y; j ++) {
+                for (int k = 0; k < gridSize.x; k ++) {
+                    int cell = getCellIndex(k, j, i);
+                    cellStart[cell + 1] = cellStart[cell] + (int)hashGrid[i][j][k].size();
+                }
+            }
+        }
+        forces.resize(particles.size());
+        if (sampleStep) {
+            neighborCounts.resize(particles.size());
+            cellSamples.assign(gridSize.x * gridSize.y * gridSize.z, CellSample());
+        }
+        
+        if (mergeMass > 1) {
+            updateReach();
+        }
+        if (sleepSteps > 0) {
+            updateSleep();
+        }
+        if (profileCells) {
+            int numCells = gridSize.x * gridSize.y * gridSize.z;
+            cellParticles.resize(numCells);
+            cellPairs.assign(numCells, 0.0);
+            cellSeconds.assign(numCells, 0.0);
+            for (int i = 0; i < gridSize.z; i ++) {
+                for (int j = 0; j < gridSize.y; j ++) {
+                    for (int k = 0; k < gridSize.x; k ++) cellParticles[getCellIndex(k, j, i)] = (int)hashGrid[i][j][k].size();
+                }
+            }
+        }
     }
     void computeDensity()
     {
+        Phase phase(this, PHASE_DENSITY);
+        withKernel([this](auto kernel) { computeDensity(kernel); });
+    }
+    void computeForce()
+    {
+        Phase phase(this, PHASE_FORCE);
+        withKernel([this](auto kernel) { computeForce(kernel); });
+    }
+    void integrate(double timestep, Vec3 gravity, ColliderSet* colliders)
+    {
+        Phase phase(this, PHASE_INTEGRATE);
+        double margin = prepareIntegrate(colliders);
         for (int z = 0; z < gridSize.z; z ++) {
             for (int y = 0; y < gridSize.y; y ++) {
                 for (int x = 0; x < gridSize.x; x ++) {
-                    std::vector<Particle*> mine;
-                    std::vector<Particle*> neighbors = getNeighbors(z, y, x, mine, kernelRadius);
-
-                    for (int i = 0; i < mine.size(); i++)
-                    {
-                        Particle* pi = mine[i];
-                        pi->density = 0;
-                        
-                        for (int j = 0; j < neighbors.size(); j ++) {
-                            Particle* pj = neighbors[j];
-                            pi->density += pj->mass * poly6Kernel(pi->position - pj->position);
-                        }
+                    std::vector<Particle*>& cell = hashGrid[z][y][x];
+                    const Vec3* force = forces.data() + cellStart[getCellIndex(x, y, z)];
+                    for (int i = 0; i < cell.size(); i ++) {
+                        integrate(cell[i], force[i], timestep, gravity, colliders, margin);
                     }
                 }
             }
         }
+        
+        if (sleepSteps > 0) {
+            updateQuiet();
+        }
     }
-    void computeForce()
+
+private:
+    // Bin colliders before integrating, and wake every cell if a collider was added or moved
+    double prepareIntegrate(ColliderSet* colliders)
     {
-        for (int z = 0; z < gridSize.z; z ++) {
-            for (int y = 0; y < gridSize.y; y ++) {
-                for (int x = 0; x < gridSize.x; x ++) {
-                    std::vector<Particle*> mine;
-                    std::vector<Particle*> neighbors = getNeighbors(z, y, x, mine, kernelRadius);
+        double margin = binColliders(colliders);
+        if (sleepSteps > 0 && colliders->revision != collidersRevision) {
+            std::fill(quietSteps.begin(), quietSteps.end(), 0);
+            std::fill(awake.begin(), awake.end(), 1);
+            collidersRevision = colliders->revision;
+        }
+        return margin;
+    }
+    // Move one particle, it only writes the particle and the velocity change of its own cell
+    void integrate(Particle* p, const Vec3& force, double timestep, Vec3 gravity, ColliderSet* colliders, double margin)
+    {
+        int cell = -1;
+        if (sleepSteps > 0) {
+            int gridX, gridY, gridZ;
+            getGridCoord(p->position, gridX, gridY, gridZ);
+            cell = getCellIndex(gridX, gridY, gridZ);
+            if (!awake[cell]) return;
+        }
+        Vec3 fGravity = p->mass * gravity;
+        // Update velocity and position
+        Vec3 acceleration = force / p->density + fGravity;
+        p->velocity += acceleration * timestep;
+        p->position += p->velocity * timestep;
+        if (cell >= 0) {
+            velocityChange[cell] = fmax(velocityChange[cell], fmax(p->velocity.len(), (acceleration * timestep).len()));
+        }
+        
+        /** Boundary Check **/
+        {
+            double pRadius = particleSize/90.0;
+            if (p->position.x < boundary->xMin && p->velocity.x < 0.0)
+            {
+                p->velocity.x *= -restitution;
+                p->position.x = boundary->xMin+pRadius+0.1;
+            }
+            if (p->position.x > boundary->xMax && p->velocity.x > 0.0)
+            {
+                p->velocity.x *= -restitution;
+                p->position.x = boundary->xMax-pRadius-0.1;
+            }
+            if (p->position.y < boundary->yMin && p->velocity.y < 0.0)
+            {
+                p->velocity.y *= -restitution;
+                p->position.y = boundary->yMin+pRadius+0.1;
+            }
+            if (p->position.y > boundary->yMax && p->velocity.y > 0.0)
+            {
+                p->velocity.y *= -restitution;
+                p->position.y = boundary->yMax-pRadius-0.2;
+            }
+            if (p->position.z < boundary->zMin && p->velocity.z < 0.0)
+            {
+                p->velocity.z *= -restitution;
+                p->position.z = boundary->zMin+pRadius+0.1;
+            }
+            if (p->position.z > boundary->zMax && p->velocity.z > 0.0)
+            {
+                p->velocity.z *= -restitution;
+                p->position.z = boundary->zMax-pRadius-0.1;
+            }
+        }
+        
+        /** Collision check **/ // Only against colliders overlapping the particle's cell
+        int gridX, gridY, gridZ;
+        getGridCoord(p->position, gridX, gridY, gridZ);
+        const std::vector<Collider*>& cellColliders = colliders->getCell(gridX, gridY, gridZ);
+        if (cellColliders.empty()) {
+            return;
+        }
+        Vec3 worldPos = getWorldPos(p);
+        bool moved = false;
+        for (int j = 0; j < cellColliders.size(); j ++) {
+            moved |= cellColliders[j]->resolve(worldPos, margin);
+        }
+        if (moved) {
+            setWorldPos(p, worldPos);
+        }
+    }
+    
+    template <class Kernel>
+    void computeDensity(Kernel kernel, int block = -1)
+    {
+        forEachCell(block, [this, kernel](int cell, std::vector<Particle*>& mine, std::vector<Particle*>& neighbors) {
+            double change = 0;
+            bool sampled = sampleStep;
+            for (int i = 0; i < mine.size(); i++)
+            {
+                Particle* pi = mine[i];
+                double previous = pi->density;
+                pi->density = 0;
+                int count = 0;
+                
+                for (int j = 0; j < neighbors.size(); j ++) {
+                    Particle* pj = neighbors[j];
+                    Vec3 diff = pi->position - pj->position;
+                    double r2 = Vec3::Dot(diff, diff);
+                    pi->density += pj->mass * pairKernel(kernel, pi, pj).density(r2);
+                    if (sampled) {
+                        double radius = mergeMass > 1 ? 0.5 * (pi->radius + pj->radius) : kernelRadius;
+                        count += pj != pi && r2 < radius*radius;
+                    }
+                }
+                change = fmax(change, fabs(pi->density - previous));
+                if (sampled) {
+                    neighborCounts[cellStart[cell] + i] = count;
+                    CellSample& sample = cellSamples[cell];
+                    double error = fabs(pi->density - restDensity) / restDensity;
+                    sample.maxDensityError = fmax(sample.maxDensityError, error);
+                    sample.densityError += error;
+                    sample.maxSpeed = fmax(sample.maxSpeed, pi->velocity.len());
+                }
+            }
+            if (sleepSteps > 0) {
+                densityChange[cell] = change;
+            }
+            cellNeighbors[cell] = (int)neighbors.size();
+        }, profileCells);
+    }
+    template <class Kernel>
+    void computeForce(Kernel kernel, int block = -1)
+    {
+        forEachCell(block, [this, kernel](int cell, std::vector<Particle*>& mine, std::vector<Particle*>& neighbors) {
+            for (int i = 0; i < mine.size(); i ++)
+            {
+                Particle *pi = mine[i];
+                Vec3 fPressure(0, 0, 0);
+                Vec3 fViscosity(0, 0, 0);
 
-                    for (int i = 0; i < mine.size(); i ++)
-                    {
-                        Particle *pi = mine[i];
-                        pi->fPressure = Vec3(0, 0, 0);//compute with spikygradientKernel
-                        pi->fViscosity = Vec3(0, 0, 0);//compute with viscositylaplacianKernel
+                for (int j = 0; j < neighbors.size(); j ++) {
+                    double temp;
+                    Particle* pj = neighbors[j];
+                    Vec3 diff = pi->position - pj->position;
+                    double r2 = Vec3::Dot(diff, diff);
+                    const auto& pair = pairKernel(kernel, pi, pj);
+                    Vec3 gradient = pair.gradient(diff, r2);
+                    temp = pj->mass * (gasConst * ((pi->density-restDensity) + pj->density - restDensity)) / (2.0 * pj->density);
+                    fPressure += gradient * temp;
+                    double laplacian = pair.laplacian(r2);
+                    fViscosity += pj->mass * ((pi->velocity - pj->velocity) / pj->density) * laplacian;
+                }
+                
+                forces[cellStart[cell] + i] = -1.0 * fPressure + viscosity * fViscosity;
+            }
+        }, profileCells);
+    }
+    
+    // Kernel of a pair of particles, uniform policies are the same for every pair
+    template <class Kernel>
+    static const Kernel& pairKernel(const Kernel& kernel, Particle* a, Particle* b) { return kernel; }
+    template <class Unit>
+    static ScaledRadius<Unit> pairKernel(const MixedRadius<Unit>& kernel, Particle* a, Particle* b) { return kernel.forPair(a->radius, b->radius); }
+    
+    // Call func with the kernel policy of this fluid, the default radius of one cell gets constant coefficients.
+    // Adaptive fluids scale a kernel of radius 1 to the smoothing lengths of each pair.
+    template <class Func>
+    void withKernel(Func func)
+    {
+        if (mergeMass > 1) {
+            if (kernelTableSize > 0) {
+                kernelTable.build(kernelType, 1.0, kernelTableSize);
+                func(MixedRadius<TabulatedRadius>(TabulatedRadius(&kernelTable)));
+                return;
+            }
+            switch (kernelType) {
+                case KERNEL_CUBIC_SPLINE: func(MixedRadius< FixedRadius<CubicSplineKernel, 1> >()); break;
+                case KERNEL_WENDLAND: func(MixedRadius< FixedRadius<WendlandKernel, 1> >()); break;
+                default: func(MixedRadius< FixedRadius<MullerKernel, 1> >()); break;
+            }
+            return;
+        }
+        if (kernelTableSize > 0) {
+            kernelTable.build(kernelType, kernelRadius, kernelTableSize);
+            func(TabulatedRadius(&kernelTable));
+            return;
+        }
+        bool unit = kernelRadius == 1.0;
+        switch (kernelType) {
+            case KERNEL_CUBIC_SPLINE:
+                if (unit) func(FixedRadius<CubicSplineKernel, 1>()); else func(RuntimeRadius<CubicSplineKernel>(kernelRadius));
+                break;
+            case KERNEL_WENDLAND:
+                if (unit) func(FixedRadius<WendlandKernel, 1>()); else func(RuntimeRadius<WendlandKernel>(kernelRadius));
+                break;
+            default:
+                if (unit) func(FixedRadius<MullerKernel, 1>()); else func(RuntimeRadius<MullerKernel>(kernelRadius));
+                break;
+        }
+    }
+    
+public:
+    FluidStats getStats()
+    {
+        // Deterministic : partial sums of fixed chunks of particles in index order, then chunks summed in order
+        const int chunkSize = 256;
+        int count = (int)particles.size();
+        std::vector<Particle*> ordered;
+        if (deterministic) {
+            ordered = particles;
+            std::sort(ordered.begin(), ordered.end(), lessIndex);
+        }
+        std::vector<Particle*>& list = deterministic ? ordered : particles;
+        int numChunks = deterministic ? (count + chunkSize - 1) / chunkSize : (threadPool ? threadPool->numThreads : 1);
+        std::vector<CompensatedSum> energy(numChunks), density(numChunks), momentumX(numChunks), momentumY(numChunks), momentumZ(numChunks);
+        std::vector<double> maxSpeed(numChunks, 0.0);
+        std::function<void(int, int, int)> reduce = [&](int begin, int end, int chunk) {
+            for (int i = begin; i < end; i ++) {
+                Particle* p = list[i];
+                double speed = p->velocity.len();
+                energy[chunk].add(0.5 * p->mass * speed * speed);
+                density[chunk].add(p->density);
+                momentumX[chunk].add(p->mass * p->velocity.x);
+                momentumY[chunk].add(p->mass * p->velocity.y);
+                momentumZ[chunk].add(p->mass * p->velocity.z);
+                maxSpeed[chunk] = fmax(maxSpeed[chunk], speed);
+            }
+        };
+        if (deterministic) {
+            parallelFor(numChunks, [&](int begin, int end, int thread) {
+                for (int c = begin; c < end; c ++) reduce(c*chunkSize, std::min((c+1)*chunkSize, count), c);
+            });
+        } else {
+            parallelFor(count, reduce);
+        }
+        
+        FluidStats stats;
+        CompensatedSum energySum, densitySum, momentumXSum, momentumYSum, momentumZSum;
+        stats.particles = count;
+        stats.maxSpeed = 0;
+        for (int c = 0; c < numChunks; c ++) {
+            energySum.add(energy[c].get());
+            densitySum.add(density[c].get());
+            momentumXSum.add(momentumX[c].get());
+            momentumYSum.add(momentumY[c].get());
+            momentumZSum.add(momentumZ[c].get());
+            stats.maxSpeed = fmax(stats.maxSpeed, maxSpeed[c]);
+        }
+        stats.kineticEnergy = energySum.get();
+        stats.meanDensity = count > 0 ? densitySum.get() / count : 0;
+        stats.momentum = Vec3(momentumXSum.get(), momentumYSum.get(), momentumZSum.get());
+        stats.sleeping = sleepingParticles;
+        return stats;
+    }
 
-                        for (int j = 0; j < neighbors.size(); j ++) {
-                            double temp;
-                            Particle* pj = neighbors[j];
-                            Vec3 spikyValue = spikyGradientKernel(pi->position - pj->position);
-                            temp = pj->mass * (gasConst * ((pi->density-restDensity) + pj->density - restDensity)) / (2.0 * pj->density);
-                            pi->fPressure += spikyValue * temp;
-                            double laplacValue = viscosityLaplacianKernel(pi->position - pj->position);
-                            pi->fViscosity += pj->mass * ((pi->velocity - pj->velocity) / pj->density) * laplacValue;
-                        }
-                        
-                        pi->fPressure = -1.0 * pi->fPressure;
-                        pi->fViscosity = viscosity * pi->fViscosity;
-                    }
+    struct StepSample
+    {
+        int particles; // In awake cells, the ones the density pass ran on
+        double maxDensityError, meanDensityError; // |density - restDensity| / restDensity
+        double maxSpeed; // At the start of the step
+        std::vector<long long> neighbors; // Particles by their number of neighbors within kernel radius, the last entry counts maxCount or more
+    };
+    // What the density pass of the last step measured, that step must have started with sampleStep set. Cells are
+    // reduced in parallel rows, no particle pair is looked at again.
+    StepSample getSample(int maxCount)
+    {
+        int numThreads = threadPool ? threadPool->numThreads : 1;
+        std::vector<StepSample> partial(numThreads, StepSample { 0, 0, 0, 0, std::vector<long long>(maxCount + 1, 0) });
+        parallelFor(gridSize.z * gridSize.y, [&](int begin, int end, int thread) {
+            StepSample& local = partial[thread];
+            for (int r = begin; r < end; r ++) {
+                int z = r / (int)gridSize.y, y = r % (int)gridSize.y;
+                for (int x = 0; x < gridSize.x; x ++) {
+                    int cell = getCellIndex(x, y, z);
+                    int count = (int)hashGrid[z][y][x].size();
+                    if (!awake[cell] || count == 0) continue;
+                    const CellSample& sample = cellSamples[cell];
+                    local.particles += count;
+                    local.maxDensityError = fmax(local.maxDensityError, sample.maxDensityError);
+                    local.meanDensityError += sample.densityError;
+                    local.maxSpeed = fmax(local.maxSpeed, sample.maxSpeed);
+                    for (int i = 0; i < count; i ++) local.neighbors[std::min(neighborCounts[cellStart[cell] + i], maxCount)] ++;
                 }
             }
+        });
+        StepSample total = partial[0];
+        for (int t = 1; t < numThreads; t ++) {
+            total.particles += partial[t].particles;
+            total.maxDensityError = fmax(total.maxDensityError, partial[t].maxDensityError);
+            total.meanDensityError += partial[t].meanDensityError;
+            total.maxSpeed = fmax(total.maxSpeed, partial[t].maxSpeed);
+            for (int k = 0; k <= maxCount; k ++) total.neighbors[k] += partial[t].neighbors[k];
         }
+        total.meanDensityError = total.particles > 0 ? total.meanDensityError / total.particles : 0;
+        return total;
     }
-    Vec3 getWorldPos(Particle* p) { return boundary->position + p->position; }
-    void setWorldPos(Particle* p, Vec3 pos) { p->position = pos - boundary->position; }
-    void integrate(double timestep, Vec3 gravity, Ball* ball)
+
+private:
+    struct CellSample { double maxDensityError = 0, densityError = 0, maxSpeed = 0; }; // densityError : sum over the cell
+    std::vector<CellSample> cellSamples; // Indexed like awake
+    std::vector<int> neighborCounts; // Of every hashed particle, laid out like forces
+    
+    struct CompensatedSum // Neumaier summation
     {
-        for (int i = 0; i < particles.size(); i++)
+        double sum, compensation;
+        
+        CompensatedSum() : sum(0), compensation(0) { }
+        void add(double value)
         {
-            Particle *p = particles[i];
-            Vec3 fGravity = p->mass * gravity;
-            // Update velocity and position
-            p->acceleration = (p->fPressure + p->fViscosity) / p->density + fGravity;
-            p->velocity += p->acceleration * timestep;
-            p->position += p->velocity * timestep;
-            
-            /** Boundary Check **/
-            {
-                double pRadius = particleSize/90.0;
-                if (p->position.x < boundary->xMin && p->velocity.x < 0.0)
-                {
-                    p->velocity.x *= -(p->restitution);
-                    p->position.x = boundary->xMin+pRadius+0.1;
+            double t = sum + value;
+            if (fabs(sum) >= fabs(value)) compensation += (sum - t) + value;
+            else compensation += (value - t) + sum;
+            sum = t;
+        }
+        double get() { return sum + compensation; }
+    };
+    
+    // Runs func(begin, end, thread) over [0, count) on the thread pool if there is one
+    void parallelFor(int count, std::function<void(int, int, int)> func)
+    {
+        if (threadPool) threadPool->parallelFor(count, func);
+        else if (count > 0) func(0, count, 0);
+    }
+    // Runs func(cell, mine, neighbors) for every awake grid cell, rows of cells are handed out to threads.
+    // Given a block of the task graph, only its cells are run, on the calling thread.
+    // Profiled : pairs and time of every cell are added to cellPairs and cellSeconds.
+    void forEachCell(int block, std::function<void(int, std::vector<Particle*>&, std::vector<Particle*>&)> func, bool profiled = false)
+    {
+        int rows = gridSize.z * gridSize.y;
+        std::function<void(int, int)> row = [&](int r, int thread) {
+            int z = r / (int)gridSize.y, y = r % (int)gridSize.y;
+            for (int x = 0; x < gridSize.x; x ++) {
+                int cell = getCellIndex(x, y, z);
+                if (!awake[cell]) continue;
+                std::chrono::steady_clock::time_point start;
+                if (profiled) start = std::chrono::steady_clock::now();
+                std::vector<Particle*> mine;
+                std::vector<Particle*> neighbors = mergeMass > 1 ? getNeighbors(z, y, x, mine, cellReach[cell], cellLongest[cell])
+                                                                 : getNeighbors(z, y, x, mine, kernelRadius);
+                if (mine.empty()) continue;
+                func(cell, mine, neighbors);
+                if (profiled) {
+                    cellPairs[cell] += (double)mine.size() * neighbors.size();
+                    cellSeconds[cell] += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
                 }
-                if (p->position.x > boundary->xMax && p->velocity.x > 0.0)
-                {
-                    p->velocity.x *= -(p->restitution);
-                    p->position.x = boundary->xMax-pRadius-0.1;
+            }
+        };
+        if (block >= 0) {
+            int zBegin, zEnd, yBegin, yEnd;
+            getBlockRows(block, zBegin, zEnd, yBegin, yEnd);
+            for (int z = zBegin; z < zEnd; z ++) {
+                for (int y = yBegin; y < yEnd; y ++) row(z*(int)gridSize.y + y, 0);
+            }
+        } else if (threadPool && placeInterval > 0) { // Fixed blocks of rows, the ones placeParticles put on each thread's node
+            threadPool->parallelFor(rows, [&](int begin, int end, int thread) {
+                for (int r = begin; r < end; r ++) row(r, thread);
+            });
+        } else if (threadPool) {
+            threadPool->parallelForDynamic(rows, row);
+        } else {
+            for (int r = 0; r < rows; r ++) row(r, 0);
+        }
+    }
+    
+    // Runs func(particle, force) for every particle of the hash grid with its entry of forces, rows of cells in parallel
+    void forEachHashed(std::function<void(Particle*, const Vec3&)> func)
+    {
+        parallelFor(gridSize.z * gridSize.y, [&](int begin, int end, int thread) {
+            for (int r = begin; r < end; r ++) {
+                int z = r / (int)gridSize.y, y = r % (int)gridSize.y;
+                for (int x = 0; x < gridSize.x; x ++) {
+                    std::vector<Particle*>& cell = hashGrid[z][y][x];
+                    const Vec3* force = forces.data() + cellStart[getCellIndex(x, y, z)];
+                    for (int i = 0; i < cell.size(); i ++) func(cell[i], force[i]);
                 }
-                if (p->position.y < boundary->yMin && p->velocity.y < 0.0)
-                {
-                    p->velocity.y *= -(p->restitution);
-                    p->position.y = boundary->yMin+pRadius+0.1;
+            }
+        });
+    }
+    
+    struct Phase // Tells observers a phase begins, and that it ends when it goes out of scope
+    {
+        Fluid* fluid;
+        int phase;
+        
+        Phase(Fluid* fluid, int phase) : fluid(fluid), phase(phase)
+        {
+            for (int i = 0; i < fluid->observers.size(); i ++) fluid->observers[i]->phaseBegin(phase);
+        }
+        ~Phase()
+        {
+            for (int i = 0; i < fluid->observers.size(); i ++) fluid->observers[i]->phaseEnd(phase);
+        }
+    };
+    
+    /** Task graph **/
+    // Blocks are blockSize x blockSize rows of cells, each has a density, a force and an integration task. Force of a block
+    // waits for density of the blocks within neighbor range, and integration waits for their force, as it moves particles
+    // they read. Blocks of full cells at the bottom and empty ones above even out by stealing.
+    const int blockSize = 2;
+    TaskGraph tasks;
+    int tasksRange; // Neighbor range the task graph was built for, -1 : not built
+    struct TaskStep { double timestep; Vec3 gravity; ColliderSet* colliders; double margin; } taskStep; // What integration tasks of this step use
+    
+    void updateTasks(double timestep, Vec3 gravity, ColliderSet* colliders)
+    {
+        Phase phase(this, PHASE_TASKS);
+        withKernel([](auto kernel) { }); // Builds the kernel table if there is one, before tasks read it
+        if (tasksRange != getNeighborRange()) {
+            buildTasks();
+        }
+        taskStep.timestep = timestep;
+        taskStep.gravity = gravity;
+        taskStep.colliders = colliders;
+        taskStep.margin = prepareIntegrate(colliders);
+        tasks.run(threadPool);
+        if (sleepSteps > 0) {
+            updateQuiet();
+        }
+    }
+    void buildTasks()
+    {
+        tasksRange = getNeighborRange();
+        int blocksY = ((int)gridSize.y + blockSize - 1) / blockSize;
+        int blocksZ = ((int)gridSize.z + blockSize - 1) / blockSize;
+        int numBlocks = blocksY * blocksZ;
+        int reach = (tasksRange + blockSize - 1) / blockSize; // In blocks
+        tasks.clear();
+        std::vector<int> density(numBlocks), force(numBlocks), move(numBlocks);
+        for (int b = 0; b < numBlocks; b ++) {
+            density[b] = tasks.add([this, b](int thread) { withKernel([this, b](auto kernel) { computeDensity(kernel, b); }); });
+        }
+        for (int b = 0; b < numBlocks; b ++) {
+            force[b] = tasks.add([this, b](int thread) { withKernel([this, b](auto kernel) { computeForce(kernel, b); }); });
+        }
+        for (int b = 0; b < numBlocks; b ++) {
+            move[b] = tasks.add([this, b](int thread) { integrateBlock(b); });
+        }
+        for (int bz = 0; bz < blocksZ; bz ++) {
+            for (int by = 0; by < blocksY; by ++) {
+                int b = bz*blocksY + by;
+                for (int nz = std::max(bz - reach, 0); nz <= std::min(bz + reach, blocksZ - 1); nz ++) {
+                    for (int ny = std::max(by - reach, 0); ny <= std::min(by + reach, blocksY - 1); ny ++) {
+                        int n = nz*blocksY + ny;
+                        tasks.depend(force[b], density[n]);
+                        tasks.depend(move[b], force[n]);
+                    }
                 }
-                if (p->position.y > boundary->yMax && p->velocity.y > 0.0)
-                {
-                    p->velocity.y *= -(p->restitution);
-                    p->position.y = boundary->yMax-pRadius-0.2;
+            }
+        }
+    }
+    void getBlockRows(int block, int& zBegin, int& zEnd, int& yBegin, int& yEnd)
+    {
+        int blocksY = ((int)gridSize.y + blockSize - 1) / blockSize;
+        zBegin = block / blocksY * blockSize;
+        yBegin = block % blocksY * blockSize;
+        zEnd = std::min(zBegin + blockSize, (int)gridSize.z);
+        yEnd = std::min(yBegin + blockSize, (int)gridSize.y);
+    }
+    void integrateBlock(int block)
+    {
+        int zBegin, zEnd, yBegin, yEnd;
+        getBlockRows(block, zBegin, zEnd, yBegin, yEnd);
+        for (int z = zBegin; z < zEnd; z ++) {
+            for (int y = yBegin; y < yEnd; y ++) {
+                for (int x = 0; x < gridSize.x; x ++) {
+                    std::vector<Particle*>& cell = hashGrid[z][y][x];
+                    const Vec3* force = forces.data() + cellStart[getCellIndex(x, y, z)];
+                    for (int i = 0; i < cell.size(); i ++) {
+                        integrate(cell[i], force[i], taskStep.timestep, taskStep.gravity, taskStep.colliders, taskStep.margin);
+                    }
                 }
-                if (p->position.z < boundary->zMin && p->velocity.z < 0.0)
-                {
-                    p->velocity.z *= -(p->restitution);
-                    p->position.z = boundary->zMin+pRadius+0.1;
+            }
+        }
+    }
+    
+    /** Sleeping cells **/
+    std::vector<double> densityChange, velocityChange; // Largest change of the particles of each cell in the last step
+    int collidersRevision; // ColliderSet::revision the sleeping state was made with
+    
+    int getCellIndex(int gridX, int gridY, int gridZ) { return (gridZ*(int)gridSize.y + gridY)*(int)gridSize.x + gridX; }
+    
+    // After integrate : count quiet steps of every awake cell. Cells next to ghosts are never quiet,
+    // their neighbors' activity is only known to other processes.
+    void updateQuiet()
+    {
+        double densityLimit = sleepDensity * restDensity;
+        for (int z = 0; z < gridSize.z; z ++) {
+            for (int y = 0; y < gridSize.y; y ++) {
+                for (int x = 0; x < gridSize.x; x ++) {
+                    int cell = getCellIndex(x, y, z);
+                    if (!awake[cell]) continue;
+                    bool quiet = densityChange[cell] < densityLimit && velocityChange[cell] < sleepVelocity && ghostGrid[z][y][x].empty();
+                    quietSteps[cell] = quiet ? std::min(quietSteps[cell] + 1, sleepSteps) : 0;
+                    densityChange[cell] = 0;
+                    velocityChange[cell] = 0;
                 }
-                if (p->position.z > boundary->zMax && p->velocity.z > 0.0)
-                {
-                    p->velocity.z *= -(p->restitution);
-                    p->position.z = boundary->zMax-pRadius-0.1;
+            }
+        }
+    }
+    // After hashing : a cell is awake unless it and all its neighbors have been quiet for sleepSteps
+    void updateSleep()
+    {
+        int range = getNeighborRange();
+        sleepingParticles = 0;
+        for (int z = 0; z < gridSize.z; z ++) {
+            for (int y = 0; y < gridSize.y; y ++) {
+                for (int x = 0; x < gridSize.x; x ++) {
+                    bool asleep = true;
+                    for (int i = std::max(z - range, 0); i <= std::min(z + range, (int)gridSize.z - 1) && asleep; i ++) {
+                        for (int j = std::max(y - range, 0); j <= std::min(y + range, (int)gridSize.y - 1) && asleep; j ++) {
+                            for (int k = std::max(x - range, 0); k <= std::min(x + range, (int)gridSize.x - 1) && asleep; k ++) {
+                                asleep = quietSteps[getCellIndex(k, j, i)] >= sleepSteps;
+                            }
+                        }
+                    }
+                    awake[getCellIndex(x, y, z)] = !asleep;
+                    if (asleep) sleepingParticles += (int)hashGrid[z][y][x].size();
                 }
             }
-            
-            /** Collision check **/
-            Vec3 distVec = getWorldPos(p) - ball->center;
-            double distLen = distVec.len();
-            double safeDist = (ball->radius + particleSize/100.0)*1.05;
-            if (distLen < safeDist) {
-                distVec.nor();
-                setWorldPos(p, distVec*safeDist+ball->center);
+        }
+    }
+    
+    /** Adaptive resolution **/
+    int numSteps;
+    int nextIndex; // Index of the next particle made by a split or an emitter
+    double baseMass; // Mass of the initial particles
+    std::vector<double> cellLongest; // Longest smoothing length of the particles of each cell
+    std::vector<double> cellReach; // Longest pair smoothing length of the particles of each cell
+    
+    // After hashing : reach of a cell is the mean of its longest smoothing length and the longest one in range,
+    // so cells away from heavy particles still search one cell around
+    void updateReach()
+    {
+        int numCells = gridSize.x * gridSize.y * gridSize.z;
+        std::vector<double>& longest = cellLongest;
+        longest.assign(numCells, kernelRadius);
+        maxRadius = kernelRadius;
+        for (int i = 0; i < particles.size(); i ++) {
+            int gridX, gridY, gridZ;
+            getGridCoord(particles[i]->position, gridX, gridY, gridZ);
+            double& radius = longest[getCellIndex(gridX, gridY, gridZ)];
+            radius = fmax(radius, particles[i]->radius);
+            maxRadius = fmax(maxRadius, particles[i]->radius);
+        }
+        // Max over the cells in range, one axis at a time
+        int range = getNeighborRange();
+        std::vector<double> around = longest;
+        int strides[3] = { 1, (int)gridSize.x, (int)(gridSize.x * gridSize.y) };
+        int sizes[3] = { (int)gridSize.x, (int)gridSize.y, (int)gridSize.z };
+        for (int axis = 0; axis < 3; axis ++) {
+            std::vector<double> previous = around;
+            for (int cell = 0; cell < numCells; cell ++) {
+                int coord = cell / strides[axis] % sizes[axis];
+                for (int d = std::max(-range, -coord); d <= std::min(range, sizes[axis] - 1 - coord); d ++) {
+                    around[cell] = fmax(around[cell], previous[cell + d*strides[axis]]);
+                }
             }
         }
+        cellReach.resize(numCells);
+        for (int cell = 0; cell < numCells; cell ++) {
+            cellReach[cell] = 0.5 * (longest[cell] + around[cell]);
+        }
     }
-
-private: //kernel functions for SPH
-    double poly6Kernel(Vec3 diffVec)
+    
+    // Colliders are in world coordinates, and so is the corner of grid cell (0, 0, 0). Returns the collision margin.
+    double binColliders(ColliderSet* colliders)
     {
-        static double kernelRadius9 = pow(kernelRadius, 9);
-        double temp = pow(kernelRadius, 2) - pow(diffVec.len(), 2);
-        if (temp <= 0) {
-            return 0;
-        } else {
-            return 315.0 / (64.0 * M_PI * kernelRadius9) * pow(temp, 3);
+        double margin = particleSize/100.0;
+        colliders->bin(boundary->position + boundary->position, gridSize.x, gridSize.y, gridSize.z, margin);
+        return margin;
+    }
+    
+    // Chebyshev distance in cells, up to mergeDistance + 1, from every cell to the nearest surface or collider cell.
+    // A cell is on the surface when the particles around it weigh less than half of those cells filled as the fluid
+    // started, walls of the boundary don't count.
+    std::vector<int> getSurfaceDistance(ColliderSet* colliders)
+    {
+        int numCells = gridSize.x * gridSize.y * gridSize.z;
+        std::vector<double> cellMass(numCells, 0.0);
+        for (int i = 0; i < particles.size(); i ++) {
+            int gridX, gridY, gridZ;
+            getGridCoord(particles[i]->position, gridX, gridY, gridZ);
+            cellMass[getCellIndex(gridX, gridY, gridZ)] += particles[i]->mass;
         }
+        
+        double filled = baseMass * resolution*resolution*resolution; // Mass of a cell at initial spacing
+        int far = mergeDistance + 1;
+        std::vector<int> distance(numCells, far);
+        for (int z = 0; z < gridSize.z; z ++) {
+            for (int y = 0; y < gridSize.y; y ++) {
+                for (int x = 0; x < gridSize.x; x ++) {
+                    double mass = 0;
+                    int cells = 0;
+                    for (int i = std::max(z - 1, 0); i <= std::min(z + 1, (int)gridSize.z - 1); i ++) {
+                        for (int j = std::max(y - 1, 0); j <= std::min(y + 1, (int)gridSize.y - 1); j ++) {
+                            for (int k = std::max(x - 1, 0); k <= std::min(x + 1, (int)gridSize.x - 1); k ++) {
+                                mass += cellMass[getCellIndex(k, j, i)];
+                                cells ++;
+                            }
+                        }
+                    }
+                    if (mass < 0.5 * filled * cells || !colliders->getCell(x, y, z).empty()) {
+                        distance[getCellIndex(x, y, z)] = 0;
+                    }
+                }
+            }
+        }
+        for (int pass = 0; pass < far; pass ++) {
+            std::vector<int> previous = distance;
+            for (int z = 0; z < gridSize.z; z ++) {
+                for (int y = 0; y < gridSize.y; y ++) {
+                    for (int x = 0; x < gridSize.x; x ++) {
+                        int& d = distance[getCellIndex(x, y, z)];
+                        for (int i = std::max(z - 1, 0); i <= std::min(z + 1, (int)gridSize.z - 1); i ++) {
+                            for (int j = std::max(y - 1, 0); j <= std::min(y + 1, (int)gridSize.y - 1); j ++) {
+                                for (int k = std::max(x - 1, 0); k <= std::min(x + 1, (int)gridSize.x - 1); k ++) {
+                                    d = std::min(d, previous[getCellIndex(k, j, i)] + 1);
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+        }
+        return distance;
     }
-    Vec3 spikyGradientKernel(Vec3 diffVec)
+    
+    // Run every iterationFreq steps after hashing. Deep in the bulk, pairs of equally heavy particles of a cell merge
+    // into one at their center of mass. Near the surface and colliders, merged particles split back in two along an
+    // axis picked by index. Mass and momentum are kept, smoothing length follows the cube root of mass.
+    void adaptResolution(ColliderSet* colliders)
     {
-        static double kernelRadius9 = pow(kernelRadius, 9);
-        double temp = pow(kernelRadius, 2) - pow(diffVec.len(), 2);
-        if (temp <= 0) {
-            return Vec3(0, 0, 0);
-        } else {
-            return diffVec * (-945.0 / (32.0 * M_PI * kernelRadius9) * pow(temp, 2));
+        binColliders(colliders);
+        std::vector<int> distance = getSurfaceDistance(colliders);
+        double spacing = 1.0 / resolution;
+        bool changed = false;
+        std::vector<Particle*> made;
+        
+        for (int z = 0; z < gridSize.z; z ++) {
+            for (int y = 0; y < gridSize.y; y ++) {
+                for (int x = 0; x < gridSize.x; x ++) {
+                    int cell = getCellIndex(x, y, z);
+                    if (sleepSteps > 0 && !awake[cell]) continue;
+                    std::vector<Particle*>& mine = hashGrid[z][y][x];
+                    
+                    if (distance[cell] > mergeDistance) { /** Merge **/
+                        for (int i = 0; i < mine.size(); i ++) {
+                            Particle* a = mine[i];
+                            if (a->mass == 0 || a->mass * 2 > mergeMass * baseMass) continue;
+                            Particle* b = NULL;
+                            double nearest = 0;
+                            for (int j = i + 1; j < mine.size(); j ++) {
+                                if (mine[j]->mass != a->mass) continue;
+                                Vec3 diff = mine[j]->position - a->position;
+                                double r2 = Vec3::Dot(diff, diff);
+                                if (!b || r2 < nearest) {
+                                    b = mine[j];
+                                    nearest = r2;
+                                }
+                            }
+                            if (!b) continue;
+                            double mass = a->mass + b->mass;
+                            a->position = (a->mass * a->position + b->mass * b->position) / mass;
+                            a->velocity = (a->mass * a->velocity + b->mass * b->velocity) / mass;
+                            a->density = 0.5 * (a->density + b->density);
+                            a->mass = mass;
+                            a->radius = kernelRadius * cbrt(mass / baseMass);
+                            b->mass = 0; // Removed below
+                            changed = true;
+                        }
+                    } else if (distance[cell] < mergeDistance) { /** Split **/
+                        std::vector<Particle*> heavy; // Split all the way down at once
+                        for (int i = 0; i < mine.size(); i ++) {
+                            if (mine[i]->mass > baseMass) heavy.push_back(mine[i]);
+                        }
+                        while (!heavy.empty()) {
+                            Particle* a = heavy.back();
+                            heavy.pop_back();
+                            a->mass *= 0.5;
+                            a->radius = kernelRadius * cbrt(a->mass / baseMass);
+                            Vec3 axis(a->index % 3 == 0, a->index % 3 == 1, a->index % 3 == 2);
+                            Vec3 offset = axis * (0.5 * spacing * cbrt(a->mass / baseMass));
+                            Particle* b = newParticle();
+                            *b = *a;
+                            b->index = nextIndex ++;
+                            a->position -= offset;
+                            b->position += offset;
+                            made.push_back(b);
+                            if (a->mass > baseMass) {
+                                heavy.push_back(a);
+                                heavy.push_back(b);
+                            }
+                            changed = true;
+                        }
+                    }
+                }
+            }
         }
+        if (!changed) {
+            return;
+        }
+        
+        std::vector<Particle*> kept;
+        kept.reserve(particles.size() + made.size());
+        for (int i = 0; i < particles.size(); i ++) {
+            if (particles[i]->mass == 0) {
+                deleteParticle(particles[i]);
+                continue;
+            }
+            kept.push_back(particles[i]);
+        }
+        for (int i = 0; i < made.size(); i ++) {
+            kept.push_back(made[i]);
+        }
+        particles = kept;
     }
-    double viscosityLaplacianKernel(Vec3 diffVec)
+    
+    static bool lessIndex(Particle* a, Particle* b) { return a->index < b->index; }
+    Vec3 getWorldPos(Particle* p) { return boundary->position + p->position; }
+    void setWorldPos(Particle* p, Vec3 pos) { p->position = pos - boundary->position; }
+    // longest > 0 : longest smoothing length in the cell of mixed radii fluids, particles of cells that aren't adjacent
+    // are only kept if their pair smoothing length with it can reach across the gap
+    std::vector<Particle *> getNeighbors(int gridZ, int gridY, int gridX, std::vector<Particle*>& mine, double radius, double longest = 0)
     {
-        static double kernelRadius9 = pow(kernelRadius, 9);
-        double diffDist = diffVec.len();
-        if (diffDist > kernelRadius) {
-            return 0;
-        } else {
-            double temp1 = pow(kernelRadius, 2);
-            double temp2 = pow(diffDist, 2);
-            return -945.0 / (32.0 * M_PI * kernelRadius9) * (temp1-temp2) * (3*temp1 - 7*temp2);
+        std::vector<Particle *> neighbors;
+        mine.clear();
+        int range = (int)ceil(radius);
+        for (int i = gridZ - range; i <= gridZ + range; i ++) {
+            for (int j = gridY - range; j <= gridY + range; j ++) {
+                for (int k = gridX - range; k <= gridX + range; k ++) {
+                    if (i < 0 || i >= gridSize.z || j < 0 || j >= gridSize.y || k < 0 || k >= gridSize.x)
+                        continue;
+
+                    if (i == gridZ && j == gridY && k == gridX) {
+                        mine = hashGrid[i][j][k];
+                    }
+                    int gapX = std::max(abs(k - gridX) - 1, 0), gapY = std::max(abs(j - gridY) - 1, 0), gapZ = std::max(abs(i - gridZ) - 1, 0);
+                    double gap = sqrt((double)(gapX*gapX + gapY*gapY + gapZ*gapZ));
+                    if (longest > 0 && gap > 0 && 0.5 * (longest + cellLongest[getCellIndex(k, j, i)]) <= gap) {
+                        continue; // Nothing in that cell can reach this one
+                    }
+                    size_t begin = neighbors.size();
+                    if (deterministic && !ghostGrid[i][j][k].empty()) {
+                        // Same order no matter which process owns which particle
+                        neighbors.resize(begin + hashGrid[i][j][k].size() + ghostGrid[i][j][k].size());
+                        std::merge(hashGrid[i][j][k].begin(), hashGrid[i][j][k].end(), ghostGrid[i][j][k].begin(), ghostGrid[i][j][k].end(), neighbors.begin() + begin, lessIndex);
+                    } else {
+                        for (int index = 0; index < hashGrid[i][j][k].size(); index ++) {
+                            neighbors.push_back(hashGrid[i][j][k][index]);
+                        }
+                        for (int index = 0; index < ghostGrid[i][j][k].size(); index ++) {
+                            neighbors.push_back(ghostGrid[i][j][k][index]);
+                        }
+                    }
+                    if (longest > 0 && gap > 0) {
+                        size_t end = begin;
+                        for (size_t n = begin; n < neighbors.size(); n ++) {
+                            if (0.5 * (longest + neighbors[n]->radius) > gap) neighbors[end ++] = neighbors[n];
+                        }
+                        neighbors.resize(end);
+                    }
+                }
+            }
         }
+        return neighbors;
     }
 };
@@ -0,0 +1,234 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <cstring>
+
+#include <math.h>
+
+#include "Fluid.h"
+#include "Collider.h"
+#include "Scene.h"
+#include "Parallel.h"
+
+/** Golden trajectories : snapshots of a reference run that later runs are compared against **/
+// Record runs the scene on one thread with the plain scalar path (analytic kernels, no task graph, no adaptive
+// resolution) and stores a snapshot every interval steps.
+// Check runs the scene again with any scene keys overridden (threads, deterministic, ...) and reports,
+// per snapshot, how far density, velocity, total mass and momentum have moved away from the reference.
+class GoldenTrajectory
+{
+public:
+    struct Tolerance // Largest error allowed at any snapshot, all relative
+    {
+        double density; // Max over particles of |density - golden| / golden
+        double velocity; // Max over particles of |velocity - golden| / max golden speed
+        double mass; // Total mass
+        double momentum; // |momentum - golden| / sum of mass * speed
+
+        Tolerance() : density(1e-3), velocity(1e-3), mass(1e-12), momentum(1e-3) { }
+    };
+
+private:
+    struct Snapshot
+    {
+        int step;
+        double mass;
+        double momentum[3];
+        double scale; // Sum of mass * speed
+        std::vector<float> fields; // 7 per particle index up to the highest one : position, velocity, density, zeros where a particle is gone
+    };
+
+    static const int fieldCount = 7;
+
+public:
+    // Run scene for steps, keep a snapshot every interval steps and write them to path
+    static bool record(Scene scene, const char* path, int steps, int interval)
+    {
+        scene.threads = 1;
+        scene.deterministic = 0;
+        scene.taskGraph = 0;
+        scene.params.kernelTable = 0;
+        scene.params.mergeMass = 1;
+        scene.numa = 0;
+        std::vector<Snapshot> snapshots;
+        run(scene, steps, interval, snapshots);
+
+        FILE* file = fopen(path, "wb");
+        if (!file) {
+            printf("GoldenTrajectory: can't write %s\n", path);
+            return false;
+        }
+        int header[3] = { steps, interval, (int)snapshots.size() };
+        fwrite("GLD2", 1, 4, file);
+        fwrite(header, sizeof(int), 3, file);
+        for (int i = 0; i < snapshots.size(); i ++) { // Emitters, sinks and splits change the count, every snapshot has its own
+            Snapshot& s = snapshots[i];
+            int count = (int)s.fields.size() / fieldCount;
+            fwrite(&s.step, sizeof(int), 1, file);
+            fwrite(&count, sizeof(int), 1, file);
+            fwrite(&s.mass, sizeof(double), 1, file);
+            fwrite(s.momentum, sizeof(double), 3, file);
+            fwrite(&s.scale, sizeof(double), 1, file);
+            fwrite(s.fields.data(), sizeof(float), s.fields.size(), file);
+        }
+        fclose(file);
+        printf("GoldenTrajectory: %d snapshots of up to %d particles written to %s\n", header[2],
+               snapshots.empty() ? 0 : (int)snapshots.back().fields.size() / fieldCount, path);
+        return true;
+    }
+
+    // Run scene against the snapshots in path, print the error of every field over time, return true if all are in tolerance
+    static bool check(Scene scene, const char* path, Tolerance tolerance = Tolerance())
+    {
+        std::vector<Snapshot> golden;
+        int steps, interval;
+        if (!load(path, golden, steps, interval)) {
+            return false;
+        }
+        std::vector<Snapshot> snapshots;
+        run(scene, steps, interval, snapshots);
+        if (snapshots.size() != golden.size()) {
+            printf("GoldenTrajectory: %s doesn't match this scene.\n", path);
+            return false;
+        }
+
+        bool pass = true;
+        printf("GoldenTrajectory: %s, threads = %d, deterministic = %d\n", path, scene.threads, scene.deterministic);
+        if (scene.params.kernelTable > 0) {
+            KernelTable table;
+            table.build(scene.params.kernel, scene.params.kernelRadius, scene.params.kernelTable);
+            table.report();
+        }
+        printf("\t%6s %12s %12s %12s %12s %12s\n", "step", "position", "density", "velocity", "mass", "momentum");
+        for (int i = 0; i < golden.size(); i ++) {
+            Snapshot& g = golden[i];
+            Snapshot& s = snapshots[i];
+            if (s.fields.size() != g.fields.size()) {
+                printf("\t%6d  %d particle indices against %d  FAIL\n", g.step, (int)(s.fields.size() / fieldCount), (int)(g.fields.size() / fieldCount));
+                pass = false;
+                continue;
+            }
+            double positionError = 0, densityError = 0, velocityError = 0, maxSpeed = 0;
+            int count = (int)g.fields.size() / fieldCount;
+            for (int n = 0; n < count; n ++) {
+                const float* a = &s.fields[n*fieldCount];
+                const float* b = &g.fields[n*fieldCount];
+                positionError = fmax(positionError, sqrt(square(a[0]-b[0]) + square(a[1]-b[1]) + square(a[2]-b[2])));
+                velocityError = fmax(velocityError, sqrt(square(a[3]-b[3]) + square(a[4]-b[4]) + square(a[5]-b[5])));
+                maxSpeed = fmax(maxSpeed, sqrt(square(b[3]) + square(b[4]) + square(b[5])));
+                densityError = fmax(densityError, fabs(a[6]-b[6]) / fmax(fabs(b[6]), 1e-12));
+            }
+            velocityError /= fmax(maxSpeed, 1e-12);
+            double massError = fabs(s.mass - g.mass) / fmax(fabs(g.mass), 1e-12);
+            double momentumError = sqrt(square(s.momentum[0]-g.momentum[0]) + square(s.momentum[1]-g.momentum[1]) + square(s.momentum[2]-g.momentum[2])) / fmax(g.scale, 1e-12);
+
+            bool ok = densityError <= tolerance.density && velocityError <= tolerance.velocity &&
+                      massError <= tolerance.mass && momentumError <= tolerance.momentum;
+            pass = pass && ok;
+            printf("\t%6d %12.3e %12.3e %12.3e %12.3e %12.3e%s\n", g.step, positionError, densityError, velocityError, massError, momentumError, ok ? "" : "  FAIL");
+        }
+        printf("GoldenTrajectory: %s (tolerance density %g, velocity %g, mass %g, momentum %g)\n", pass ? "PASS" : "FAIL",
+               tolerance.density, tolerance.velocity, tolerance.mass, tolerance.momentum);
+        return pass;
+    }
+
+private:
+    static double square(double x) { return x*x; }
+
+    static void run(const Scene& scene, int steps, int interval, std::vector<Snapshot>& snapshots)
+    {
+        Boundary boundary(scene.boundaryPosition, scene.boundarySize);
+        ThreadPool* pool = scene.threads == 1 ? NULL : new ThreadPool(scene.threads);
+        Fluid fluid(&boundary, scene.fluidSize, scene.fluidPosOffset, scene.fluidInitVelocity, scene.params, Subdomain(), pool);
+        fluid.deterministic = scene.deterministic;
+        fluid.taskGraph = scene.taskGraph;
+        fluid.placeInterval = scene.numa;
+        fluid.hugePages = scene.hugePages;
+        scene.addSources(&fluid);
+        if (pool && scene.numa > 0) {
+            pool->pinThreads();
+            fluid.placeParticles();
+        }
+        ColliderSet colliders;
+        scene.addColliders(&colliders);
+
+        for (int step = 1; step <= steps; step ++) {
+            fluid.update(scene.timestep, scene.gravity, &colliders);
+            if (step % interval == 0 || step == steps) {
+                snapshots.push_back(snapshot(fluid, step));
+            }
+        }
+        delete pool;
+    }
+
+    static Snapshot snapshot(Fluid& fluid, int step)
+    {
+        Snapshot s;
+        s.step = step;
+        s.mass = 0;
+        s.momentum[0] = s.momentum[1] = s.momentum[2] = 0;
+        s.scale = 0;
+        int count = 0;
+        for (int i = 0; i < fluid.particles.size(); i ++) {
+            count = std::max(count, fluid.particles[i]->index + 1);
+        }
+        s.fields.assign(count*fieldCount, 0.0f);
+        for (int i = 0; i < fluid.particles.size(); i ++) {
+            Particle* p = fluid.particles[i];
+            float* f = &s.fields[p->index*fieldCount];
+            f[0] = p->position.x; f[1] = p->position.y; f[2] = p->position.z;
+            f[3] = p->velocity.x; f[4] = p->velocity.y; f[5] = p->velocity.z;
+            f[6] = p->density;
+        }
+        // Totals in index order, so they don't depend on particle order in memory
+        std::vector<Particle*> ordered(count, (Particle*)NULL);
+        for (int i = 0; i < fluid.particles.size(); i ++) {
+            ordered[fluid.particles[i]->index] = fluid.particles[i];
+        }
+        for (int i = 0; i < count; i ++) {
+            Particle* p = ordered[i];
+            if (!p) continue;
+            s.mass += p->mass;
+            s.momentum[0] += p->mass * p->velocity.x;
+            s.momentum[1] += p->mass * p->velocity.y;
+            s.momentum[2] += p->mass * p->velocity.z;
+            s.scale += p->mass * p->velocity.len();
+        }
+        return s;
+    }
+
+    static bool load(const char* path, std::vector<Snapshot>& snapshots, int& steps, int& interval)
+    {
+        FILE* file = fopen(path, "rb");
+        if (!file) {
+            printf("GoldenTrajectory: can't open %s\n", path);
+            return false;
+        }
+        char magic[4];
+        int header[3];
+        bool ok = fread(magic, 1, 4, file) == 4 && memcmp(magic, "GLD2", 4) == 0 && fread(header, sizeof(int), 3, file) == 3;
+        if (ok) {
+            steps = header[0];
+            interval = header[1];
+            snapshots.resize(header[2]);
+            for (int i = 0; i < snapshots.size() && ok; i ++) {
+                Snapshot& s = snapshots[i];
+                int count;
+                ok = fread(&s.step, sizeof(int), 1, file) == 1 && fread(&count, sizeof(int), 1, file) == 1 && count >= 0;
+                if (!ok) break;
+                s.fields.resize((size_t)count*fieldCount);
+                ok = fread(&s.mass, sizeof(double), 1, file) == 1 &&
+                     fread(s.momentum, sizeof(double), 3, file) == 3 && fread(&s.scale, sizeof(double), 1, file) == 1 &&
+                     fread(s.fields.data(), sizeof(float), s.fields.size(), file) == s.fields.size();
+            }
+        }
+        fclose(file);
+        if (!ok || snapshots.empty()) {
+            printf("GoldenTrajectory: %s isn't a golden trajectory.\n", path);
+            return false;
+        }
+        return true;
+    }
+};
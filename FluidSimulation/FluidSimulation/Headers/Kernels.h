@@ -0,0 +1,327 @@
+#pragma once
+
+#include <vector>
+#include <cstdio>
+
+#include <math.h>
+
+#include "Vector.h"
+
+/** Smoothing kernel families **/
+// Every family takes the squared distance r2 and the difference vector of a pair, and has
+//     density(r2)          W, summed for density
+//     gradient(diff, r2)   gradient of W, used for pressure
+//     laplacian(r2)        laplacian used for viscosity
+// Coefficients come from the radius in a constexpr constructor, so a family built with a constant
+// radius (see FixedRadius) leaves nothing but the polynomial in the pair loop.
+
+enum KernelType
+{
+    KERNEL_MULLER, // The original poly6 density with its gradient and laplacian
+    KERNEL_CUBIC_SPLINE,
+    KERNEL_WENDLAND // Wendland C2
+};
+
+constexpr double kernelPow3(double h) { return h*h*h; }
+constexpr double kernelPow9(double h) { return kernelPow3(h)*kernelPow3(h)*kernelPow3(h); }
+
+struct MullerKernel
+{
+    double radius, radius2;
+    double densityCoef, gradientCoef;
+
+    constexpr MullerKernel(double h) : radius(h), radius2(h*h),
+        densityCoef(315.0 / (64.0 * M_PI * kernelPow9(h))), gradientCoef(-945.0 / (32.0 * M_PI * kernelPow9(h))) { }
+
+    double density(double r2) const
+    {
+        double t = radius2 - r2;
+        return t > 0 ? densityCoef * t*t*t : 0;
+    }
+    Vec3 gradient(Vec3 diff, double r2) const
+    {
+        double t = radius2 - r2;
+        return t > 0 ? diff * (gradientCoef * t*t) : Vec3(0, 0, 0);
+    }
+    double laplacian(double r2) const
+    {
+        double t = radius2 - r2;
+        return t >= 0 ? gradientCoef * t * (3*radius2 - 7*r2) : 0;
+    }
+};
+
+// Cubic B-spline of Monaghan, scaled so that it reaches zero at the kernel radius.
+// Viscosity keeps the laplacian of the Muller family.
+struct CubicSplineKernel
+{
+    MullerKernel viscosity;
+    double radius, radius2, inverseRadius;
+    double densityCoef, gradientCoef;
+
+    constexpr CubicSplineKernel(double h) : viscosity(h), radius(h), radius2(h*h), inverseRadius(1.0 / h),
+        densityCoef(8.0 / (M_PI * kernelPow3(h))), gradientCoef(8.0 / (M_PI * kernelPow3(h) * h)) { }
+
+    double density(double r2) const
+    {
+        if (r2 >= radius2) return 0;
+        double q = sqrt(r2) * inverseRadius;
+        if (q <= 0.5) return densityCoef * (6*q*q*q - 6*q*q + 1);
+        double t = 1 - q;
+        return densityCoef * 2*t*t*t;
+    }
+    Vec3 gradient(Vec3 diff, double r2) const
+    {
+        if (r2 >= radius2 || r2 <= 0) return Vec3(0, 0, 0);
+        double r = sqrt(r2);
+        double q = r * inverseRadius;
+        double t = 1 - q;
+        double slope = q <= 0.5 ? gradientCoef * (18*q*q - 12*q) : -gradientCoef * 6*t*t; // dW/dr
+        return diff * (slope / r);
+    }
+    double laplacian(double r2) const { return viscosity.laplacian(r2); }
+};
+
+// Wendland C2, its gradient needs no division by r : dW/dr = -20 densityCoef q (1-q)^3 / h.
+// Viscosity keeps the laplacian of the Muller family.
+struct WendlandKernel
+{
+    MullerKernel viscosity;
+    double radius, radius2, inverseRadius;
+    double densityCoef, gradientCoef;
+
+    constexpr WendlandKernel(double h) : viscosity(h), radius(h), radius2(h*h), inverseRadius(1.0 / h),
+        densityCoef(21.0 / (2.0 * M_PI * kernelPow3(h))), gradientCoef(-210.0 / (M_PI * kernelPow3(h) * h*h)) { }
+
+    double density(double r2) const
+    {
+        if (r2 >= radius2) return 0;
+        double q = sqrt(r2) * inverseRadius;
+        double t = 1 - q;
+        return densityCoef * t*t*t*t * (1 + 4*q);
+    }
+    Vec3 gradient(Vec3 diff, double r2) const
+    {
+        if (r2 >= radius2) return Vec3(0, 0, 0);
+        double t = 1 - sqrt(r2) * inverseRadius;
+        return diff * (gradientCoef * t*t*t);
+    }
+    double laplacian(double r2) const { return viscosity.laplacian(r2); }
+};
+
+/** Gradients of every family against central differences of its density **/
+// A table built from the analytic gradient can't catch a wrong one, this can. dW/dr is compared along x at points
+// over (0, radius), away from r = 0 where it's a limit, errors are relative to the largest |dW/dr|.
+class KernelCheck
+{
+public:
+    static bool run(double radius, double tolerance = 1e-5)
+    {
+        bool pass = true;
+        pass &= report("muller", MullerKernel(radius), radius, tolerance);
+        pass &= report("cubic", CubicSplineKernel(radius), radius, tolerance);
+        pass &= report("wendland", WendlandKernel(radius), radius, tolerance);
+        printf("KernelCheck: %s (radius %f, tolerance %g)\n", pass ? "PASS" : "FAIL", radius, tolerance);
+        return pass;
+    }
+
+private:
+    template <class Family>
+    static bool report(const char* name, const Family& kernel, double radius, double tolerance)
+    {
+        const int points = 200;
+        double step = radius * 1e-6;
+        double maxSlope = 0, maxError = 0, worst = 0;
+        for (int i = 1; i < points; i ++) {
+            double r = radius * i / points;
+            double analytic = kernel.gradient(Vec3(r, 0, 0), r*r).x;
+            double numeric = (kernel.density((r+step)*(r+step)) - kernel.density((r-step)*(r-step))) / (2*step);
+            maxSlope = fmax(maxSlope, fabs(numeric));
+            if (fabs(analytic - numeric) > maxError) {
+                maxError = fabs(analytic - numeric);
+                worst = r;
+            }
+        }
+        double error = maxError / fmax(maxSlope, 1e-300);
+        printf("\t%-8s gradient against finite difference of density : max error %.3e at r = %f%s\n", name, error, worst,
+               error <= tolerance ? "" : "  FAIL");
+        return error <= tolerance;
+    }
+};
+
+/** Radius policies, compute loops are instantiated with one of them **/
+// Radius fixed at compile time as Numerator / Denominator : every coefficient is a constant
+template <class Family, int Numerator, int Denominator = 1>
+struct FixedRadius
+{
+    static constexpr Family kernel = Family((double)Numerator / Denominator);
+
+    double density(double r2) const { return kernel.density(r2); }
+    Vec3 gradient(Vec3 diff, double r2) const { return kernel.gradient(diff, r2); }
+    double laplacian(double r2) const { return kernel.laplacian(r2); }
+};
+template <class Family, int Numerator, int Denominator>
+constexpr Family FixedRadius<Family, Numerator, Denominator>::kernel;
+
+// Any radius, coefficients are computed once when the policy is made
+template <class Family>
+struct RuntimeRadius
+{
+    Family kernel;
+
+    RuntimeRadius(double radius) : kernel(radius) { }
+
+    double density(double r2) const { return kernel.density(r2); }
+    Vec3 gradient(Vec3 diff, double r2) const { return kernel.gradient(diff, r2); }
+    double laplacian(double r2) const { return kernel.laplacian(r2); }
+};
+
+/** Kernels tabulated over r2 / radius^2, read with linear interpolation **/
+// No sqrt or pow in the pair loop, for any family and radius. The gradient is stored as dW/dr / r,
+// so the vector is just diff times the looked up value.
+class KernelTable
+{
+public:
+    int type; // KernelType the table was built for
+    double radius;
+    int size; // Intervals, there are size+1 samples
+
+private:
+    struct Sample { double density, gradient, laplacian; };
+    std::vector<Sample> samples;
+    double scale; // size / radius^2
+
+public:
+    KernelTable() : type(-1), radius(0), size(0), scale(0) { }
+
+    // Nothing happens if the table is already built for the same kernel, radius and size
+    bool build(int type, double radius, int size)
+    {
+        if (type == this->type && radius == this->radius && size == this->size) {
+            return false;
+        }
+        this->type = type;
+        this->radius = radius;
+        this->size = size;
+        scale = size / (radius*radius);
+        samples.resize(size + 1);
+        switch (type) {
+            case KERNEL_CUBIC_SPLINE: fill(CubicSplineKernel(radius)); break;
+            case KERNEL_WENDLAND: fill(WendlandKernel(radius)); break;
+            default: fill(MullerKernel(radius)); break;
+        }
+        return true;
+    }
+
+    double density(double r2) const
+    {
+        double x = r2 * scale;
+        if (x >= size) return 0;
+        int i = (int)x;
+        double f = x - i;
+        return samples[i].density + (samples[i+1].density - samples[i].density) * f;
+    }
+    Vec3 gradient(Vec3 diff, double r2) const
+    {
+        double x = r2 * scale;
+        if (x >= size) return Vec3(0, 0, 0);
+        int i = (int)x;
+        double f = x - i;
+        return diff * (samples[i].gradient + (samples[i+1].gradient - samples[i].gradient) * f);
+    }
+    double laplacian(double r2) const
+    {
+        double x = r2 * scale;
+        if (x >= size) return 0;
+        int i = (int)x;
+        double f = x - i;
+        return samples[i].laplacian + (samples[i+1].laplacian - samples[i].laplacian) * f;
+    }
+
+    // Largest error against the analytic kernel, relative to its largest magnitude, at points between samples
+    void report()
+    {
+        switch (type) {
+            case KERNEL_CUBIC_SPLINE: report(CubicSplineKernel(radius)); break;
+            case KERNEL_WENDLAND: report(WendlandKernel(radius)); break;
+            default: report(MullerKernel(radius)); break;
+        }
+    }
+
+private:
+    template <class Family>
+    void fill(const Family& kernel)
+    {
+        double radius2 = radius*radius;
+        for (int i = 0; i <= size; i ++) {
+            double r2 = radius2 * i / size;
+            double r = sqrt(r2);
+            samples[i].density = kernel.density(r2);
+            samples[i].gradient = r > 0 ? kernel.gradient(Vec3(r, 0, 0), r2).x / r : 0;
+            samples[i].laplacian = kernel.laplacian(r2);
+        }
+        // dW/dr / r at r = 0 is a limit, take it from the next two samples
+        if (size >= 2) {
+            samples[0].gradient = 2*samples[1].gradient - samples[2].gradient;
+        }
+    }
+
+    template <class Family>
+    void report(const Family& kernel)
+    {
+        const int between = 16; // Points checked in every interval
+        double radius2 = radius*radius;
+        double maxDensity = 0, maxGradient = 0, maxLaplacian = 0;
+        double densityError = 0, gradientError = 0, laplacianError = 0;
+        for (int i = 0; i < size * between; i ++) {
+            double r2 = radius2 * (i + 0.5) / (size * between);
+            double r = sqrt(r2);
+            Vec3 diff(r, 0, 0);
+            maxDensity = fmax(maxDensity, fabs(kernel.density(r2)));
+            maxGradient = fmax(maxGradient, fabs(kernel.gradient(diff, r2).x));
+            maxLaplacian = fmax(maxLaplacian, fabs(kernel.laplacian(r2)));
+            densityError = fmax(densityError, fabs(density(r2) - kernel.density(r2)));
+            gradientError = fmax(gradientError, fabs(gradient(diff, r2).x - kernel.gradient(diff, r2).x));
+            laplacianError = fmax(laplacianError, fabs(laplacian(r2) - kernel.laplacian(r2)));
+        }
+        printf("KernelTable: %d intervals, radius %f, max error density %.3e, gradient %.3e, laplacian %.3e\n", size, radius,
+               densityError / fmax(maxDensity, 1e-300), gradientError / fmax(maxGradient, 1e-300), laplacianError / fmax(maxLaplacian, 1e-300));
+    }
+};
+
+// Policy reading a table, made by Fluid when FluidParams::kernelTable is set
+struct TabulatedRadius
+{
+    const KernelTable* table;
+
+    TabulatedRadius(const KernelTable* table) : table(table) { }
+
+    double density(double r2) const { return table->density(r2); }
+    Vec3 gradient(Vec3 diff, double r2) const { return table->gradient(diff, r2); }
+    double laplacian(double r2) const { return table->laplacian(r2); }
+};
+
+/** Mixed radii, for fluids whose particles have their own smoothing length **/
+// W_h(r) = W_1(r / h) / h^3 for every family, so one policy of radius 1 serves any radius h.
+template <class Unit>
+struct ScaledRadius
+{
+    Unit unit;
+    double inverse, inverse2, inverse3;
+
+    ScaledRadius(const Unit& unit, double radius) : unit(unit), inverse(radius == 1.0 ? 1.0 : 1.0 / radius), inverse2(inverse*inverse), inverse3(inverse2*inverse) { }
+
+    double density(double r2) const { return unit.density(r2 * inverse2) * inverse3; }
+    Vec3 gradient(Vec3 diff, double r2) const { return unit.gradient(diff * inverse, r2 * inverse2) * (inverse3 * inverse); }
+    double laplacian(double r2) const { return unit.laplacian(r2 * inverse2) * (inverse3 * inverse2); }
+};
+
+// Every pair uses the mean smoothing length of its two particles, so forces stay symmetric
+template <class Unit>
+struct MixedRadius
+{
+    Unit unit;
+
+    MixedRadius(const Unit& unit = Unit()) : unit(unit) { }
+
+    ScaledRadius<Unit> forPair(double radiusA, double radiusB) const { return ScaledRadius<Unit>(unit, 0.5 * (radiusA + radiusB)); }
+};
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdarg>
+
+enum LogLevel
+{
+    LOG_ERROR, // Something is wrong, usually followed by exit(-1)
+    LOG_INFO, // What was built : extents, particle counts, program IDs
+    LOG_DEBUG // Every vertex and particle, slow for big scenes
+};
+
+/** Leveled diagnostics of constructors **/
+// Messages above Log::level() are dropped, by default only errors get through so startup is silent.
+// Raise it with the log key of a scene file. Lines go to stdout, printf format.
+struct Log
+{
+    static int& level() { static int current = LOG_ERROR; return current; }
+    static bool enabled(int messageLevel) { return messageLevel <= level(); }
+
+    static void error(const char* format, ...) { va_list args; va_start(args, format); write(LOG_ERROR, format, args); va_end(args); }
+    static void info(const char* format, ...) { va_list args; va_start(args, format); write(LOG_INFO, format, args); va_end(args); }
+    static void debug(const char* format, ...) { va_list args; va_start(args, format); write(LOG_DEBUG, format, args); va_end(args); }
+
+private:
+    static void write(int messageLevel, const char* format, va_list args)
+    {
+        if (!enabled(messageLevel)) return;
+        vprintf(format, args);
+        printf("\n");
+    }
+};
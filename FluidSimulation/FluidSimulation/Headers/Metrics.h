@@ -0,0 +1,281 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <math.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "Fluid.h"
+
+/** Live metrics of a fluid, served in the Prometheus text format over HTTP **/
+// Add it to Fluid::observers and start it on a local port ("9100", bound to 127.0.0.1) or a Unix socket path :
+//     curl http://127.0.0.1:9100/metrics
+//     curl --unix-socket /tmp/fluid.sock http://localhost/metrics
+// The simulation only writes atomics : phase times at every phase, particle state every sampleInterval steps. Particle
+// state is measured by the density pass of the sampled step (Fluid::sampleStep), it costs no pass of its own.
+// The server thread only reads them, so a scrape never waits for a step and a step never waits for a scrape.
+class MetricsServer : public FluidObserver
+{
+public:
+    static const int sampleInterval = 10; // Steps between samples of particle state and the neighbor histogram
+
+private:
+    static const int numBuckets = 9;
+    const int bucketBounds[numBuckets - 1] = { 8, 16, 24, 32, 48, 64, 96, 128 }; // Neighbor counts, the last bucket is +Inf
+
+    std::atomic<long long> steps;
+    std::atomic<double> stepsPerSecond;
+    std::atomic<double> timestep;
+    std::atomic<int> particles;
+    std::atomic<int> sleeping;
+    std::atomic<double> maxDensityError, meanDensityError; // Relative to rest density
+    std::atomic<double> maxSpeed;
+    std::atomic<long long> phaseNanoseconds[NUM_PHASES];
+    std::atomic<long long> phaseCount[NUM_PHASES];
+    std::atomic<long long> neighborBuckets[numBuckets]; // Particles in every bucket, not cumulative
+    std::atomic<long long> neighborSum, neighborCount;
+
+    // Only touched by the simulation thread
+    std::chrono::steady_clock::time_point phaseStart[NUM_PHASES];
+    std::chrono::steady_clock::time_point sampleStart;
+    long long sampleSteps;
+
+    int listener;
+    std::string socketPath; // Unlinked when the server stops
+    std::thread server;
+    std::atomic<bool> stopping;
+
+public:
+    MetricsServer() : steps(0), stepsPerSecond(0), timestep(0), particles(0), sleeping(0), maxDensityError(0), meanDensityError(0),
+                      maxSpeed(0), neighborSum(0), neighborCount(0), sampleSteps(0), listener(-1), stopping(false)
+    {
+        for (int i = 0; i < NUM_PHASES; i ++) {
+            phaseNanoseconds[i] = 0;
+            phaseCount[i] = 0;
+        }
+        for (int i = 0; i < numBuckets; i ++) neighborBuckets[i] = 0;
+        sampleStart = std::chrono::steady_clock::now();
+    }
+    ~MetricsServer()
+    {
+        stop();
+    }
+
+    // Listen on a port of 127.0.0.1 if address is a number, else on a Unix socket at that path
+    bool start(const std::string& address)
+    {
+        int port = atoi(address.c_str());
+        if (port > 0 && address.find_first_not_of("0123456789") == std::string::npos) {
+            listener = socket(AF_INET, SOCK_STREAM, 0);
+            int reuse = 1;
+            setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+            struct sockaddr_in local;
+            memset(&local, 0, sizeof(local));
+            local.sin_family = AF_INET;
+            local.sin_port = htons(port);
+            local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            if (listener < 0 || bind(listener, (struct sockaddr*)&local, sizeof(local)) != 0 || listen(listener, 8) != 0) {
+                printf("MetricsServer: can't listen on 127.0.0.1:%d\n", port);
+                close(listener);
+                listener = -1;
+                return false;
+            }
+            printf("MetricsServer: serving http://127.0.0.1:%d/metrics\n", port);
+        } else {
+            struct sockaddr_un local;
+            memset(&local, 0, sizeof(local));
+            local.sun_family = AF_UNIX;
+            if (address.size() >= sizeof(local.sun_path)) {
+                printf("MetricsServer: socket path %s is too long\n", address.c_str());
+                return false;
+            }
+            strcpy(local.sun_path, address.c_str());
+            unlink(address.c_str());
+            listener = socket(AF_UNIX, SOCK_STREAM, 0);
+            if (listener < 0 || bind(listener, (struct sockaddr*)&local, sizeof(local)) != 0 || listen(listener, 8) != 0) {
+                printf("MetricsServer: can't listen on %s\n", address.c_str());
+                close(listener);
+                listener = -1;
+                return false;
+            }
+            socketPath = address;
+            printf("MetricsServer: serving /metrics on Unix socket %s\n", address.c_str());
+        }
+        server = std::thread(&MetricsServer::serve, this);
+        return true;
+    }
+    void stop()
+    {
+        stopping = true;
+        if (server.joinable()) server.join();
+        if (listener >= 0) close(listener);
+        listener = -1;
+        if (!socketPath.empty()) unlink(socketPath.c_str());
+        socketPath.clear();
+    }
+
+    /** FluidObserver **/
+    void phaseBegin(int phase)
+    {
+        phaseStart[phase] = std::chrono::steady_clock::now();
+    }
+    void phaseEnd(int phase)
+    {
+        phaseNanoseconds[phase] += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - phaseStart[phase]).count();
+        phaseCount[phase] ++;
+    }
+    void stepDone(Fluid* fluid, double timestep)
+    {
+        steps ++;
+        sampleSteps ++;
+        this->timestep = timestep;
+        if (steps % sampleInterval == 0 && fluid->sampleStep) {
+            sample(fluid);
+        }
+        fluid->sampleStep = (steps + 1) % sampleInterval == 0; // The density pass of the next step measures for the sample
+    }
+
+private:
+    void sample(Fluid* fluid)
+    {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        stepsPerSecond = sampleSteps / std::chrono::duration<double>(now - sampleStart).count();
+        sampleStart = now;
+        sampleSteps = 0;
+
+        const int maxCount = 255;
+        Fluid::StepSample stepSample = fluid->getSample(maxCount);
+        particles = (int)fluid->particles.size();
+        sleeping = fluid->sleepingParticles;
+        maxDensityError = stepSample.maxDensityError;
+        meanDensityError = stepSample.meanDensityError;
+        maxSpeed = stepSample.maxSpeed;
+
+        std::vector<long long> buckets(numBuckets, 0);
+        long long sum = 0, total = 0;
+        for (int k = 0; k <= maxCount; k ++) {
+            int b = 0;
+            while (b < numBuckets - 1 && k > bucketBounds[b]) b ++;
+            buckets[b] += stepSample.neighbors[k];
+            sum += k * stepSample.neighbors[k];
+            total += stepSample.neighbors[k];
+        }
+        for (int b = 0; b < numBuckets; b ++) neighborBuckets[b] = buckets[b];
+        neighborSum = sum;
+        neighborCount = total;
+    }
+
+    void serve()
+    {
+        while (!stopping) {
+            struct pollfd ready = { listener, POLLIN, 0 };
+            if (poll(&ready, 1, 200) <= 0) continue;
+            int client = accept(listener, NULL, NULL);
+            if (client < 0) continue;
+            struct timeval timeout = { 1, 0 };
+            setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+#ifdef SO_NOSIGPIPE
+            int noSignal = 1;
+            setsockopt(client, SOL_SOCKET, SO_NOSIGPIPE, &noSignal, sizeof(noSignal));
+#endif
+            char request[2048];
+            int length = (int)recv(client, request, sizeof(request) - 1, 0);
+            request[length > 0 ? length : 0] = '\0';
+            bool found = strncmp(request, "GET /metrics", 12) == 0 || strncmp(request, "GET / ", 6) == 0;
+            std::string body = found ? format() : "Not found, try /metrics\n";
+            char header[256];
+            snprintf(header, sizeof(header), "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %d\r\nConnection: close\r\n\r\n",
+                     found ? "200 OK" : "404 Not Found", (int)body.size());
+            std::string response = header + body;
+            int flags = 0;
+#ifdef MSG_NOSIGNAL
+            flags = MSG_NOSIGNAL;
+#endif
+            for (size_t sent = 0; sent < response.size(); ) {
+                ssize_t n = send(client, response.data() + sent, response.size() - sent, flags);
+                if (n <= 0) break;
+                sent += n;
+            }
+            close(client);
+        }
+    }
+
+    std::string format()
+    {
+        std::string text;
+        metric(text, "fluid_steps_total", "counter", "Steps simulated.", (double)steps);
+        metric(text, "fluid_steps_per_second", "gauge", "Steps per second over the last sample interval.", stepsPerSecond);
+        metric(text, "fluid_timestep", "gauge", "Current timestep in simulation time units.", timestep);
+        metric(text, "fluid_particles", "gauge", "Particles owned by this fluid.", particles);
+        metric(text, "fluid_sleeping_particles", "gauge", "Particles in sleeping cells.", sleeping);
+        metric(text, "fluid_density_error_max", "gauge", "Largest |density - restDensity| / restDensity of any particle in an awake cell.", maxDensityError);
+        metric(text, "fluid_density_error_mean", "gauge", "Mean |density - restDensity| / restDensity over awake cells.", meanDensityError);
+        metric(text, "fluid_speed_max", "gauge", "Largest particle speed in an awake cell.", maxSpeed);
+
+        char line[256];
+        text += "# HELP fluid_phase_seconds_total Time spent in every phase of a step.\n# TYPE fluid_phase_seconds_total counter\n";
+        for (int i = 0; i < NUM_PHASES; i ++) {
+            snprintf(line, sizeof(line), "fluid_phase_seconds_total{phase=\"%s\"} %.9f\n", phaseNames[i], phaseNanoseconds[i] * 1e-9);
+            text += line;
+        }
+        text += "# HELP fluid_phase_runs_total Times every phase ran.\n# TYPE fluid_phase_runs_total counter\n";
+        for (int i = 0; i < NUM_PHASES; i ++) {
+            snprintf(line, sizeof(line), "fluid_phase_runs_total{phase=\"%s\"} %lld\n", phaseNames[i], (long long)phaseCount[i]);
+            text += line;
+        }
+
+        text += "# HELP fluid_neighbors Neighbors within kernel radius of the particles of awake cells, at the last sample.\n# TYPE fluid_neighbors histogram\n";
+        long long cumulative = 0;
+        for (int b = 0; b < numBuckets; b ++) {
+            cumulative += neighborBuckets[b];
+            if (b < numBuckets - 1) snprintf(line, sizeof(line), "fluid_neighbors_bucket{le=\"%d\"} %lld\n", bucketBounds[b], cumulative);
+            else snprintf(line, sizeof(line), "fluid_neighbors_bucket{le=\"+Inf\"} %lld\n", cumulative);
+            text += line;
+        }
+        snprintf(line, sizeof(line), "fluid_neighbors_sum %lld\nfluid_neighbors_count %lld\n", (long long)neighborSum, (long long)neighborCount);
+        text += line;
+
+        metric(text, "process_resident_memory_bytes", "gauge", "Resident memory of the process.", residentBytes());
+        return text;
+    }
+
+    static void metric(std::string& text, const char* name, const char* type, const char* help, double value)
+    {
+        char line[512];
+        snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s %s\n%s %.9g\n", name, help, name, type, name, value);
+        text += line;
+    }
+
+public:
+    // Current resident set on Linux, peak resident set elsewhere
+    static double residentBytes()
+    {
+#ifdef __linux__
+        FILE* file = fopen("/proc/self/statm", "r");
+        if (file) {
+            long pages = 0, resident = 0;
+            int read = fscanf(file, "%ld %ld", &pages, &resident);
+            fclose(file);
+            if (read == 2) return (double)resident * sysconf(_SC_PAGESIZE);
+        }
+        return 0;
+#else
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        return (double)usage.ru_maxrss; // Bytes on macOS
+#endif
+    }
+};
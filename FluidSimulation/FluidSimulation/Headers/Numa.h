@@ -0,0 +1,151 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <dirent.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+/** NUMA topology and page placement **/
+// Read from sysfs and the move_pages system call, so libnuma isn't needed. On other systems there is
+// one node, every cpu is on it and page placement can't be queried or advised.
+class Numa
+{
+public:
+    // Nodes of the machine, 1 if unknown
+    static int numNodes()
+    {
+        int count = 0;
+#ifdef __linux__
+        DIR* dir = opendir("/sys/devices/system/node");
+        if (dir) {
+            for (struct dirent* entry = readdir(dir); entry; entry = readdir(dir)) {
+                int node;
+                char extra;
+                if (sscanf(entry->d_name, "node%d%c", &node, &extra) == 1) count ++;
+            }
+            closedir(dir);
+        }
+#endif
+        return count > 0 ? count : 1;
+    }
+
+    // Node a cpu belongs to, 0 if unknown
+    static int nodeOfCpu(int cpu)
+    {
+#ifdef __linux__
+        char path[64];
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+        DIR* dir = opendir(path);
+        if (dir) {
+            int node = 0;
+            for (struct dirent* entry = readdir(dir); entry; entry = readdir(dir)) {
+                char extra;
+                if (sscanf(entry->d_name, "node%d%c", &node, &extra) == 1) break;
+            }
+            closedir(dir);
+            return node;
+        }
+#endif
+        return 0;
+    }
+
+    // Cpus this process may run on, every cpu of node 0 first, then node 1 ...
+    // Threads pinned in this order in contiguous blocks share a node.
+    static std::vector<int> cpusByNode()
+    {
+        std::vector<int> cpus;
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+            std::vector< std::pair<int, int> > nodeCpu;
+            for (int cpu = 0; cpu < CPU_SETSIZE; cpu ++) {
+                if (CPU_ISSET(cpu, &set)) nodeCpu.push_back(std::make_pair(nodeOfCpu(cpu), cpu));
+            }
+            std::sort(nodeCpu.begin(), nodeCpu.end());
+            for (int i = 0; i < nodeCpu.size(); i ++) cpus.push_back(nodeCpu[i].second);
+        }
+#endif
+        return cpus;
+    }
+
+    // Node holding the page of every address, -1 where it isn't known (not touched yet, or no move_pages here)
+    static std::vector<int> nodesOf(const std::vector<const void*>& addresses)
+    {
+        std::vector<int> nodes(addresses.size(), -1);
+#ifdef __linux__
+        const int batch = 4096;
+        std::vector<void*> pages(batch);
+        std::vector<int> status(batch);
+        for (int begin = 0; begin < addresses.size(); begin += batch) {
+            int count = std::min(batch, (int)addresses.size() - begin);
+            for (int i = 0; i < count; i ++) pages[i] = pageOf(addresses[begin + i]);
+            // No target nodes : only asks where the pages are
+            if (syscall(SYS_move_pages, 0, (unsigned long)count, &pages[0], NULL, &status[0], 0) != 0) {
+                break;
+            }
+            for (int i = 0; i < count; i ++) nodes[begin + i] = status[i] >= 0 ? status[i] : -1;
+        }
+#endif
+        return nodes;
+    }
+
+    // Advise transparent huge pages for the pages overlapping [begin, begin + bytes). Only works where THP is
+    // "madvise" or "always" (/sys/kernel/mm/transparent_hugepage/enabled), pages already touched are collapsed later by khugepaged.
+    static bool adviseHugePages(const void* begin, size_t bytes)
+    {
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+        if (bytes == 0) return true;
+        char* first = (char*)pageOf(begin);
+        char* last = (char*)pageOf((const char*)begin + bytes - 1);
+        return madvise(first, last - first + pageSize(), MADV_HUGEPAGE) == 0;
+#else
+        return false;
+#endif
+    }
+
+    // Print how many distinct pages holding the objects at addresses are on every node
+    static void report(const char* name, const std::vector<const void*>& addresses)
+    {
+        std::vector<const void*> pages(addresses.size());
+        for (int i = 0; i < addresses.size(); i ++) pages[i] = pageOf(addresses[i]);
+        std::sort(pages.begin(), pages.end());
+        pages.erase(std::unique(pages.begin(), pages.end()), pages.end());
+        std::vector<int> nodes = nodesOf(pages);
+        int numNodes = Numa::numNodes();
+        std::vector<int> perNode(numNodes + 1, 0); // Last one counts unknown pages
+        for (int i = 0; i < nodes.size(); i ++) {
+            perNode[nodes[i] >= 0 && nodes[i] < numNodes ? nodes[i] : numNodes] ++;
+        }
+        printf("Numa: %-10s %8d objects on %6d pages :", name, (int)addresses.size(), (int)pages.size());
+        double percent = pages.empty() ? 0.0 : 100.0 / pages.size();
+        for (int n = 0; n < numNodes; n ++) {
+            printf(" node %d %d (%.0f%%)", n, perNode[n], perNode[n] * percent);
+        }
+        if (perNode[numNodes] > 0) {
+            printf(" unknown %d (%.0f%%)", perNode[numNodes], perNode[numNodes] * percent);
+        }
+        printf("\n");
+    }
+
+private:
+    static size_t pageSize()
+    {
+#ifdef __linux__
+        static size_t size = (size_t)sysconf(_SC_PAGESIZE);
+        return size;
+#else
+        return 4096;
+#endif
+    }
+    static void* pageOf(const void* address) { return (void*)((size_t)address & ~(pageSize() - 1)); }
+};
@@ -0,0 +1,147 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+
+#include "Numa.h"
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+/** Persistent worker threads, the calling thread works as thread 0 **/
+// Jobs can't be nested : don't call run() from inside a job.
+class ThreadPool
+{
+public:
+    int numThreads;
+    std::vector<int> cores; // Core each thread is pinned to, empty until pinThreads
+
+private:
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    std::function<void(int)> job;
+    int generation; // Increased for every job
+    int pending; // Workers still running current job
+    bool stopping;
+
+public:
+    // numThreads <= 0 : one thread per hardware thread
+    ThreadPool(int numThreads = 0) : generation(0), pending(0), stopping(false)
+    {
+        if (numThreads <= 0) {
+            numThreads = (int)std::thread::hardware_concurrency();
+        }
+        this->numThreads = numThreads > 0 ? numThreads : 1;
+        for (int i = 1; i < this->numThreads; i ++) {
+            workers.push_back(std::thread(&ThreadPool::work, this, i));
+        }
+    }
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (int i = 0; i < workers.size(); i ++) {
+            workers[i].join();
+        }
+    }
+
+    // Run func(thread) on every thread and wait for all of them
+    void run(std::function<void(int)> func)
+    {
+        if (numThreads == 1) {
+            func(0);
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job = func;
+            pending = numThreads - 1;
+            generation ++;
+        }
+        wake.notify_all();
+        func(0);
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [this] { return pending == 0; });
+    }
+
+    // Split [0, count) into one contiguous range per thread : func(begin, end, thread)
+    void parallelFor(int count, std::function<void(int, int, int)> func)
+    {
+        int n = numThreads;
+        run([count, n, &func](int thread) {
+            int begin = blockBegin(count, thread, n);
+            int end = blockBegin(count, thread+1, n);
+            if (begin < end) func(begin, end, thread);
+        });
+    }
+    // First index of the range parallelFor gives thread out of n threads
+    static int blockBegin(int count, int thread, int n) { return (int)((long long)count * thread / n); }
+
+    // Hand out [0, count) one index at a time to whichever thread is free : func(index, thread)
+    void parallelForDynamic(int count, std::function<void(int, int)> func)
+    {
+        std::atomic<int> next(0);
+        run([count, &next, &func](int thread) {
+            for (int i = next++; i < count; i = next++) {
+                func(i, thread);
+            }
+        });
+    }
+
+    // Bind every thread to its own core (wrapping around), return false if pinning isn't supported here.
+    // Cores are taken node by node, so the threads of neighboring parallelFor ranges share a NUMA node.
+    // macOS has no API to bind a thread to a core, there threads are left to the scheduler.
+    bool pinThreads()
+    {
+#ifdef __linux__
+        std::vector<int> cpus = Numa::cpusByNode();
+        if (cpus.empty()) return false;
+        cores.resize(numThreads);
+        for (int i = 0; i < numThreads; i ++) cores[i] = cpus[i % cpus.size()];
+        std::atomic<int> failed(0);
+        run([this, &failed](int thread) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cores[thread], &set);
+            if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) failed ++;
+        });
+        if (failed > 0) cores.clear();
+        return failed == 0;
+#else
+        return false;
+#endif
+    }
+
+private:
+    void work(int thread)
+    {
+        int seen = 0;
+        while (true) {
+            std::function<void(int)> func;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [this, seen] { return stopping || generation != seen; });
+                if (stopping) return;
+                seen = generation;
+                func = job;
+            }
+            func(thread);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                pending --;
+                if (pending == 0) done.notify_one();
+            }
+        }
+    }
+};
@@ -0,0 +1,214 @@
+#pragma once
+
+#include <vector>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <errno.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#include "Fluid.h"
+#include "Parallel.h"
+
+/** Hardware performance counters around the phases of a step and around rendering **/
+// Linux perf_event_open, user space only, so perf_event_paranoid up to 2 is fine. Every thread of the pool
+// counts for itself and a phase adds up all threads. Events that can't be opened (no PMU in a VM, paranoid 3,
+// not Linux) are left out and reported as unavailable, wall time is always measured.
+// Add it to Fluid::observers, and wrap rendering in begin(SLOT_RENDER) / end(SLOT_RENDER).
+class PerfCounters : public FluidObserver
+{
+public:
+    enum Event { CYCLES, INSTRUCTIONS, L1D_MISSES, LLC_MISSES, BRANCH_MISSES, NUM_EVENTS };
+    static const int SLOT_RENDER = NUM_PHASES; // Slots are the phases of Fluid, then rendering
+    static const int NUM_SLOTS = NUM_PHASES + 1;
+
+    struct Sample // Counts of one slot
+    {
+        double wall; // Seconds
+        double events[NUM_EVENTS];
+        long long runs;
+
+        Sample() : wall(0), runs(0) { for (int e = 0; e < NUM_EVENTS; e ++) events[e] = 0; }
+    };
+
+    Sample step[NUM_SLOTS]; // Counts of the last step, rendering after a step is counted with the next one
+    Sample total[NUM_SLOTS]; // Counts of every step
+    int reportInterval; // Steps between reports of the last step, 0 : only the totals are reported
+    long long steps;
+
+private:
+    int numThreads;
+    std::vector<int> fds; // [thread * NUM_EVENTS + event], -1 where the event isn't available
+    bool available[NUM_EVENTS];
+    double startValues[NUM_SLOTS][NUM_EVENTS];
+    std::chrono::steady_clock::time_point startTime[NUM_SLOTS];
+
+public:
+    // pool can be NULL, then only the calling thread is counted
+    PerfCounters(ThreadPool* pool, int reportInterval = 0) : reportInterval(reportInterval), steps(0)
+    {
+        numThreads = pool ? pool->numThreads : 1;
+        fds.assign(numThreads * NUM_EVENTS, -1);
+        int failure = 0;
+        std::function<void(int)> open = [this, &failure](int thread) {
+            for (int e = 0; e < NUM_EVENTS; e ++) {
+                fds[thread * NUM_EVENTS + e] = openEvent(e);
+                if (fds[thread * NUM_EVENTS + e] < 0 && thread == 0) failure = errno;
+            }
+        };
+        if (pool) pool->run(open);
+        else open(0);
+        int count = 0;
+        for (int e = 0; e < NUM_EVENTS; e ++) {
+            available[e] = true;
+            for (int t = 0; t < numThreads; t ++) available[e] &= fds[t * NUM_EVENTS + e] >= 0;
+            count += available[e];
+        }
+        printf("PerfCounters: %d of %d events on %d threads", count, (int)NUM_EVENTS, numThreads);
+        if (count < NUM_EVENTS) {
+            printf(", unavailable :");
+            for (int e = 0; e < NUM_EVENTS; e ++) if (!available[e]) printf(" %s", eventNames()[e]);
+#ifdef __linux__
+            printf(" (%s%s)", strerror(failure), failure == EACCES || failure == EPERM ? ", see /proc/sys/kernel/perf_event_paranoid" : "");
+#else
+            printf(" (perf_event_open is Linux only)");
+#endif
+        }
+        printf("\n");
+        for (int s = 0; s < NUM_SLOTS; s ++) {
+            for (int e = 0; e < NUM_EVENTS; e ++) startValues[s][e] = 0;
+        }
+    }
+    ~PerfCounters()
+    {
+#ifdef __linux__
+        for (int i = 0; i < fds.size(); i ++) {
+            if (fds[i] >= 0) close(fds[i]);
+        }
+#endif
+    }
+
+    void begin(int slot)
+    {
+        for (int e = 0; e < NUM_EVENTS; e ++) startValues[slot][e] = available[e] ? read(e) : 0;
+        startTime[slot] = std::chrono::steady_clock::now();
+    }
+    void end(int slot)
+    {
+        double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime[slot]).count();
+        step[slot].wall += wall;
+        total[slot].wall += wall;
+        for (int e = 0; e < NUM_EVENTS; e ++) {
+            double count = available[e] ? read(e) - startValues[slot][e] : 0;
+            step[slot].events[e] += count;
+            total[slot].events[e] += count;
+        }
+        step[slot].runs ++;
+        total[slot].runs ++;
+    }
+
+    /** FluidObserver **/
+    void phaseBegin(int phase) { begin(phase); }
+    void phaseEnd(int phase) { end(phase); }
+    void stepDone(Fluid* fluid, double timestep)
+    {
+        steps ++;
+        if (reportInterval > 0 && steps % reportInterval == 0) {
+            char title[64];
+            snprintf(title, sizeof(title), "step %lld", steps);
+            report(title, step);
+        }
+        for (int s = 0; s < NUM_SLOTS; s ++) step[s] = Sample();
+    }
+
+    void reportTotals()
+    {
+        char title[64];
+        snprintf(title, sizeof(title), "total of %lld steps", steps);
+        report(title, total);
+    }
+
+private:
+    static const char* const* eventNames()
+    {
+        static const char* const names[NUM_EVENTS] = { "cycles", "instructions", "L1d-misses", "LLC-misses", "branch-misses" };
+        return names;
+    }
+    static const char* slotName(int slot) { return slot == SLOT_RENDER ? "render" : phaseNames[slot]; }
+
+    // Table of every slot that ran : wall time, counts, instructions per cycle and misses per 1000 instructions
+    void report(const char* title, const Sample* samples)
+    {
+        printf("PerfCounters: %s\n", title);
+        printf("\t%-10s %10s %14s %14s %6s %12s %12s %12s %8s %8s %8s\n", "slot", "ms", "cycles", "instructions", "IPC",
+               "L1d-misses", "LLC-misses", "br-misses", "L1d/ki", "LLC/ki", "br/ki");
+        for (int s = 0; s < NUM_SLOTS; s ++) {
+            const Sample& sample = samples[s];
+            if (sample.runs == 0) continue;
+            double instructions = sample.events[INSTRUCTIONS];
+            printf("\t%-10s %10.3f", slotName(s), sample.wall * 1e3);
+            printCount(available[CYCLES], sample.events[CYCLES], 14, 0);
+            printCount(available[INSTRUCTIONS], instructions, 14, 0);
+            printCount(available[CYCLES] && available[INSTRUCTIONS] && sample.events[CYCLES] > 0, instructions / sample.events[CYCLES], 6, 2);
+            for (int e = L1D_MISSES; e < NUM_EVENTS; e ++) {
+                printCount(available[e], sample.events[e], 12, 0);
+            }
+            for (int e = L1D_MISSES; e < NUM_EVENTS; e ++) {
+                printCount(available[e] && available[INSTRUCTIONS] && instructions > 0, sample.events[e] / instructions * 1000, 8, 2);
+            }
+            printf("\n");
+        }
+    }
+    static void printCount(bool known, double value, int width, int decimals)
+    {
+        if (known) printf(" %*.*f", width, decimals, value);
+        else printf(" %*s", width, "-");
+    }
+
+    // Sum of an event over every thread, scaled up if the kernel multiplexed it
+    double read(int event)
+    {
+        double sum = 0;
+#ifdef __linux__
+        for (int t = 0; t < numThreads; t ++) {
+            uint64_t values[3]; // value, time enabled, time running
+            if (::read(fds[t * NUM_EVENTS + event], values, sizeof(values)) != sizeof(values)) continue;
+            sum += values[2] > 0 && values[2] < values[1] ? (double)values[0] * values[1] / values[2] : (double)values[0];
+        }
+#endif
+        return sum;
+    }
+
+    // Counter of the calling thread on any cpu, -1 if it can't be opened
+    static int openEvent(int event)
+    {
+#ifdef __linux__
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.disabled = 0;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        switch (event) {
+            case CYCLES: attr.type = PERF_TYPE_HARDWARE; attr.config = PERF_COUNT_HW_CPU_CYCLES; break;
+            case INSTRUCTIONS: attr.type = PERF_TYPE_HARDWARE; attr.config = PERF_COUNT_HW_INSTRUCTIONS; break;
+            case L1D_MISSES:
+                attr.type = PERF_TYPE_HW_CACHE;
+                attr.config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+                break;
+            case LLC_MISSES: attr.type = PERF_TYPE_HARDWARE; attr.config = PERF_COUNT_HW_CACHE_MISSES; break;
+            default: attr.type = PERF_TYPE_HARDWARE; attr.config = PERF_COUNT_HW_BRANCH_MISSES; break;
+        }
+        return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+        return -1;
+#endif
+    }
+};
@@ -16,25 +16,22 @@ public:
     ~Vertex() {}
 };
 
-struct Particle
+struct Particle // Slots come from blocks of Fluid, see Fluid::newParticle
 {
-    int     index;
+    CompactVec3 position;
+    CompactVec3 velocity;
     double  mass;
     double  density;
-    double  restitution;
-    Vec3    color;
-    Vec3    position;
-    Vec3    velocity;
-    Vec3    acceleration;
-    Vec3    fPressure;
-    Vec3    fViscosity;
+    double  radius; // Smoothing length, heavier particles of adaptive fluids have a longer one
+    int     index;
+    int     origin; // Lattice index of the initial particle its color follows from, see Fluid::getColor
+    // Restitution is the same for a whole fluid
     
     Particle() { }
-    Particle(int index, Vec3 color, Vec3 position) : index(index), color(color), position(position), velocity(0, 0, 0), acceleration(0, 0, 0), fPressure(0, 0, 0), fViscosity(0, 0, 0)
+    Particle(int index, Vec3 position) : position(position), velocity(0, 0, 0), index(index), origin(index)
     {
         mass = 1.0;
         density = 0.0;
-        restitution = 0.5;
+        radius = 1.0;
     }
-    ~Particle() { }
 };
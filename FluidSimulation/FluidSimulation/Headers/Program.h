@@ -9,6 +9,8 @@
 
 #include <unistd.h> // To use getcwd()
 
+#include "Log.h"
+
 class Program
 {
 public:
@@ -31,7 +33,7 @@ public:
             char currPath[256];
             char *currPathPtr = getcwd(currPath, sizeof(currPath));
             if (currPathPtr) {
-                std::cout << "Working at: " << currPath << std::endl;
+                Log::info("Working at: %s", currPath);
             }
             // Open file
             vsFile.open(vsFilePath);
@@ -47,7 +49,7 @@ public:
             vsSrc = vsStream.str();
             fsSrc = fsStream.str();
         } catch (std::ifstream::failure e) {
-            std::cout << "ERROR::SHADER::FILE_NOT_SUCCESSFULLY_READ" << std::endl;
+            Log::error("ERROR::SHADER::FILE_NOT_SUCCESSFULLY_READ");
         }
         
         const char *vsCode = vsSrc.c_str();
@@ -69,7 +71,7 @@ public:
         glGetShaderiv(vs, GL_COMPILE_STATUS, &cFlag);
         if (!cFlag) {
             glGetShaderInfoLog(vs, 512, NULL, cLog);
-            std::cout << "ERROR::SHADER::VERTEX::COMPILATION_FAILED\n" << cLog << std::endl;
+            Log::error("ERROR::SHADER::VERTEX::COMPILATION_FAILED\n%s", cLog);
         }
         
         // Fragment shader
@@ -80,7 +82,7 @@ public:
         glGetShaderiv(fs, GL_COMPILE_STATUS, &cFlag);
         if (!cFlag) {
             glGetShaderInfoLog(fs, 512, NULL, cLog);
-            std::cout << "ERROR::SHADER::FRAGMENT::COMPILATION_FAILED\n" << cLog << std::endl;
+            Log::error("ERROR::SHADER::FRAGMENT::COMPILATION_FAILED\n%s", cLog);
         }
         
         // Shader program
@@ -92,7 +94,7 @@ public:
         glGetProgramiv(ID, GL_LINK_STATUS, &cFlag);
         if (!cFlag) {
             glGetProgramInfoLog(ID, 512, NULL, cLog);
-            std::cout << "ERROR::SHADER::PROGRAM::LINKING_FAILED\n" << cLog << std::endl;
+            Log::error("ERROR::SHADER::PROGRAM::LINKING_FAILED\n%s", cLog);
         }
         
         // Clean linked shaders (What we actually need is the shader program)
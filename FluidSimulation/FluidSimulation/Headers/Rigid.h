@@ -1,6 +1,7 @@
 #pragma once
 
 #include "Point.h"
+#include "Log.h"
 
 struct Ground
 {
@@ -38,7 +39,7 @@ struct Ground
             vertexes[i]->normal = Vec3(0.0, 1.0, 0.0); // It's not neccessery to normalize here
             
             // Debug info
-            printf("Ground[%d]: (%f, %f, %f) - (%f, %f, %f)\n", i, vertexes[i]->position.x, vertexes[i]->position.y, vertexes[i]->position.z, vertexes[i]->normal.x, vertexes[i]->normal.y, vertexes[i]->normal.z);
+            Log::debug("Ground[%d]: (%f, %f, %f) - (%f, %f, %f)", i, vertexes[i]->position.x, vertexes[i]->position.y, vertexes[i]->position.z, vertexes[i]->normal.x, vertexes[i]->normal.y, vertexes[i]->normal.z);
         }
         
         faces.push_back(vertexes[0]);
@@ -77,7 +78,7 @@ public:
     Vertex* getVertex(int x, int y)
     {
         if (x < 0 || x >= parallelNum || y < 0 || y >= meridianNum) {
-            printf("Vertex Index Out of Range.\n");
+            Log::error("Vertex Index Out of Range.");
             exit(-1);
         } else {
             return vertexes[1+x*meridianNum+y];
@@ -186,5 +187,8 @@ struct Ball
         
         sphere = new Sphere(radius);
     }
-    ~Ball() {}
+    ~Ball()
+    {
+        delete sphere;
+    }
 };
@@ -0,0 +1,279 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+
+#include "Vector.h"
+#include "Fluid.h"
+#include "Collider.h"
+#include "DistanceField.h"
+
+/** Scene description, the defaults are the built-in scene **/
+// Scene files have one "key = value" per line, vectors are 3 numbers separated by spaces and # starts a comment.
+// A line "sweep key = v1 v2 ..." makes the key a sweep axis, see Sweep.h.
+struct Scene
+{
+    Vec3 boundaryPosition;
+    Vec3 boundarySize;
+    Vec3 fluidSize;
+    Vec3 fluidPosOffset;
+    Vec3 fluidInitVelocity;
+    Vec3 gravity;
+    Vec3 groundPosition;
+    Vec3 ballPosition;
+    int ballRadius;
+    Vec3 emitterOffset, emitterSize, emitterVelocity;
+    double emitterRate; // Particles per unit of simulation time, 0 : no emitter, see Fluid::updateSources
+    Vec3 sinkOffset, sinkSize; // No sink while its size is 0
+    double sinkRate; // Most particles removed per unit of simulation time, 0 : every particle inside
+    std::string meshPath; // OBJ file of a closed static mesh the fluid collides with, "" : none, see DistanceFieldCollider
+    std::string meshCache; // File its baked distance field is kept in, "" : baked every run
+    Vec3 meshOffset; // Mesh coordinates to world coordinates
+    double meshResolution; // Node interval of the distance field
+    std::string directory; // Of the scene file, relative mesh and cache paths start there
+    FluidParams params;
+    double timestep;
+    int steps; // Only used by headless runs
+    int threads; // Threads of an interactive or distributed run, 0 : one per core. Sweep jobs run on one thread each.
+    int deterministic; // Bit-identical results for any thread count or process split, see Fluid::deterministic
+    int taskGraph; // Phases of blocks of cells run as dependent tasks, see Fluid::taskGraph
+    int numa; // Steps between placements of particles on the NUMA nodes of their threads, 0 : off, see Fluid::placeParticles
+    int hugePages; // Advise transparent huge pages for placed particles
+    int perf; // Hardware counters per phase : steps between reports of a step, -1 : only totals, 0 : off, see PerfCounters
+    int profileCells; // Steps averaged in every export of cell costs, 0 : off, see CellProfiler
+    int renderCull; // Grid cells outside the camera frustum aren't drawn, see FluidRender::gather
+    double renderLod; // Grid cells farther than this from the camera are drawn as one point, 0 : never
+    int renderSurface; // Only grid cells at the surface of the fluid are drawn, see FluidRender::surfaceOnly
+    std::string metrics; // Port on 127.0.0.1 or Unix socket path the metrics are served on, "0" : off, see MetricsServer
+    int log; // LogLevel of constructor diagnostics, 0 : errors only
+
+    struct Axis // Values a swept key takes
+    {
+        std::string key;
+        std::vector<std::string> values;
+    };
+    std::vector<Axis> sweep;
+
+    Scene() : boundaryPosition(-3.25, -2, -12), boundarySize(13, 13, 13),
+              fluidSize(6, 6, 6), fluidPosOffset(0, 6, 2), fluidInitVelocity(7, 0, 0), gravity(0, -1, 0),
+              groundPosition(-20, -6.5, -8), ballPosition(5, 5, -17), ballRadius(2),
+              emitterOffset(0.5, 10, 5), emitterSize(1, 1, 3), emitterVelocity(4, 0, 0), emitterRate(0),
+              sinkOffset(11, 0, 0), sinkSize(0, 0, 0), sinkRate(0), meshOffset(0, 0, 0), meshResolution(0.25),
+              timestep(0.04), steps(1000), threads(0), deterministic(0), taskGraph(0), numa(0), hugePages(0), perf(0), profileCells(0), renderCull(1), renderLod(0), renderSurface(0), metrics("0"), log(LOG_ERROR) { }
+
+    bool load(const char* path)
+    {
+        FILE* file = fopen(path, "r");
+        if (!file) {
+            printf("Scene: can't open %s\n", path);
+            return false;
+        }
+        const char* slash = strrchr(path, '/');
+        directory = slash ? std::string(path, slash - path + 1) : "";
+        char line[1024];
+        int lineNumber = 0;
+        bool ok = true;
+        while (fgets(line, sizeof(line), file)) {
+            lineNumber ++;
+            char* comment = strchr(line, '#');
+            if (comment) *comment = '\0';
+            char* equal = strchr(line, '=');
+            std::string key = trim(std::string(line, equal ? equal - line : strlen(line)));
+            if (key.empty()) continue;
+            if (!equal) {
+                printf("Scene: %s:%d : expected key = value\n", path, lineNumber);
+                ok = false;
+                continue;
+            }
+            std::string value = trim(equal + 1);
+
+            if (key.compare(0, 6, "sweep ") == 0) {
+                Axis axis;
+                axis.key = trim(key.substr(6));
+                char* rest = &value[0];
+                for (char* token = strtok(rest, " \t"); token; token = strtok(NULL, " \t")) {
+                    axis.values.push_back(token);
+                }
+                // Every value has to be valid for the key
+                Scene check;
+                for (int i = 0; i < axis.values.size(); i ++) {
+                    if (!check.set(axis.key, axis.values[i])) {
+                        printf("Scene: %s:%d : bad sweep value %s for %s\n", path, lineNumber, axis.values[i].c_str(), axis.key.c_str());
+                        ok = false;
+                    }
+                }
+                if (axis.values.empty()) {
+                    printf("Scene: %s:%d : sweep of %s has no values\n", path, lineNumber, axis.key.c_str());
+                    ok = false;
+                }
+                sweep.push_back(axis);
+            } else if (!set(key, value)) {
+                printf("Scene: %s:%d : bad value for %s\n", path, lineNumber, key.c_str());
+                ok = false;
+            }
+        }
+        fclose(file);
+        return ok;
+    }
+
+    // Why building this scene would exit (the Boundary and Fluid constructors, a missing mesh), NULL when it won't
+    const char* invalidReason() const
+    {
+        if (boundarySize.x <= 0 || boundarySize.y <= 0 || boundarySize.z <= 0) return "boundary size must be positive";
+        if (fluidSize.x <= 0 || fluidSize.y <= 0 || fluidSize.z <= 0) return "fluid size must be positive";
+        if (fluidPosOffset.x < 0 || fluidPosOffset.y < 0 || fluidPosOffset.z < 0) return "fluid offset can't be negative";
+        if (fluidPosOffset.x+fluidSize.x > boundarySize.x || fluidPosOffset.y+fluidSize.y > boundarySize.y ||
+            fluidPosOffset.z+fluidSize.z > boundarySize.z) return "fluid out of boundary";
+        if (!params.isValid()) return "fluid constants out of range";
+        if (!(timestep > 0)) return "timestep must be positive";
+        if (steps < 0) return "steps can't be negative";
+        if (!meshPath.empty()) {
+            if (!(meshResolution > 0)) return "mesh resolution must be positive";
+            FILE* mesh = fopen(resolvePath(meshPath).c_str(), "r");
+            if (!mesh) return "mesh file can't be opened";
+            fclose(mesh);
+        }
+        return NULL;
+    }
+
+    // Emitter and sink of the scene, if it has them
+    void addSources(Fluid* fluid) const
+    {
+        if (emitterRate > 0) {
+            fluid->emitters.push_back(Emitter(emitterOffset, emitterSize, emitterVelocity, emitterRate));
+        }
+        if (sinkSize.x > 0 && sinkSize.y > 0 && sinkSize.z > 0) {
+            fluid->sinks.push_back(Sink(sinkOffset, sinkSize, sinkRate));
+        }
+    }
+
+    // Ball, ground and mesh of the scene
+    void addColliders(ColliderSet* colliders) const
+    {
+        colliders->add(new SphereCollider(ballPosition, ballRadius));
+        colliders->add(new PlaneCollider(groundPosition, Vec3(0, 1, 0)));
+        addMesh(colliders);
+    }
+
+    // Distance field collider of the mesh, if the scene has one. The field reaches a kernel radius plus a node past
+    // the mesh, so particles closer than the margin are always inside it.
+    void addMesh(ColliderSet* colliders) const
+    {
+        if (meshPath.empty()) return;
+        std::string path = resolvePath(meshPath), cache = meshCache.empty() ? "" : resolvePath(meshCache);
+        std::vector<Vertex> corners;
+        if (!DistanceField::readObj(path.c_str(), corners)) {
+            Log::error("Scene: can't read mesh %s", path.c_str());
+            exit(-1);
+        }
+        std::vector<Vertex*> faces(corners.size());
+        for (int i = 0; i < corners.size(); i ++) {
+            faces[i] = &corners[i];
+        }
+        int padding = (int)ceil(params.kernelRadius / meshResolution) + 1;
+        DistanceField* field = new DistanceField(faces, meshOffset, meshResolution, padding, cache.empty() ? NULL : cache.c_str());
+        colliders->add(new DistanceFieldCollider(field));
+    }
+
+    // Set one key from its text value, return false if the key is unknown or the value can't be parsed
+    bool set(const std::string& key, const std::string& value)
+    {
+        if (key == "boundary.position") return parse(value, boundaryPosition);
+        if (key == "boundary.size") return parse(value, boundarySize);
+        if (key == "fluid.size") return parse(value, fluidSize);
+        if (key == "fluid.offset") return parse(value, fluidPosOffset);
+        if (key == "fluid.velocity") return parse(value, fluidInitVelocity);
+        if (key == "fluid.jitter") return parse(value, params.jitter);
+        if (key == "fluid.relax") return parse(value, params.relaxSteps);
+        if (key == "gravity") return parse(value, gravity);
+        if (key == "ground.position") return parse(value, groundPosition);
+        if (key == "ball.position") return parse(value, ballPosition);
+        if (key == "ball.radius") return parse(value, ballRadius);
+        if (key == "emitter.offset") return parse(value, emitterOffset);
+        if (key == "emitter.size") return parse(value, emitterSize);
+        if (key == "emitter.velocity") return parse(value, emitterVelocity);
+        if (key == "emitter.rate") return parse(value, emitterRate);
+        if (key == "sink.offset") return parse(value, sinkOffset);
+        if (key == "sink.size") return parse(value, sinkSize);
+        if (key == "sink.rate") return parse(value, sinkRate);
+        if (key == "mesh.path") {
+            meshPath = value;
+            return !value.empty();
+        }
+        if (key == "mesh.cache") {
+            meshCache = value;
+            return !value.empty();
+        }
+        if (key == "mesh.offset") return parse(value, meshOffset);
+        if (key == "mesh.resolution") return parse(value, meshResolution);
+        if (key == "gasConst") return parse(value, params.gasConst);
+        if (key == "restDensity") return parse(value, params.restDensity);
+        if (key == "viscosity") return parse(value, params.viscosity);
+        if (key == "kernelRadius") return parse(value, params.kernelRadius);
+        if (key == "kernelTable") return parse(value, params.kernelTable);
+        if (key == "sleep.steps") return parse(value, params.sleepSteps);
+        if (key == "sleep.velocity") return parse(value, params.sleepVelocity);
+        if (key == "sleep.density") return parse(value, params.sleepDensity);
+        if (key == "merge.mass") return parse(value, params.mergeMass);
+        if (key == "merge.distance") return parse(value, params.mergeDistance);
+        if (key == "kernel") {
+            if (value == "muller") params.kernel = KERNEL_MULLER;
+            else if (value == "cubic") params.kernel = KERNEL_CUBIC_SPLINE;
+            else if (value == "wendland") params.kernel = KERNEL_WENDLAND;
+            else return false;
+            return true;
+        }
+        if (key == "timestep") return parse(value, timestep);
+        if (key == "steps") return parse(value, steps);
+        if (key == "threads") return parse(value, threads);
+        if (key == "deterministic") return parse(value, deterministic);
+        if (key == "taskGraph") return parse(value, taskGraph);
+        if (key == "numa") return parse(value, numa);
+        if (key == "hugePages") return parse(value, hugePages);
+        if (key == "perf") return parse(value, perf);
+        if (key == "profile.cells") return parse(value, profileCells);
+        if (key == "render.cull") return parse(value, renderCull);
+        if (key == "render.lod") return parse(value, renderLod);
+        if (key == "render.surface") return parse(value, renderSurface);
+        if (key == "log") return parse(value, log);
+        if (key == "metrics") {
+            metrics = value;
+            return !value.empty();
+        }
+        return false;
+    }
+
+private:
+    std::string resolvePath(const std::string& path) const
+    {
+        return path[0] == '/' ? path : directory + path;
+    }
+    static std::string trim(const std::string& text)
+    {
+        size_t begin = text.find_first_not_of(" \t\r\n");
+        if (begin == std::string::npos) return "";
+        size_t end = text.find_last_not_of(" \t\r\n");
+        return text.substr(begin, end - begin + 1);
+    }
+    static bool parse(const std::string& text, double& value)
+    {
+        char extra;
+        return sscanf(text.c_str(), "%lf %c", &value, &extra) == 1;
+    }
+    static bool parse(const std::string& text, int& value)
+    {
+        char extra;
+        return sscanf(text.c_str(), "%d %c", &value, &extra) == 1;
+    }
+    static bool parse(const std::string& text, Vec3& value)
+    {
+        char extra;
+        double x, y, z;
+        if (sscanf(text.c_str(), "%lf %lf %lf %c", &x, &y, &z, &extra) != 3) return false;
+        value = Vec3(x, y, z);
+        return true;
+    }
+};
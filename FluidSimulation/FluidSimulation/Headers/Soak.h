@@ -0,0 +1,159 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+#if defined(__GLIBC__)
+#include <malloc.h>
+#elif defined(__APPLE__)
+#include <malloc/malloc.h>
+#endif
+
+#include "Fluid.h"
+#include "Scene.h"
+#include "Display.h"
+#include "Metrics.h"
+
+/** Long run that fails when memory keeps growing **/
+// Steps the fluid of a scene, with its emitters and sinks so particles keep being made and freed. Every cycleInterval
+// steps a fluid, ball and ground are built and destroyed, and so are all renderers with a GL context, after one flush
+// each; FluidRender draws the stepping fluid. Resident memory and the bytes the allocator has handed out are sampled
+// 100 times. The largest sample of the first tenth of the steps is the baseline, a later sample more than bound bytes
+// above it fails the run.
+class SoakTest
+{
+public:
+    struct Sample
+    {
+        long long step;
+        double resident; // Bytes, peak resident set where the current one isn't known
+        double allocated; // Bytes in use from the allocator, -1 if it can't tell
+        int particles;
+    };
+
+    std::vector<Sample> samples;
+    int cycles; // Build and destroy cycles run
+
+    SoakTest() : cycles(0) { }
+
+    // render needs a current GL context with glad loaded
+    bool run(const Scene& scene, long long steps, int cycleInterval, double bound, bool render)
+    {
+        Boundary boundary(scene.boundaryPosition, scene.boundarySize);
+        ThreadPool threadPool(scene.threads);
+        Fluid fluid(&boundary, scene.fluidSize, scene.fluidPosOffset, scene.fluidInitVelocity, scene.params, Subdomain(), &threadPool);
+        fluid.deterministic = scene.deterministic;
+        fluid.taskGraph = scene.taskGraph;
+        scene.addSources(&fluid);
+        ColliderSet colliders;
+        scene.addColliders(&colliders);
+
+        long long sampleInterval = std::max(steps / 100, 1LL);
+        long long warmup = std::max(steps / 10, sampleInterval);
+        printf("SoakTest: %lld steps, build and destroy every %d steps%s, bound %.1f MB, sampled every %lld steps\n",
+               steps, cycleInterval, render ? " with renderers" : " without renderers (no GL context)", bound / 1048576, sampleInterval);
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        Sample baseline = { 0, 0, 0, 0 };
+        bool failed = false;
+        for (long long step = 1; step <= steps; step ++) {
+            fluid.update(scene.timestep, scene.gravity, &colliders);
+            if (cycleInterval > 0 && step % cycleInterval == 0) {
+                cycle(scene, &fluid, render);
+                cycles ++;
+            }
+            if (step % sampleInterval != 0) continue;
+
+            Sample sample = { step, MetricsServer::residentBytes(), allocatedBytes(), (int)fluid.particles.size() };
+            samples.push_back(sample);
+            bool warm = step > warmup;
+            if (!warm) {
+                baseline.resident = std::max(baseline.resident, sample.resident);
+                baseline.allocated = std::max(baseline.allocated, sample.allocated);
+            }
+            bool over = warm && (sample.resident > baseline.resident + bound || (sample.allocated >= 0 && sample.allocated > baseline.allocated + bound));
+            printf("\tstep %10lld  resident %9.2f MB  allocated %9.2f MB  particles %7d  free slots %5d%s\n", step, sample.resident / 1048576,
+                   sample.allocated / 1048576, sample.particles, fluid.getFreeSlots(), warm ? (over ? "  OVER BOUND" : "") : "  (warm-up)");
+            failed |= over;
+        }
+
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        double residentGrowth = 0, allocatedGrowth = 0;
+        for (int i = 0; i < samples.size(); i ++) {
+            if (samples[i].step <= warmup) continue;
+            residentGrowth = std::max(residentGrowth, samples[i].resident - baseline.resident);
+            allocatedGrowth = std::max(allocatedGrowth, samples[i].allocated - baseline.allocated);
+        }
+        printf("SoakTest: %s, %lld steps and %d cycles in %.1f s, largest growth after warm-up : resident %.2f MB, allocated %.2f MB\n",
+               failed ? "FAIL" : "PASS", steps, cycles, seconds, residentGrowth / 1048576, allocatedGrowth / 1048576);
+        return !failed;
+    }
+
+    // Bytes of live allocations. glibc's mallinfo only counts the main arena, so the totals over every arena are read
+    // from malloc_info : their size minus free chunks, plus mmapped chunks.
+    static double allocatedBytes()
+    {
+#if defined(__GLIBC__)
+        char* text = NULL;
+        size_t size = 0;
+        FILE* stream = open_memstream(&text, &size);
+        if (!stream) return -1;
+        malloc_info(0, stream);
+        fclose(stream);
+        std::string info(text, size);
+        free(text);
+        size_t totals = info.rfind("</heap>");
+        totals = totals == std::string::npos ? 0 : totals;
+        double current = infoSize(info, totals, "<system type=\"current\""), fast = infoSize(info, totals, "<total type=\"fast\""),
+               rest = infoSize(info, totals, "<total type=\"rest\""), mmapped = infoSize(info, totals, "<total type=\"mmap\"");
+        if (current < 0 || fast < 0 || rest < 0 || mmapped < 0) return -1;
+        return current - fast - rest + mmapped;
+#elif defined(__APPLE__)
+        malloc_statistics_t stats;
+        malloc_zone_statistics(NULL, &stats);
+        return (double)stats.size_in_use;
+#else
+        return -1;
+#endif
+    }
+
+private:
+    // Short-lived copies of everything the viewer builds, renderers flushed once
+    void cycle(const Scene& scene, Fluid* fluid, bool render)
+    {
+        Boundary boundary(scene.boundaryPosition, scene.boundarySize);
+        Fluid* spare = new Fluid(&boundary, scene.fluidSize, scene.fluidPosOffset, scene.fluidInitVelocity, scene.params);
+        Ground* ground = new Ground(scene.groundPosition, Vec2(40, 40), glm::vec4(0.5, 0.5, 0.5, 1.0));
+        Ball* ball = new Ball(scene.ballPosition, scene.ballRadius, glm::vec4(0.5, 0.5, 0.5, 1.0));
+        if (render) {
+            FluidRender* fluidRender = new FluidRender(fluid);
+            BoundaryRender* boundaryRender = new BoundaryRender(&boundary);
+            GroundRender* groundRender = new GroundRender(ground);
+            BallRender* ballRender = new BallRender(ball);
+            groundRender->flush();
+            fluidRender->flush();
+            boundaryRender->flush();
+            ballRender->flush();
+            glFinish();
+            delete ballRender;
+            delete groundRender;
+            delete boundaryRender;
+            delete fluidRender;
+        }
+        delete ball;
+        delete ground;
+        delete spare;
+    }
+
+    // size="N" of the first tag starting with prefix at or after from, -1 if there is none
+    static double infoSize(const std::string& info, size_t from, const char* prefix)
+    {
+        size_t tag = info.find(prefix, from);
+        if (tag == std::string::npos) return -1;
+        size_t value = info.find("size=\"", tag);
+        if (value == std::string::npos) return -1;
+        return atof(info.c_str() + value + 6);
+    }
+};
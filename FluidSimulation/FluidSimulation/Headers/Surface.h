@@ -0,0 +1,545 @@
+#pragma once
+
+#include <vector>
+#include <cstdio>
+#include <stdint.h>
+
+#include "Vector.h"
+#include "Fluid.h"
+#include "Parallel.h"
+
+// Cube corner index is x + 2y + 4z, edges go along x, then y, then z, lower corner first
+static const int edgeCorners[12][2] = {
+    {0, 1}, {2, 3}, {4, 5}, {6, 7},
+    {0, 2}, {1, 3}, {4, 6}, {5, 7},
+    {0, 4}, {1, 5}, {2, 6}, {3, 7}
+};
+
+struct SurfaceMesh // Indexed triangle mesh in world coordinates
+{
+    std::vector<Vec3> vertexes;
+    std::vector<Vec3> normals;
+    std::vector<int> indices; // Every 3 indices make up a triangle
+
+    void clear()
+    {
+        vertexes.clear();
+        normals.clear();
+        indices.clear();
+    }
+
+    bool writeObj(const char* path)
+    {
+        FILE* file = fopen(path, "w");
+        if (!file) {
+            printf("SurfaceMesh: can't write %s\n", path);
+            return false;
+        }
+        for (int i = 0; i < vertexes.size(); i ++) {
+            fprintf(file, "v %f %f %f\n", vertexes[i].x, vertexes[i].y, vertexes[i].z);
+        }
+        for (int i = 0; i < normals.size(); i ++) {
+            fprintf(file, "vn %f %f %f\n", normals[i].x, normals[i].y, normals[i].z);
+        }
+        for (int i = 0; i < indices.size(); i += 3) {
+            int a = indices[i]+1, b = indices[i+1]+1, c = indices[i+2]+1;
+            fprintf(file, "f %d//%d %d//%d %d//%d\n", a, a, b, b, c, c);
+        }
+        fclose(file);
+        return true;
+    }
+};
+
+/** Marching cubes over the color field of fluid, only near the grid cells holding particles **/
+// Each hash grid cell is a block of subdivision^3 cubes. Particles are found through the hash grid of the fluid's
+// last step. Tiles of tileBlocks^3 blocks near particles splat the color field on their own nodes in parallel, every
+// particle with its own smoothing length, then blocks whose nodes cross the iso value are polygonized in parallel and
+// vertexes on shared cube edges are welded.
+class SurfaceExtractor
+{
+public:
+    const double isoValue = 0.5;
+    static const int tileBlocks = 4; // Blocks along each axis of a tile, larger tiles find each particle fewer times
+
+    Fluid* fluid;
+    ThreadPool* pool;
+    int subdivision; // Cubes per grid cell along each axis
+    SurfaceMesh mesh;
+
+private:
+    struct BlockResult
+    {
+        std::vector<uint64_t> keys; // Cube edge of each triangle corner
+        std::vector<Vec3> points;
+    };
+
+    int pad; // Blocks out of the grid that can still hold the surface, particles may be a bit out of boundary
+    int sizeX, sizeY, sizeZ; // Blocks, including padding
+    int tilesX, tilesY, tilesZ;
+    int tileNodes; // Along each axis, a tile owns the nodes at the lower corners of its cubes
+    int nodesX, nodesY, nodesZ; // Global node counts, including padding blocks
+    std::vector<double> cellSlack; // How far the particles of each hash cell moved out of it since hashing
+    double maxSlack;
+    std::vector<int> fieldIndex; // Of each tile in fieldTiles, -1 : no particle reaches its nodes
+    std::vector<int> fieldTiles;
+    std::vector<double> fields; // tileNodes^3 nodes of every tile of fieldTiles, x fastest
+    std::vector<char> blockAbove, blockBelow; // A node a block owns is above, or not above, the iso value. Blocks of
+                                              // tiles no particle reaches have all of them below.
+    std::vector<int> activeBlocks; // Blocks with cubes crossing the iso value
+    std::vector<BlockResult> results;
+    std::vector< std::vector<double> > scratch; // Nodes of the block each thread polygonizes
+    std::vector<uint64_t> weldKeys; // Open addressing table of the edges welded so far, ~0 where free
+    std::vector<int> weldVertexes;
+
+    static const int keyStride = 8; // Vertex keys per node : 3 cube edges, then centers of up to 4 polygons of the cube
+    std::vector<int> triangleTable[256]; // Marching cubes table, edge indexes of cube, 3 per triangle
+    std::vector< std::vector<int> > centerPolygons[256]; // Polygons triangulated around an extra center vertex
+
+public:
+    SurfaceExtractor(Fluid* fluid, ThreadPool* pool, int subdivision = 2) : fluid(fluid), pool(pool), subdivision(subdivision), maxSlack(0)
+    {
+        // Merged particles reach up to kernelRadius * cbrt(mergeMass)
+        pad = (int)ceil(fluid->kernelRadius * cbrt(fluid->mergeMass)) + 1;
+        sizeX = (int)fluid->gridSize.x + 2*pad;
+        sizeY = (int)fluid->gridSize.y + 2*pad;
+        sizeZ = (int)fluid->gridSize.z + 2*pad;
+        tilesX = (sizeX + tileBlocks - 1) / tileBlocks;
+        tilesY = (sizeY + tileBlocks - 1) / tileBlocks;
+        tilesZ = (sizeZ + tileBlocks - 1) / tileBlocks;
+        tileNodes = tileBlocks * subdivision;
+        nodesX = sizeX * subdivision + 1;
+        nodesY = sizeY * subdivision + 1;
+        nodesZ = sizeZ * subdivision + 1;
+        buildTriangleTable();
+    }
+    ~SurfaceExtractor() { }
+
+    // Rebuild mesh from the current particles
+    void extract()
+    {
+        measureSlack();
+        findFieldTiles();
+        fields.resize(fieldTiles.size() * tileNodes*tileNodes*tileNodes);
+        blockAbove.assign(sizeX*sizeY*sizeZ, 0);
+        blockBelow.assign(sizeX*sizeY*sizeZ, 1);
+        pool->parallelForDynamic((int)fieldTiles.size(), [this](int index, int thread) {
+            splatTile(fieldTiles[index], &fields[(size_t)index * tileNodes*tileNodes*tileNodes]);
+        });
+        findActiveBlocks();
+        results.resize(activeBlocks.size());
+        scratch.resize(pool->numThreads);
+        pool->parallelForDynamic((int)activeBlocks.size(), [this](int index, int thread) {
+            polygonizeBlock(activeBlocks[index], results[index], scratch[thread]);
+        });
+        weld();
+    }
+
+private:
+    // The hash grid is a step behind the positions : how far each cell's particles are out of it now. If the grid
+    // doesn't hold every particle (nothing stepped yet, particles added since), the fluid hashes them again once.
+    void measureSlack()
+    {
+        int gx = (int)fluid->gridSize.x, gy = (int)fluid->gridSize.y, gz = (int)fluid->gridSize.z;
+        cellSlack.assign(gx*gy*gz, 0.0);
+        std::vector<int> rowCounts(gy*gz, 0);
+        std::vector<double> rowSlack(gy*gz, 0.0);
+        for (int pass = 0; pass < 2; pass ++) {
+            pool->parallelFor(gy*gz, [&](int begin, int end, int thread) {
+                for (int row = begin; row < end; row ++) {
+                    int z = row / gy, y = row % gy;
+                    rowCounts[row] = 0;
+                    rowSlack[row] = 0;
+                    for (int x = 0; x < gx; x ++) {
+                        const std::vector<Particle*>& cell = fluid->hashGrid[z][y][x];
+                        double slack = 0;
+                        for (int m = 0; m < cell.size(); m ++) {
+                            Vec3 local = cell[m]->position - fluid->boundary->position;
+                            slack = fmax(slack, fmax(fmax(x - local.x, local.x - (x+1)), fmax(fmax(y - local.y, local.y - (y+1)), fmax(z - local.z, local.z - (z+1)))));
+                        }
+                        cellSlack[row*gx + x] = slack;
+                        rowSlack[row] = fmax(rowSlack[row], slack);
+                        rowCounts[row] += (int)cell.size();
+                    }
+                }
+            });
+            int count = 0;
+            maxSlack = 0;
+            for (int row = 0; row < gy*gz; row ++) {
+                count += rowCounts[row];
+                maxSlack = fmax(maxSlack, rowSlack[row]);
+            }
+            if (count == fluid->particles.size() || pass == 1) break;
+            fluid->makeHashTable();
+        }
+    }
+
+    // Longest smoothing length of the particles of hash cell, kept by the fluid while particles merge
+    double cellRadius(int cell)
+    {
+        return fluid->mergeMass > 1 && cell < fluid->cellLongest.size() ? fluid->cellLongest[cell] : fluid->kernelRadius;
+    }
+    double maxRadius() { return fluid->mergeMass > 1 ? fluid->maxRadius : fluid->kernelRadius; }
+
+    // Calls func(x, y, z) for every non empty hash cell whose particles, moved by their slack, can reach the nodes
+    // owned by tile, i.e. the box of cells [lower, upper - interval] from its first block
+    template <class Func>
+    void forEachCellNear(int tileX, int tileY, int tileZ, Func func)
+    {
+        int gx = (int)fluid->gridSize.x, gy = (int)fluid->gridSize.y, gz = (int)fluid->gridSize.z;
+        int range = (int)ceil(maxRadius() + maxSlack);
+        int firstX = tileX*tileBlocks - pad, firstY = tileY*tileBlocks - pad, firstZ = tileZ*tileBlocks - pad;
+        double lowerX = firstX, lowerY = firstY, lowerZ = firstZ;
+        double upperX = firstX + tileBlocks - 1.0/subdivision, upperY = firstY + tileBlocks - 1.0/subdivision, upperZ = firstZ + tileBlocks - 1.0/subdivision;
+        int zMin = std::max(firstZ - range, 0), zMax = std::min(firstZ + tileBlocks - 1 + range, gz - 1);
+        int yMin = std::max(firstY - range, 0), yMax = std::min(firstY + tileBlocks - 1 + range, gy - 1);
+        int xMin = std::max(firstX - range, 0), xMax = std::min(firstX + tileBlocks - 1 + range, gx - 1);
+        for (int z = zMin; z <= zMax; z ++) {
+            double gapZ = fmax(fmax(lowerZ - (z+1), z - upperZ), 0.0);
+            for (int y = yMin; y <= yMax; y ++) {
+                double gapY = fmax(fmax(lowerY - (y+1), y - upperY), 0.0);
+                for (int x = xMin; x <= xMax; x ++) {
+                    if (fluid->hashGrid[z][y][x].empty()) continue;
+                    // Gap between the box of nodes and the cell, against the cell's reach grown by its slack
+                    int cell = (z*gy + y)*gx + x;
+                    double reach = cellRadius(cell) + cellSlack[cell];
+                    double gapX = fmax(fmax(lowerX - (x+1), x - upperX), 0.0);
+                    if (gapX*gapX + gapY*gapY + gapZ*gapZ < reach*reach) func(x, y, z);
+                }
+            }
+        }
+    }
+
+    // Tiles some particle can reach the nodes of
+    void findFieldTiles()
+    {
+        int numTiles = tilesX*tilesY*tilesZ;
+        fieldIndex.resize(numTiles);
+        pool->parallelFor(numTiles, [this](int begin, int end, int thread) {
+            for (int tile = begin; tile < end; tile ++) {
+                bool reached = false;
+                forEachCellNear(tile % tilesX, (tile / tilesX) % tilesY, tile / (tilesX*tilesY), [&reached](int x, int y, int z) { reached = true; });
+                fieldIndex[tile] = reached ? 0 : -1;
+            }
+        });
+        fieldTiles.clear();
+        for (int tile = 0; tile < numTiles; tile ++) {
+            if (fieldIndex[tile] < 0) continue;
+            fieldIndex[tile] = (int)fieldTiles.size();
+            fieldTiles.push_back(tile);
+        }
+    }
+
+    // Color field on the nodes owned by tile, then which of its blocks own nodes above and below the iso value
+    void splatTile(int tile, double* field)
+    {
+        int s = subdivision, t = tileNodes;
+        int tileX = tile % tilesX, tileY = (tile / tilesX) % tilesY, tileZ = tile / (tilesX*tilesY);
+        double interval = 1.0 / s;
+        for (int i = 0; i < t*t*t; i ++) field[i] = 0;
+
+        // Coordinates of nodes come from global node indexes, so every tile sees a node at the same place
+        Vec3 base = fluid->boundary->position - Vec3(pad, pad, pad); // Fluid coordinate of global node (0, 0, 0)
+        int nodeX = tileX*t, nodeY = tileY*t, nodeZ = tileZ*t;
+        std::vector<double> coords(6*t);
+        double *coordX = &coords[0], *coordY = &coords[t], *coordZ = &coords[2*t], *dx2 = &coords[3*t], *dy2 = &coords[4*t], *dz2 = &coords[5*t];
+        for (int i = 0; i < t; i ++) {
+            coordX[i] = base.x + (nodeX + i)*interval;
+            coordY[i] = base.y + (nodeY + i)*interval;
+            coordZ[i] = base.z + (nodeZ + i)*interval;
+        }
+
+        // Same poly6 kernel as density, scaled to the smoothing length of each particle
+        const double poly6 = 315.0 / (64.0 * M_PI);
+        forEachCellNear(tileX, tileY, tileZ, [&](int x, int y, int z) {
+            const std::vector<Particle*>& particles = fluid->hashGrid[z][y][x];
+            for (int m = 0; m < particles.size(); m ++) {
+                Particle* p = particles[m];
+                double radius = p->radius, radius2 = radius*radius;
+                Vec3 global = (p->position - base) * s;
+                int i0 = std::max((int)ceil(global.x - radius*s) - nodeX, 0), i1 = std::min((int)floor(global.x + radius*s) - nodeX, t-1);
+                int j0 = std::max((int)ceil(global.y - radius*s) - nodeY, 0), j1 = std::min((int)floor(global.y + radius*s) - nodeY, t-1);
+                int k0 = std::max((int)ceil(global.z - radius*s) - nodeZ, 0), k1 = std::min((int)floor(global.z + radius*s) - nodeZ, t-1);
+                if (i0 > i1 || j0 > j1 || k0 > k1) continue;
+                for (int i = i0; i <= i1; i ++) dx2[i] = (coordX[i] - p->position.x) * (coordX[i] - p->position.x);
+                for (int j = j0; j <= j1; j ++) dy2[j] = (coordY[j] - p->position.y) * (coordY[j] - p->position.y);
+                for (int k = k0; k <= k1; k ++) dz2[k] = (coordZ[k] - p->position.z) * (coordZ[k] - p->position.z);
+
+                double weight = poly6 / (radius2*radius2*radius2*radius2*radius) * p->mass / (p->density > 0 ? p->density : fluid->restDensity);
+                for (int k = k0; k <= k1; k ++) {
+                    if (dz2[k] >= radius2) continue;
+                    for (int j = j0; j <= j1; j ++) {
+                        if (dy2[j] + dz2[k] >= radius2) continue; // Rows out of the sphere
+                        double* row = &field[(k*t + j)*t];
+                        for (int i = i0; i <= i1; i ++) {
+                            double temp = radius2 - (dx2[i] + dy2[j] + dz2[k]);
+                            if (temp > 0) row[i] += weight * temp*temp*temp;
+                        }
+                    }
+                }
+            }
+        });
+
+        // Which blocks of the tile own nodes above the iso value, and which own nodes that aren't
+        for (int b = 0; b < tileBlocks*tileBlocks*tileBlocks; b ++) {
+            int bx = b % tileBlocks, by = (b / tileBlocks) % tileBlocks, bz = b / (tileBlocks*tileBlocks);
+            int blockX = tileX*tileBlocks + bx, blockY = tileY*tileBlocks + by, blockZ = tileZ*tileBlocks + bz;
+            if (blockX >= sizeX || blockY >= sizeY || blockZ >= sizeZ) continue;
+            bool above = false, below = false;
+            for (int k = 0; k < s; k ++) {
+                for (int j = 0; j < s; j ++) {
+                    for (int i = 0; i < s; i ++) {
+                        bool over = field[((bz*s + k)*t + by*s + j)*t + bx*s + i] > isoValue;
+                        above |= over;
+                        below |= !over;
+                    }
+                }
+            }
+            int block = (blockZ*sizeY + blockY)*sizeX + blockX;
+            blockAbove[block] = above;
+            blockBelow[block] = below;
+        }
+    }
+
+    // Value of node (i, j, k) of a tile, 0 in tiles no particle reaches
+    double tileValue(int tileX, int tileY, int tileZ, int i, int j, int k)
+    {
+        if (tileX >= tilesX || tileY >= tilesY || tileZ >= tilesZ) return 0;
+        int index = fieldIndex[(tileZ*tilesY + tileY)*tilesX + tileX];
+        if (index < 0) return 0;
+        return fields[(size_t)index * tileNodes*tileNodes*tileNodes + (k*tileNodes + j)*tileNodes + i];
+    }
+
+    // Blocks whose cubes cross the iso value : among the nodes of the block and of its 7 upper neighbors, some
+    // are above it and some aren't
+    void findActiveBlocks()
+    {
+        std::vector<char> active(sizeX*sizeY*sizeZ, 0);
+        pool->parallelFor(sizeY*sizeZ, [this, &active](int begin, int end, int thread) {
+            for (int row = begin; row < end; row ++) {
+                int z = row / sizeY, y = row % sizeY;
+                for (int x = 0; x < sizeX; x ++) {
+                    bool above = false, below = false;
+                    for (int c = 0; c < 8; c ++) {
+                        int i = x + (c&1), j = y + ((c>>1)&1), k = z + (c>>2);
+                        if (i >= sizeX || j >= sizeY || k >= sizeZ) {
+                            below = true;
+                            continue;
+                        }
+                        int block = (k*sizeY + j)*sizeX + i;
+                        above |= blockAbove[block] != 0;
+                        below |= blockBelow[block] != 0;
+                    }
+                    active[row*sizeX + x] = above && below;
+                }
+            }
+        });
+        activeBlocks.clear();
+        for (int i = 0; i < active.size(); i ++) {
+            if (active[i]) activeBlocks.push_back(i);
+        }
+    }
+
+    void polygonizeBlock(int block, BlockResult& result, std::vector<double>& field)
+    {
+        result.keys.clear();
+        result.points.clear();
+
+        int s = subdivision, n = s + 1;
+        int blockX = block % sizeX, blockY = (block / sizeX) % sizeY, blockZ = block / (sizeX*sizeY);
+        int nodeX = blockX*s, nodeY = blockY*s, nodeZ = blockZ*s;
+        double interval = 1.0 / s;
+
+        /** Nodes of the block's cubes, the upper layers can be in the next tiles **/
+        field.resize(n*n*n);
+        int tileX = nodeX / tileNodes, tileY = nodeY / tileNodes, tileZ = nodeZ / tileNodes;
+        for (int k = 0; k < n; k ++) {
+            int tz = tileZ, lz = nodeZ - tileZ*tileNodes + k;
+            if (lz >= tileNodes) { tz ++; lz -= tileNodes; }
+            for (int j = 0; j < n; j ++) {
+                int ty = tileY, ly = nodeY - tileY*tileNodes + j;
+                if (ly >= tileNodes) { ty ++; ly -= tileNodes; }
+                for (int i = 0; i < n; i ++) {
+                    int tx = tileX, lx = nodeX - tileX*tileNodes + i;
+                    if (lx >= tileNodes) { tx ++; lx -= tileNodes; }
+                    field[(k*n + j)*n + i] = tileValue(tx, ty, tz, lx, ly, lz);
+                }
+            }
+        }
+
+        /** Marching cubes **/
+        Vec3 base = fluid->boundary->position - Vec3(pad, pad, pad);
+        Vec3 world = fluid->boundary->position + base + Vec3(nodeX, nodeY, nodeZ) * interval; // Same translation as the fluid renderer
+        for (int k = 0; k < s; k ++) {
+            for (int j = 0; j < s; j ++) {
+                for (int i = 0; i < s; i ++) {
+                    double value[8];
+                    int cubeIndex = 0;
+                    for (int c = 0; c < 8; c ++) {
+                        value[c] = field[((k + (c>>2))*n + j + ((c>>1)&1))*n + i + (c&1)];
+                        if (value[c] > isoValue) cubeIndex |= 1 << c;
+                    }
+                    if (cubeIndex == 0 || cubeIndex == 255) continue;
+                    uint64_t cube = ((uint64_t)(nodeZ + k)*nodesY + (nodeY + j))*nodesX + (nodeX + i);
+                    Vec3 points[12];
+                    uint64_t keys[12];
+                    for (int e = 0; e < 12; e ++) {
+                        int a = edgeCorners[e][0], b = edgeCorners[e][1];
+                        if (((cubeIndex >> a) & 1) == ((cubeIndex >> b) & 1)) continue;
+                        double w = (isoValue - value[a]) / (value[b] - value[a]);
+                        Vec3 pa((i + (a&1))*interval, (j + ((a>>1)&1))*interval, (k + (a>>2))*interval);
+                        Vec3 pb((i + (b&1))*interval, (j + ((b>>1)&1))*interval, (k + (b>>2))*interval);
+                        points[e] = world + pa + (pb - pa)*w;
+                        // Global node of the lower corner and axis identify the edge
+                        uint64_t corner = cube + ((uint64_t)(a>>2)*nodesY + ((a>>1)&1))*nodesX + (a&1);
+                        keys[e] = corner*keyStride + e/4;
+                    }
+
+                    const std::vector<int>& triangles = triangleTable[cubeIndex];
+                    for (int t = 0; t < triangles.size(); t ++) {
+                        result.points.push_back(points[triangles[t]]);
+                        result.keys.push_back(keys[triangles[t]]);
+                    }
+                    const std::vector< std::vector<int> >& polygons = centerPolygons[cubeIndex];
+                    for (int q = 0; q < polygons.size(); q ++) {
+                        const std::vector<int>& polygon = polygons[q];
+                        Vec3 center(0, 0, 0);
+                        for (int v = 0; v < polygon.size(); v ++) center += points[polygon[v]];
+                        center = center / (double)polygon.size();
+                        for (int v = 0; v < polygon.size(); v ++) {
+                            int e0 = polygon[v], e1 = polygon[(v+1) % polygon.size()];
+                            result.points.push_back(center);
+                            result.keys.push_back(cube*keyStride + 3 + q);
+                            result.points.push_back(points[e0]);
+                            result.keys.push_back(keys[e0]);
+                            result.points.push_back(points[e1]);
+                            result.keys.push_back(keys[e1]);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    // Vertexes in the order blocks first use them
+    void weld()
+    {
+        const uint64_t emptyKey = ~0ULL;
+        mesh.clear();
+        size_t corners = 0;
+        for (int b = 0; b < results.size(); b ++) corners += results[b].keys.size();
+        size_t capacity = 64;
+        while (capacity < 2*corners) capacity <<= 1;
+        weldKeys.assign(capacity, emptyKey);
+        weldVertexes.resize(capacity);
+        mesh.indices.reserve(corners);
+        for (int b = 0; b < results.size(); b ++) {
+            BlockResult& result = results[b];
+            for (int i = 0; i < result.keys.size(); i ++) {
+                uint64_t key = result.keys[i];
+                size_t slot = (size_t)((key * 0x9E3779B97F4A7C15ULL) >> 32) & (capacity - 1);
+                while (weldKeys[slot] != emptyKey && weldKeys[slot] != key) slot = (slot + 1) & (capacity - 1);
+                if (weldKeys[slot] == emptyKey) {
+                    weldKeys[slot] = key;
+                    weldVertexes[slot] = (int)mesh.vertexes.size();
+                    mesh.vertexes.push_back(result.points[i]);
+                }
+                mesh.indices.push_back(weldVertexes[slot]);
+            }
+        }
+
+        mesh.normals.assign(mesh.vertexes.size(), Vec3(0, 0, 0));
+        for (int i = 0; i < mesh.indices.size(); i += 3) {
+            int a = mesh.indices[i], b = mesh.indices[i+1], c = mesh.indices[i+2];
+            Vec3 normal = Vec3::Cross(mesh.vertexes[b] - mesh.vertexes[a], mesh.vertexes[c] - mesh.vertexes[a]);
+            mesh.normals[a] += normal;
+            mesh.normals[b] += normal;
+            mesh.normals[c] += normal;
+        }
+        for (int i = 0; i < mesh.normals.size(); i ++) {
+            mesh.normals[i].nor();
+        }
+    }
+
+
+    // Triangles of every case are made by walking the cube faces : on each face a segment joins the edge where
+    // a run of inside corners begins to the edge where it ends, then segments are chained into polygons.
+    // A face decides only by its own corners, so neighbor cubes always agree and the surface is closed.
+    void buildTriangleTable()
+    {
+        // Corners of each face, counterclockwise seen from outside
+        static const int faceCorners[6][4] = {
+            {0, 4, 6, 2}, {1, 3, 7, 5}, // -x, +x
+            {0, 1, 5, 4}, {2, 6, 7, 3}, // -y, +y
+            {0, 2, 3, 1}, {4, 5, 7, 6}  // -z, +z
+        };
+
+        for (int cubeIndex = 0; cubeIndex < 256; cubeIndex ++) {
+            int next[12];
+            for (int e = 0; e < 12; e ++) next[e] = -1;
+
+            for (int f = 0; f < 6; f ++) {
+                const int* q = faceCorners[f];
+                for (int c = 0; c < 4; c ++) {
+                    bool inside = (cubeIndex >> q[c]) & 1;
+                    bool prevInside = (cubeIndex >> q[(c+3)%4]) & 1;
+                    if (!inside || prevInside) continue;
+                    // A run of inside corners starts at c
+                    int end = c;
+                    while ((cubeIndex >> q[(end+1)%4]) & 1) end = (end+1)%4;
+                    next[findEdge(q[(c+3)%4], q[c])] = findEdge(q[end], q[(end+1)%4]);
+                }
+            }
+
+            bool used[12] = { false };
+            for (int e = 0; e < 12; e ++) {
+                if (next[e] < 0 || used[e]) continue;
+                std::vector<int> polygon;
+                for (int edge = e; !used[edge]; edge = next[edge]) {
+                    used[edge] = true;
+                    polygon.push_back(edge);
+                }
+                // Fan from a corner whose diagonals all cut through the cube, a diagonal lying on a face
+                // would also be made by the neighbor cube. If there's no such corner, use a center vertex.
+                int start = -1;
+                for (int s = 0; s < polygon.size() && start < 0; s ++) {
+                    bool inside = true;
+                    for (int i = 2; i + 1 < polygon.size(); i ++) {
+                        if (shareFace(polygon[s], polygon[(s+i) % polygon.size()])) inside = false;
+                    }
+                    if (inside) start = s;
+                }
+                if (start < 0) {
+                    centerPolygons[cubeIndex].push_back(polygon);
+                    continue;
+                }
+                for (int i = 1; i + 1 < polygon.size(); i ++) {
+                    // Wound so that normals point out of the fluid
+                    triangleTable[cubeIndex].push_back(polygon[start]);
+                    triangleTable[cubeIndex].push_back(polygon[(start+i) % polygon.size()]);
+                    triangleTable[cubeIndex].push_back(polygon[(start+i+1) % polygon.size()]);
+                }
+            }
+        }
+    }
+    static bool shareFace(int e0, int e1)
+    {
+        // Corners of a face agree on one coordinate bit
+        int corners[4] = { edgeCorners[e0][0], edgeCorners[e0][1], edgeCorners[e1][0], edgeCorners[e1][1] };
+        for (int bit = 1; bit <= 4; bit <<= 1) {
+            bool same = true;
+            for (int c = 1; c < 4; c ++) {
+                if ((corners[c] & bit) != (corners[0] & bit)) same = false;
+            }
+            if (same) return true;
+        }
+        return false;
+    }
+    static int findEdge(int a, int b)
+    {
+        for (int e = 0; e < 12; e ++) {
+            if ((edgeCorners[e][0] == a && edgeCorners[e][1] == b) || (edgeCorners[e][0] == b && edgeCorners[e][1] == a)) return e;
+        }
+        return -1;
+    }
+};
+
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <mutex>
+#include <chrono>
+#include <cstdio>
+
+#include <math.h>
+
+#include "Fluid.h"
+#include "Collider.h"
+#include "Scene.h"
+#include "Parallel.h"
+
+/** Runs every combination of the sweep axes of a scene as an independent headless simulation **/
+// Jobs are handed to pinned worker threads one at a time, each job owns its own Fluid and colliders.
+// When a job finishes, one JSON line describing it is appended to the results file. Jobs the Fluid constructor would
+// reject, or with numa placement, aren't run, their line has "stable": false and an "error".
+class SweepRunner
+{
+public:
+    Scene base;
+    int numJobs;
+
+private:
+    std::mutex resultsMutex;
+    FILE* results;
+
+public:
+    SweepRunner(const Scene& base) : base(base), results(NULL)
+    {
+        numJobs = 1;
+        for (int i = 0; i < base.sweep.size(); i ++) {
+            numJobs *= (int)base.sweep[i].values.size();
+        }
+    }
+    ~SweepRunner() { }
+
+    // Scene of job n : axis values are picked like digits of n, the last axis changes fastest
+    Scene getJob(int n)
+    {
+        Scene scene = base;
+        for (int i = (int)base.sweep.size() - 1; i >= 0; i --) {
+            const Scene::Axis& axis = base.sweep[i];
+            scene.set(axis.key, axis.values[n % axis.values.size()]);
+            n /= axis.values.size();
+        }
+        return scene;
+    }
+
+    // numThreads <= 0 : one thread per hardware thread
+    bool run(int numThreads, const char* resultsPath)
+    {
+        results = fopen(resultsPath, "w");
+        if (!results) {
+            printf("SweepRunner: can't write %s\n", resultsPath);
+            return false;
+        }
+        ThreadPool pool(numThreads);
+        bool pinned = pool.pinThreads();
+        printf("SweepRunner: %d jobs on %d threads%s\n", numJobs, pool.numThreads, pinned ? ", pinned to cores" : "");
+
+        pool.parallelForDynamic(numJobs, [this](int n, int thread) {
+            runJob(n, thread);
+        });
+        fclose(results);
+        results = NULL;
+        printf("SweepRunner: results written to %s\n", resultsPath);
+        return true;
+    }
+
+private:
+    void runJob(int n, int thread)
+    {
+        Scene scene = getJob(n);
+        const char* error = scene.invalidReason();
+        if (!error && scene.numa > 0) error = "numa placement needs a fluid stepped by several threads, sweep jobs run on one thread each";
+        if (error) {
+            std::lock_guard<std::mutex> lock(resultsMutex);
+            printf("SweepRunner: job %d skipped, %s\n", n, error);
+            writeJob(n, thread);
+            fprintf(results, ", \"stable\": false, \"error\": \"%s\"}\n", error);
+            fflush(results);
+            return;
+        }
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+        // A pool of one thread runs everything on the calling thread, the task graph then orders the blocks of this job
+        ThreadPool single(1);
+        Boundary boundary(scene.boundaryPosition, scene.boundarySize);
+        Fluid fluid(&boundary, scene.fluidSize, scene.fluidPosOffset, scene.fluidInitVelocity, scene.params, Subdomain(), scene.taskGraph ? &single : NULL);
+        fluid.deterministic = scene.deterministic;
+        fluid.taskGraph = scene.taskGraph;
+        scene.addSources(&fluid);
+        ColliderSet colliders;
+        scene.addColliders(&colliders);
+        for (int i = 0; i < scene.steps; i ++) {
+            fluid.update(scene.timestep, scene.gravity, &colliders);
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        FluidStats stats = fluid.getStats();
+        bool finite = isfinite(stats.kineticEnergy) && isfinite(stats.meanDensity);
+
+        std::lock_guard<std::mutex> lock(resultsMutex);
+        writeJob(n, thread);
+        fprintf(results, ", \"steps\": %d, \"particles\": %d, \"seconds\": %f, \"stable\": %s, \"meanDensity\": %.9g, \"maxSpeed\": %.9g, \"kineticEnergy\": %.9g}\n",
+                scene.steps, stats.particles, seconds, finite ? "true" : "false", stats.meanDensity, stats.maxSpeed, stats.kineticEnergy);
+        fflush(results);
+    }
+
+    // Start of the JSON line of job n : its number, thread and axis values, resultsMutex held
+    void writeJob(int n, int thread)
+    {
+        fprintf(results, "{\"job\": %d, \"thread\": %d", n, thread);
+        for (int i = 0; i < base.sweep.size(); i ++) {
+            const Scene::Axis& axis = base.sweep[i];
+            int digit = n;
+            for (int j = (int)base.sweep.size() - 1; j > i; j --) digit /= base.sweep[j].values.size();
+            fprintf(results, ", \"%s\": \"%s\"", axis.key.c_str(), axis.values[digit % axis.values.size()].c_str());
+        }
+    }
+};
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <memory>
+#include <functional>
+
+#include "Parallel.h"
+
+/** Tasks and the tasks they wait for, run on a thread pool with work stealing **/
+// A task is ready once every task it depends on has finished. Each thread keeps a queue of ready tasks :
+// it runs its newest one, so a task's successors tend to run right after it on the same thread, and
+// when its queue is empty it steals the oldest one of another thread. The graph can be run again and again.
+class TaskGraph
+{
+public:
+    int stolen; // Tasks run by another thread than the one that made them ready, in the last run
+
+private:
+    struct Task
+    {
+        std::function<void(int)> func; // func(thread)
+        std::vector<int> successors;
+        int dependencies;
+    };
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<int> tasks;
+    };
+    std::vector<Task> tasks;
+    std::unique_ptr< std::atomic<int>[] > waiting; // Dependencies of every task not finished yet in this run
+    std::unique_ptr<Queue[]> queues;
+    int numQueues;
+    std::atomic<int> remaining;
+    std::atomic<int> steals;
+
+public:
+    TaskGraph() : stolen(0), numQueues(0), remaining(0), steals(0) { }
+
+    void clear() { tasks.clear(); }
+    int size() { return (int)tasks.size(); }
+
+    // Add a task, return its id
+    int add(std::function<void(int)> func)
+    {
+        Task task;
+        task.func = func;
+        task.dependencies = 0;
+        tasks.push_back(task);
+        return (int)tasks.size() - 1;
+    }
+    // Task won't start before task on has finished
+    void depend(int task, int on)
+    {
+        tasks[on].successors.push_back(task);
+        tasks[task].dependencies ++;
+    }
+
+    // Run every task and wait for all of them. Tasks nothing depends on are dealt out to the threads in
+    // contiguous ranges of their ids, like ThreadPool::parallelFor, so neighboring tasks start on the same thread.
+    void run(ThreadPool* pool)
+    {
+        int n = pool->numThreads;
+        if (numQueues != n) {
+            queues.reset(new Queue[n]);
+            numQueues = n;
+        }
+        waiting.reset(new std::atomic<int>[tasks.size()]);
+        std::vector<int> roots;
+        for (int i = 0; i < tasks.size(); i ++) {
+            waiting[i] = tasks[i].dependencies;
+            if (tasks[i].dependencies == 0) roots.push_back(i);
+        }
+        for (int t = 0; t < n; t ++) {
+            for (int i = ThreadPool::blockBegin((int)roots.size(), t, n); i < ThreadPool::blockBegin((int)roots.size(), t+1, n); i ++) {
+                queues[t].tasks.push_back(roots[i]);
+            }
+        }
+        remaining = (int)tasks.size();
+        steals = 0;
+        pool->run([this, n](int thread) {
+            while (remaining > 0) {
+                int task = pop(thread);
+                for (int i = 1; task < 0 && i < n; i ++) {
+                    task = steal((thread + i) % n);
+                }
+                if (task < 0) {
+                    std::this_thread::yield();
+                    continue;
+                }
+                execute(task, thread);
+            }
+        });
+        stolen = steals;
+    }
+
+private:
+    void execute(int task, int thread)
+    {
+        tasks[task].func(thread);
+        const std::vector<int>& successors = tasks[task].successors;
+        for (int i = 0; i < successors.size(); i ++) {
+            if (-- waiting[successors[i]] == 0) {
+                std::lock_guard<std::mutex> lock(queues[thread].mutex);
+                queues[thread].tasks.push_back(successors[i]);
+            }
+        }
+        remaining --;
+    }
+    int pop(int thread) // Newest task of this thread
+    {
+        std::lock_guard<std::mutex> lock(queues[thread].mutex);
+        if (queues[thread].tasks.empty()) return -1;
+        int task = queues[thread].tasks.back();
+        queues[thread].tasks.pop_back();
+        return task;
+    }
+    int steal(int victim) // Oldest task of another thread
+    {
+        std::lock_guard<std::mutex> lock(queues[victim].mutex);
+        if (queues[victim].tasks.empty()) return -1;
+        int task = queues[victim].tasks.front();
+        queues[victim].tasks.pop_front();
+        steals ++;
+        return task;
+    }
+};
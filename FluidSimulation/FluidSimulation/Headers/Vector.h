@@ -2,106 +2,168 @@
 
 #include <math.h>
 
+// Heap allocations honor alignments wider than 16 bytes only since C++17 aligned new,
+// before that a whole AVX register of alignment could be promised but not kept
+#if defined(__cpp_aligned_new)
+#define VEC3_ALIGNMENT 32
+#else
+#define VEC3_ALIGNMENT 16
+#endif
+
+// With AVX, all 4 lanes of a Vec3 fit one register and arithmetic covers w too. Narrower targets
+// leave w alone, 4 lanes in two SSE2 registers measured slower than 3 scalar ones.
+#if defined(__AVX__)
+#define VEC3_PACKED 1
+#else
+#define VEC3_PACKED 0
+#endif
+
 struct Vec2
 {
     double x;
     double y;
-    
-    Vec2() : x(0), y(0) { }
-    Vec2(double x0, double y0) : x(x0), y(y0) { }
-    ~Vec2() { }
 
-    void operator=(Vec2 v)
-    {
-        x = v.x;
-        y = v.y;
-    }
-    Vec2 operator+(Vec2 v) { return Vec2(x+v.x, y+v.y); }
-    Vec2 operator-(Vec2 v) { return Vec2(x-v.x, y-v.y); }
-    Vec2 operator*(double n) { return Vec2(x*n, y*n); }
-    Vec2 operator/(double n) { return Vec2(x/n, y/n); }
-    bool operator==(Vec2 &v) { return x == v.x && y == v.y; }
-    bool operator!=(Vec2 &v) { return x != v.x || y != v.y; }
-    Vec2 &operator+=(Vec2 v)
+    constexpr Vec2() : x(0), y(0) { }
+    constexpr Vec2(double x0, double y0) : x(x0), y(y0) { }
+
+    constexpr Vec2 operator+(const Vec2& v) const { return Vec2(x+v.x, y+v.y); }
+    constexpr Vec2 operator-(const Vec2& v) const { return Vec2(x-v.x, y-v.y); }
+    constexpr Vec2 operator*(double n) const { return Vec2(x*n, y*n); }
+    constexpr Vec2 operator/(double n) const { return Vec2(x/n, y/n); }
+    constexpr bool operator==(const Vec2& v) const { return x == v.x && y == v.y; }
+    constexpr bool operator!=(const Vec2& v) const { return x != v.x || y != v.y; }
+    Vec2 &operator+=(const Vec2& v)
     {
         x += v.x;
         y += v.y;
         return *this;
     }
-    Vec2 &operator-=(Vec2 v)
+    Vec2 &operator-=(const Vec2& v)
     {
         x -= v.x;
         y -= v.y;
         return *this;
     }
 
-    double len() { return sqrt(x*x + y*y); }
-    double dst(Vec2 v) { return sqrt(pow(x-v.x, 2) + pow(y-v.y, 2)); }
+    constexpr double lengthSquared() const { return x*x + y*y; }
+    double len() const { return sqrt(lengthSquared()); }
+    double dst(const Vec2& v) const { return (*this - v).len(); }
 };
 
-struct Vec3
+// Padded to 4 lanes, w is always 0. With VEC3_PACKED arithmetic runs over all 4 lanes so a chain of
+// operators becomes packed AVX instructions, dot products and lengths only read x, y and z.
+struct alignas(VEC3_ALIGNMENT) Vec3
 {
     double x;
     double y;
     double z;
-    
-    Vec3() : x(0), y(0), z(0) { }
-    Vec3(double x0, double y0, double z0) : x(x0), y(y0), z(z0) { }
-    ~Vec3() {}
-    
-    void operator=(Vec3 v)
-    {
-        x = v.x;
-        y = v.y;
-        z = v.z;
-    }
-    Vec3 operator+(Vec3 v) { return Vec3(x+v.x, y+v.y, z+v.z); }
-    Vec3 operator-(Vec3 v) { return Vec3(x-v.x, y-v.y, z-v.z); }
-    Vec3 operator*(double n) { return Vec3(x*n, y*n, z*n); }
-    Vec3 operator/(double n) { return Vec3(x/n, y/n, z/n); }
-    bool operator==(Vec3 &v) { return x == v.x && y == v.y && z == v.z; }
-    bool operator!=(Vec3 &v) { return x != v.x || y != v.y || z != v.z; }
-    Vec3 &operator+=(Vec3 v)
+    double w;
+
+    constexpr Vec3() : x(0), y(0), z(0), w(0) { }
+    constexpr Vec3(double x0, double y0, double z0) : x(x0), y(y0), z(z0), w(0) { }
+
+    constexpr Vec3 operator+(const Vec3& v) const { return Vec3(x+v.x, y+v.y, z+v.z, VEC3_PACKED ? w+v.w : 0); }
+    constexpr Vec3 operator-(const Vec3& v) const { return Vec3(x-v.x, y-v.y, z-v.z, VEC3_PACKED ? w-v.w : 0); }
+    constexpr Vec3 operator-() const { return Vec3(-x, -y, -z, VEC3_PACKED ? -w : 0); }
+    constexpr Vec3 operator*(double n) const { return Vec3(x*n, y*n, z*n, VEC3_PACKED ? w*n : 0); }
+    constexpr Vec3 operator/(double n) const { return Vec3(x/n, y/n, z/n, VEC3_PACKED ? w/n : 0); }
+    constexpr bool operator==(const Vec3& v) const { return x == v.x && y == v.y && z == v.z; }
+    constexpr bool operator!=(const Vec3& v) const { return x != v.x || y != v.y || z != v.z; }
+    Vec3 &operator+=(const Vec3& v)
     {
         x += v.x;
         y += v.y;
         z += v.z;
+        if (VEC3_PACKED) w += v.w;
         return *this;
     }
-    Vec3 &operator-=(Vec3 v)
+    Vec3 &operator-=(const Vec3& v)
     {
         x -= v.x;
         y -= v.y;
         z -= v.z;
+        if (VEC3_PACKED) w -= v.w;
+        return *this;
+    }
+    Vec3 &operator*=(double n)
+    {
+        x *= n;
+        y *= n;
+        z *= n;
+        if (VEC3_PACKED) w *= n;
         return *this;
     }
 
-    friend Vec3 operator*(double n, Vec3 v)
+    friend constexpr Vec3 operator*(double n, const Vec3& v) { return v * n; }
+    friend constexpr Vec3 operator/(double n, const Vec3& v) { return v / n; } // Divides v by n, as it always has
+
+    constexpr double lengthSquared() const { return x*x + y*y + z*z; }
+    double len() const { return sqrt(lengthSquared()); }
+    double dst(const Vec3& v) const { return (*this - v).len(); }
+    void nor()
     {
-        v.x *= n;
-        v.y *= n;
-        v.z *= n;
-        return v;
+        double length = len();
+        if (length < 0.00001) return;
+        *this = *this / length;
     }
-    friend Vec3 operator/(double n, Vec3 v)
+    Vec3 normalized() const
     {
-        v.x /= n;
-        v.y /= n;
-        v.z /= n;
+        Vec3 v = *this;
+        v.nor();
         return v;
     }
 
-    double len() { return sqrt(x*x + y*y + z*z); }
-    double dst(Vec3 v) { return sqrt(pow(x-v.x, 2) + pow(y-v.y, 2) + pow(z-v.z, 2)); }
-    void nor()
+    static constexpr double Dot(const Vec3& v1, const Vec3& v2) { return v1.x*v2.x + v1.y*v2.y + v1.z*v2.z; }
+    static constexpr Vec3 Cross(const Vec3& v1, const Vec3& v2) { return Vec3(v1.y*v2.z-v1.z*v2.y, v1.z*v2.x-v1.x*v2.z, v1.x*v2.y-v1.y*v2.x); }
+    static constexpr Vec3 Fma(const Vec3& a, double s, const Vec3& b) { return Vec3(a.x*s + b.x, a.y*s + b.y, a.z*s + b.z, VEC3_PACKED ? a.w*s + b.w : 0); } // a * s + b
+
+private:
+    constexpr Vec3(double x0, double y0, double z0, double w0) : x(x0), y(y0), z(z0), w(w0) { }
+};
+
+// Vec3 without the padding lane, 24 bytes instead of 32, for what is stored per particle. Arithmetic
+// converts to Vec3, so expressions keep running on padded registers and only loads and stores change.
+struct CompactVec3
+{
+    double x;
+    double y;
+    double z;
+
+    constexpr CompactVec3() : x(0), y(0), z(0) { }
+    constexpr CompactVec3(double x0, double y0, double z0) : x(x0), y(y0), z(z0) { }
+    constexpr CompactVec3(const Vec3& v) : x(v.x), y(v.y), z(v.z) { }
+    constexpr operator Vec3() const { return Vec3(x, y, z); }
+
+    constexpr Vec3 operator+(const Vec3& v) const { return Vec3(*this) + v; }
+    constexpr Vec3 operator-(const Vec3& v) const { return Vec3(*this) - v; }
+    constexpr Vec3 operator-() const { return -Vec3(*this); }
+    constexpr Vec3 operator*(double n) const { return Vec3(*this) * n; }
+    constexpr Vec3 operator/(double n) const { return Vec3(*this) / n; }
+    CompactVec3 &operator+=(const Vec3& v)
+    {
+        x += v.x;
+        y += v.y;
+        z += v.z;
+        return *this;
+    }
+    CompactVec3 &operator-=(const Vec3& v)
+    {
+        x -= v.x;
+        y -= v.y;
+        z -= v.z;
+        return *this;
+    }
+    CompactVec3 &operator*=(double n)
     {
-        double w = len();
-        if (w < 0.00001) return;
-        x /= w;
-        y /= w;
-        z /= w;
+        x *= n;
+        y *= n;
+        z *= n;
+        return *this;
     }
-    
-    static double Dot(Vec3 v1, Vec3 v2) { return v1.x*v2.x + v1.y*v2.y + v1.z*v2.z; }
-    static Vec3 Cross(Vec3 v1, Vec3 v2) { return Vec3(v1.y*v2.z-v1.z*v2.y, v1.z*v2.x-v1.x*v2.z, v1.x*v2.y-v1.y*v2.x); }
+
+    friend constexpr Vec3 operator*(double n, const CompactVec3& v) { return v * n; }
+
+    constexpr double lengthSquared() const { return x*x + y*y + z*z; }
+    double len() const { return sqrt(lengthSquared()); }
+    double dst(const Vec3& v) const { return (*this - v).len(); }
 };
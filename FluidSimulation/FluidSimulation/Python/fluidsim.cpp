@@ -0,0 +1,578 @@
+/** Python bindings of the solver **/
+// import fluidsim
+// boundary = fluidsim.Boundary((-3.25, -2, -12), (13, 13, 13))
+// fluid = fluidsim.Fluid(boundary, (6, 6, 6), offset=(0, 6, 2), velocity=(7, 0, 0), params={"sleep.steps": 10})
+// ball = fluidsim.Ball((5, 5, -17), 2)
+// fluid.update(0.04, balls=[ball])
+//
+// fluid.positions, velocities and densities are read-only memoryviews of Fluid::getFields, contiguous arrays of every
+// particle copied once per step that is asked for. They are plain strided buffers, numpy.asarray(view) doesn't copy.
+// A view keeps the arrays of the step it was taken at alive, later steps write new ones instead, so update
+// never waits for views to be released : take them again after stepping.
+// fluid.snapshot() holds the same arrays together with the particle indices, it stays valid for as long as it's kept.
+// update releases the GIL while it steps and takes the fluid's lock one step at a time, so views, snapshots and len()
+// from other threads wait for the step in progress only, and see the fluid between two steps.
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <glm/glm.hpp>
+
+#include <mutex>
+#include <vector>
+#include <string>
+#include <memory>
+#include <atomic>
+#include <thread>
+
+#include "../Headers/Fluid.h"
+#include "../Headers/Scene.h"
+
+/** Vectors **/
+
+static bool toVec3(PyObject* object, Vec3& v, const char* name)
+{
+    PyObject* seq = PySequence_Fast(object, name);
+    if (!seq) return false;
+    bool ok = PySequence_Fast_GET_SIZE(seq) == 3;
+    double c[3] = { 0, 0, 0 };
+    for (int i = 0; ok && i < 3; i ++) {
+        c[i] = PyFloat_AsDouble(PySequence_Fast_GET_ITEM(seq, i));
+        ok = !PyErr_Occurred();
+    }
+    Py_DECREF(seq);
+    if (!ok) {
+        if (!PyErr_Occurred()) PyErr_Format(PyExc_TypeError, "%s must be 3 numbers", name);
+        return false;
+    }
+    v = Vec3(c[0], c[1], c[2]);
+    return true;
+}
+
+static PyObject* fromVec3(const Vec3& v)
+{
+    return Py_BuildValue("(ddd)", v.x, v.y, v.z);
+}
+
+/** Views **/
+// Buffer of one field array of a fluid, with the arrays it lives in
+
+typedef std::shared_ptr<Fluid::ParticleFields> FieldsPointer;
+
+struct ViewObject
+{
+    PyObject_HEAD
+    FieldsPointer* fields; // Kept alive by the view
+    double* buf;
+    int ndim;
+    Py_ssize_t shape[2];
+    Py_ssize_t strides[2];
+};
+
+static void View_dealloc(ViewObject* self)
+{
+    delete self->fields;
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static int View_getbuffer(ViewObject* self, Py_buffer* view, int flags)
+{
+    if (flags & PyBUF_WRITABLE) {
+        PyErr_SetString(PyExc_BufferError, "particle views are read-only");
+        return -1;
+    }
+    // C-contiguous, consumers that don't ask for shape or strides get them implied
+    view->obj = (PyObject*)self;
+    Py_INCREF(self);
+    view->buf = self->buf;
+    view->len = self->shape[0] * (self->ndim == 2 ? self->shape[1] : 1) * (Py_ssize_t)sizeof(double);
+    view->readonly = 1;
+    view->itemsize = sizeof(double);
+    view->format = (flags & PyBUF_FORMAT) ? (char*)"d" : NULL;
+    view->ndim = self->ndim;
+    view->shape = (flags & PyBUF_ND) == PyBUF_ND ? self->shape : NULL;
+    view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? self->strides : NULL;
+    view->suboffsets = NULL;
+    view->internal = NULL;
+    return 0;
+}
+
+static PyBufferProcs View_buffer = { (getbufferproc)View_getbuffer, NULL };
+
+static PyTypeObject ViewType = { PyVarObject_HEAD_INIT(NULL, 0) };
+
+// Memoryview of the rows of components doubles in array, one per particle of fields
+static PyObject* makeView(const FieldsPointer& fields, std::vector<double>& array, int components)
+{
+    ViewObject* self = PyObject_New(ViewObject, &ViewType);
+    if (!self) return NULL;
+    self->fields = new FieldsPointer(fields);
+    self->buf = array.data();
+    self->ndim = components > 1 ? 2 : 1;
+    self->shape[0] = (Py_ssize_t)fields->indices.size();
+    self->shape[1] = components;
+    self->strides[0] = components * sizeof(double);
+    self->strides[1] = sizeof(double);
+    PyObject* memory = PyMemoryView_FromObject((PyObject*)self);
+    Py_DECREF(self);
+    return memory;
+}
+
+/** Snapshot **/
+// Field arrays of one step with the indices of their particles, in the order of Fluid::particles
+
+struct SnapshotObject
+{
+    PyObject_HEAD
+    FieldsPointer* fields;
+};
+
+static void Snapshot_dealloc(SnapshotObject* self)
+{
+    delete self->fields;
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static Py_ssize_t Snapshot_length(SnapshotObject* self)
+{
+    return (Py_ssize_t)(*self->fields)->indices.size();
+}
+
+static PyObject* Snapshot_positions(SnapshotObject* self, void*) { return makeView(*self->fields, (*self->fields)->positions, 3); }
+static PyObject* Snapshot_velocities(SnapshotObject* self, void*) { return makeView(*self->fields, (*self->fields)->velocities, 3); }
+static PyObject* Snapshot_densities(SnapshotObject* self, void*) { return makeView(*self->fields, (*self->fields)->densities, 1); }
+static PyObject* Snapshot_indices(SnapshotObject* self, void*)
+{
+    const std::vector<int>& indices = (*self->fields)->indices;
+    PyObject* list = PyList_New((Py_ssize_t)indices.size());
+    if (!list) return NULL;
+    for (int i = 0; i < indices.size(); i ++) {
+        PyList_SET_ITEM(list, i, PyLong_FromLong(indices[i]));
+    }
+    return list;
+}
+static PyObject* Snapshot_step(SnapshotObject* self, void*) { return PyLong_FromLong((*self->fields)->step); }
+
+static PyGetSetDef Snapshot_getset[] = {
+    { "positions", (getter)Snapshot_positions, NULL, "Positions, (n, 3) doubles", NULL },
+    { "velocities", (getter)Snapshot_velocities, NULL, "Velocities, (n, 3) doubles", NULL },
+    { "densities", (getter)Snapshot_densities, NULL, "Densities, (n,) doubles", NULL },
+    { "indices", (getter)Snapshot_indices, NULL, "Index of the particle of every row, a list", NULL },
+    { "step", (getter)Snapshot_step, NULL, "Steps the fluid had taken", NULL },
+    { NULL }
+};
+
+static PySequenceMethods Snapshot_sequence = { (lenfunc)Snapshot_length };
+
+static PyTypeObject SnapshotType = { PyVarObject_HEAD_INIT(NULL, 0) };
+
+/** Boundary **/
+
+struct BoundaryObject
+{
+    PyObject_HEAD
+    Boundary* boundary;
+};
+
+static int Boundary_init(BoundaryObject* self, PyObject* args, PyObject* kwargs)
+{
+    static const char* keywords[] = { "position", "size", NULL };
+    PyObject *position, *size;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO", (char**)keywords, &position, &size)) return -1;
+    Vec3 p, s;
+    if (!toVec3(position, p, "position") || !toVec3(size, s, "size")) return -1;
+    if (s.x <= 0 || s.y <= 0 || s.z <= 0) {
+        PyErr_SetString(PyExc_ValueError, "boundary size must be positive");
+        return -1;
+    }
+    delete self->boundary;
+    self->boundary = new Boundary(p, s);
+    return 0;
+}
+
+static void Boundary_dealloc(BoundaryObject* self)
+{
+    delete self->boundary;
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static PyObject* Boundary_position(BoundaryObject* self, void*) { return fromVec3(self->boundary->position); }
+static PyObject* Boundary_size(BoundaryObject* self, void*) { return fromVec3(self->boundary->size); }
+
+static PyGetSetDef Boundary_getset[] = {
+    { "position", (getter)Boundary_position, NULL, "Lowest corner", NULL },
+    { "size", (getter)Boundary_size, NULL, "Extent, grid cells are 1 wide", NULL },
+    { NULL }
+};
+
+static PyTypeObject BoundaryType = { PyVarObject_HEAD_INIT(NULL, 0) };
+
+/** Ball **/
+
+struct BallObject
+{
+    PyObject_HEAD
+    Ball* ball;
+};
+
+static int Ball_init(BallObject* self, PyObject* args, PyObject* kwargs)
+{
+    static const char* keywords[] = { "center", "radius", NULL };
+    PyObject* center;
+    int radius;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "Oi", (char**)keywords, &center, &radius)) return -1;
+    Vec3 c;
+    if (!toVec3(center, c, "center")) return -1;
+    if (radius <= 0) {
+        PyErr_SetString(PyExc_ValueError, "radius must be positive");
+        return -1;
+    }
+    delete self->ball;
+    self->ball = new Ball(c, radius, glm::vec4(1.0f, 1.0f, 1.0f, 1.0f));
+    return 0;
+}
+
+static void Ball_dealloc(BallObject* self)
+{
+    delete self->ball;
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static PyObject* Ball_getCenter(BallObject* self, void*) { return fromVec3(self->ball->center); }
+static int Ball_setCenter(BallObject* self, PyObject* value, void*)
+{
+    if (!value) {
+        PyErr_SetString(PyExc_AttributeError, "center can't be deleted");
+        return -1;
+    }
+    return toVec3(value, self->ball->center, "center") ? 0 : -1;
+}
+static PyObject* Ball_radius(BallObject* self, void*) { return PyLong_FromLong(self->ball->radius); }
+
+static PyGetSetDef Ball_getset[] = {
+    { "center", (getter)Ball_getCenter, (setter)Ball_setCenter, "Center, fluids see a move at their next update", NULL },
+    { "radius", (getter)Ball_radius, NULL, "Radius", NULL },
+    { NULL }
+};
+
+static PyTypeObject BallType = { PyVarObject_HEAD_INIT(NULL, 0) };
+
+/** Fluid **/
+
+struct FluidObject
+{
+    PyObject_HEAD
+    Fluid* fluid;
+    ThreadPool* pool;
+    PyObject* boundary; // Kept alive while the fluid is
+    ColliderSet* colliders; // Spheres of the balls of the last update
+    std::vector<Vec3>* ballCenters;
+    std::vector<double>* ballRadii;
+    std::mutex* lock; // Held by update for every step and by readers, they run without the GIL
+    std::atomic<int>* waiting; // Readers waiting for the lock, update lets them go first between steps
+    bool stepping;
+    long long steps;
+};
+
+static int Fluid_init(FluidObject* self, PyObject* args, PyObject* kwargs)
+{
+    static const char* keywords[] = { "boundary", "size", "offset", "velocity", "threads", "params", NULL };
+    PyObject *boundary, *size, *offset = NULL, *velocity = NULL, *params = NULL;
+    int threads = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O!O|OOiO", (char**)keywords, &BoundaryType, &boundary, &size, &offset, &velocity, &threads, &params)) {
+        return -1;
+    }
+    if (self->fluid) {
+        PyErr_SetString(PyExc_RuntimeError, "Fluid is already initialized");
+        return -1;
+    }
+    Vec3 s, o(0, 0, 0), v(0, 0, 0);
+    if (!toVec3(size, s, "size") || (offset && !toVec3(offset, o, "offset")) || (velocity && !toVec3(velocity, v, "velocity"))) return -1;
+
+    // Fluid checks too, but it exits
+    Boundary* b = ((BoundaryObject*)boundary)->boundary;
+    if (s.x <= 0 || s.y <= 0 || s.z <= 0 || o.x < 0 || o.y < 0 || o.z < 0) {
+        PyErr_SetString(PyExc_ValueError, "fluid size must be positive and its offset can't be negative");
+        return -1;
+    }
+    if (o.x + s.x > b->size.x || o.y + s.y > b->size.y || o.z + s.z > b->size.z) {
+        PyErr_SetString(PyExc_ValueError, "fluid out of boundary");
+        return -1;
+    }
+    // Fluid constants as keys of a scene file, e.g. {"viscosity": 0.5, "sleep.steps": 10, "kernel": "wendland"}
+    Scene scene;
+    if (params && params != Py_None) {
+        if (!PyDict_Check(params)) {
+            PyErr_SetString(PyExc_TypeError, "params must be a dict");
+            return -1;
+        }
+        PyObject *key, *value;
+        Py_ssize_t position = 0;
+        while (PyDict_Next(params, &position, &key, &value)) {
+            PyObject* text = PyObject_Str(value);
+            if (!text) return -1;
+            const char* k = PyUnicode_Check(key) ? PyUnicode_AsUTF8(key) : NULL;
+            const char* t = PyUnicode_AsUTF8(text);
+            bool known = k && t && scene.set(k, t);
+            Py_DECREF(text);
+            if (!known) {
+                if (!PyErr_Occurred()) PyErr_Format(PyExc_ValueError, "unknown key or bad value in params : %S", key);
+                return -1;
+            }
+        }
+    }
+    if (!scene.params.isValid()) {
+        PyErr_SetString(PyExc_ValueError, "fluid constants out of range");
+        return -1;
+    }
+
+    Py_INCREF(boundary);
+    self->boundary = boundary;
+    self->lock = new std::mutex();
+    self->waiting = new std::atomic<int>(0);
+    self->colliders = new ColliderSet();
+    self->ballCenters = new std::vector<Vec3>();
+    self->ballRadii = new std::vector<double>();
+    self->stepping = false;
+    self->steps = 0;
+    Py_BEGIN_ALLOW_THREADS
+    self->pool = threads == 1 ? NULL : new ThreadPool(threads);
+    self->fluid = new Fluid(b, s, o, v, scene.params, Subdomain(), self->pool);
+    Py_END_ALLOW_THREADS
+    return 0;
+}
+
+static void Fluid_dealloc(FluidObject* self)
+{
+    delete self->fluid;
+    delete self->pool;
+    delete self->colliders;
+    delete self->ballCenters;
+    delete self->ballRadii;
+    delete self->lock;
+    delete self->waiting;
+    Py_XDECREF(self->boundary);
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static bool Fluid_ready(FluidObject* self)
+{
+    if (!self->fluid) PyErr_SetString(PyExc_RuntimeError, "Fluid isn't initialized");
+    return self->fluid != NULL;
+}
+
+// Rebuild the colliders when balls were added, removed or moved since the last update
+static bool Fluid_setBalls(FluidObject* self, PyObject* balls)
+{
+    PyObject* seq = PySequence_Fast(balls, "balls must be a sequence of Ball");
+    if (!seq) return false;
+    std::vector<Vec3> centers;
+    std::vector<double> radii;
+    for (Py_ssize_t i = 0; i < PySequence_Fast_GET_SIZE(seq); i ++) {
+        PyObject* item = PySequence_Fast_GET_ITEM(seq, i);
+        if (!PyObject_TypeCheck(item, &BallType) || !((BallObject*)item)->ball) {
+            Py_DECREF(seq);
+            PyErr_SetString(PyExc_TypeError, "balls must be a sequence of Ball");
+            return false;
+        }
+        Ball* ball = ((BallObject*)item)->ball;
+        centers.push_back(ball->center);
+        radii.push_back(ball->radius);
+    }
+    Py_DECREF(seq);
+    if (centers == *self->ballCenters && radii == *self->ballRadii) return true;
+
+    ColliderSet* colliders = self->colliders;
+    for (int i = 0; i < colliders->colliders.size(); i ++) { delete colliders->colliders[i]; }
+    colliders->colliders.clear();
+    for (int i = 0; i < centers.size(); i ++) {
+        colliders->add(new SphereCollider(centers[i], radii[i]));
+    }
+    colliders->moved();
+    *self->ballCenters = centers;
+    *self->ballRadii = radii;
+    return true;
+}
+
+static PyObject* Fluid_update(FluidObject* self, PyObject* args, PyObject* kwargs)
+{
+    static const char* keywords[] = { "timestep", "gravity", "balls", "steps", NULL };
+    double timestep;
+    PyObject *gravity = NULL, *balls = NULL;
+    int steps = 1;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "d|OOi", (char**)keywords, &timestep, &gravity, &balls, &steps)) return NULL;
+    if (!Fluid_ready(self)) return NULL;
+    Vec3 g(0, -1, 0);
+    if (gravity && !toVec3(gravity, g, "gravity")) return NULL;
+    if (self->stepping) {
+        PyErr_SetString(PyExc_RuntimeError, "the fluid is already stepping in another thread");
+        return NULL;
+    }
+    if (balls && balls != Py_None && !Fluid_setBalls(self, balls)) return NULL;
+
+    self->stepping = true; // Set and cleared with the GIL held
+    Py_BEGIN_ALLOW_THREADS
+    for (int i = 0; i < steps; i ++) {
+        while (self->waiting->load() > 0) std::this_thread::yield(); // The mutex isn't fair
+        std::lock_guard<std::mutex> guard(*self->lock);
+        self->fluid->update((float)timestep, g, self->colliders);
+    }
+    Py_END_ALLOW_THREADS
+    self->stepping = false;
+    self->steps += steps;
+    Py_RETURN_NONE;
+}
+
+// Field arrays of the current step, taken between two steps of an update running in another thread
+static FieldsPointer Fluid_fields(FluidObject* self)
+{
+    FieldsPointer fields;
+    Py_BEGIN_ALLOW_THREADS
+    (*self->waiting) ++;
+    {
+        std::lock_guard<std::mutex> guard(*self->lock);
+        fields = self->fluid->getFields();
+    }
+    (*self->waiting) --;
+    Py_END_ALLOW_THREADS
+    return fields;
+}
+
+static PyObject* Fluid_snapshot(FluidObject* self, PyObject*)
+{
+    if (!Fluid_ready(self)) return NULL;
+    SnapshotObject* snapshot = PyObject_New(SnapshotObject, &SnapshotType);
+    if (!snapshot) return NULL;
+    snapshot->fields = new FieldsPointer(Fluid_fields(self));
+    return (PyObject*)snapshot;
+}
+
+static PyObject* Fluid_stats(FluidObject* self, PyObject*)
+{
+    if (!Fluid_ready(self)) return NULL;
+    if (self->stepping) {
+        PyErr_SetString(PyExc_RuntimeError, "the fluid is stepping in another thread");
+        return NULL;
+    }
+    FluidStats stats = self->fluid->getStats();
+    PyObject* momentum = fromVec3(stats.momentum);
+    if (!momentum) return NULL;
+    return Py_BuildValue("{s:i,s:d,s:d,s:d,s:N,s:i}", "particles", stats.particles, "kinetic_energy", stats.kineticEnergy,
+                         "max_speed", stats.maxSpeed, "mean_density", stats.meanDensity, "momentum", momentum, "sleeping", stats.sleeping);
+}
+
+static Py_ssize_t Fluid_length(FluidObject* self)
+{
+    if (!self->fluid) return 0;
+    Py_ssize_t length;
+    Py_BEGIN_ALLOW_THREADS
+    (*self->waiting) ++;
+    {
+        std::lock_guard<std::mutex> guard(*self->lock);
+        length = (Py_ssize_t)self->fluid->particles.size();
+    }
+    (*self->waiting) --;
+    Py_END_ALLOW_THREADS
+    return length;
+}
+
+// View of a field array of the current step
+static PyObject* Fluid_field(FluidObject* self, std::vector<double> Fluid::ParticleFields::* array, int components)
+{
+    if (!Fluid_ready(self)) return NULL;
+    FieldsPointer fields = Fluid_fields(self);
+    return makeView(fields, (*fields).*array, components);
+}
+static PyObject* Fluid_positions(FluidObject* self, void*) { return Fluid_field(self, &Fluid::ParticleFields::positions, 3); }
+static PyObject* Fluid_velocities(FluidObject* self, void*) { return Fluid_field(self, &Fluid::ParticleFields::velocities, 3); }
+static PyObject* Fluid_densities(FluidObject* self, void*) { return Fluid_field(self, &Fluid::ParticleFields::densities, 1); }
+static PyObject* Fluid_steps(FluidObject* self, void*) { return PyLong_FromLongLong(self->steps); }
+
+static PyMethodDef Fluid_methods[] = {
+    { "update", (PyCFunction)Fluid_update, METH_VARARGS | METH_KEYWORDS,
+      "update(timestep, gravity=(0, -1, 0), balls=None, steps=1)\nStep the fluid without holding the GIL. balls : Balls to collide with, None keeps the last ones." },
+    { "snapshot", (PyCFunction)Fluid_snapshot, METH_NOARGS, "Position, velocity, density and index of every particle at the current step, between two steps of an update in another thread" },
+    { "stats", (PyCFunction)Fluid_stats, METH_NOARGS, "Reductions over all particles as a dict" },
+    { NULL }
+};
+
+static PyGetSetDef Fluid_getset[] = {
+    { "positions", (getter)Fluid_positions, NULL, "Read-only (n, 3) view of particle positions at the current step", NULL },
+    { "velocities", (getter)Fluid_velocities, NULL, "Read-only (n, 3) view of particle velocities at the current step", NULL },
+    { "densities", (getter)Fluid_densities, NULL, "Read-only (n,) view of particle densities at the current step", NULL },
+    { "steps", (getter)Fluid_steps, NULL, "Steps taken", NULL },
+    { NULL }
+};
+
+static PySequenceMethods Fluid_sequence = { (lenfunc)Fluid_length };
+
+static PyTypeObject FluidType = { PyVarObject_HEAD_INIT(NULL, 0) };
+
+/** Module **/
+
+static PyObject* setLogLevel(PyObject* module, PyObject* args)
+{
+    int level;
+    if (!PyArg_ParseTuple(args, "i", &level)) return NULL;
+    Log::level() = level;
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef module_methods[] = {
+    { "set_log_level", setLogLevel, METH_VARARGS, "Log level of constructor diagnostics : 0 errors, 1 info, 2 debug" },
+    { NULL }
+};
+
+static struct PyModuleDef module_def = { PyModuleDef_HEAD_INIT, "fluidsim", "SPH fluid solver with particle views NumPy reads without copying", -1, module_methods };
+
+static bool ready(PyTypeObject* type, const char* name, Py_ssize_t size, destructor dealloc, const char* doc)
+{
+    type->tp_name = name;
+    type->tp_basicsize = size;
+    type->tp_dealloc = dealloc;
+    type->tp_flags = Py_TPFLAGS_DEFAULT;
+    type->tp_doc = doc;
+    return PyType_Ready(type) == 0;
+}
+
+PyMODINIT_FUNC PyInit_fluidsim(void)
+{
+    ViewType.tp_as_buffer = &View_buffer;
+    if (!ready(&ViewType, "fluidsim.View", sizeof(ViewObject), (destructor)View_dealloc, "Buffer of one field of the particles")) return NULL;
+
+    SnapshotType.tp_getset = Snapshot_getset;
+    SnapshotType.tp_as_sequence = &Snapshot_sequence;
+    if (!ready(&SnapshotType, "fluidsim.Snapshot", sizeof(SnapshotObject), (destructor)Snapshot_dealloc, "Particles after one step")) return NULL;
+
+    BoundaryType.tp_new = PyType_GenericNew;
+    BoundaryType.tp_init = (initproc)Boundary_init;
+    BoundaryType.tp_getset = Boundary_getset;
+    if (!ready(&BoundaryType, "fluidsim.Boundary", sizeof(BoundaryObject), (destructor)Boundary_dealloc, "Boundary(position, size)")) return NULL;
+
+    BallType.tp_new = PyType_GenericNew;
+    BallType.tp_init = (initproc)Ball_init;
+    BallType.tp_getset = Ball_getset;
+    if (!ready(&BallType, "fluidsim.Ball", sizeof(BallObject), (destructor)Ball_dealloc, "Ball(center, radius)")) return NULL;
+
+    FluidType.tp_new = PyType_GenericNew;
+    FluidType.tp_init = (initproc)Fluid_init;
+    FluidType.tp_methods = Fluid_methods;
+    FluidType.tp_getset = Fluid_getset;
+    FluidType.tp_as_sequence = &Fluid_sequence;
+    if (!ready(&FluidType, "fluidsim.Fluid", sizeof(FluidObject), (destructor)Fluid_dealloc,
+               "Fluid(boundary, size, offset=(0, 0, 0), velocity=(0, 0, 0), threads=0, params=None)")) return NULL;
+
+    PyObject* module = PyModule_Create(&module_def);
+    if (!module) return NULL;
+    PyObject* types[] = { (PyObject*)&BoundaryType, (PyObject*)&BallType, (PyObject*)&FluidType, (PyObject*)&SnapshotType };
+    const char* names[] = { "Boundary", "Ball", "Fluid", "Snapshot" };
+    for (int i = 0; i < 4; i ++) {
+        Py_INCREF(types[i]);
+        if (PyModule_AddObject(module, names[i], types[i]) < 0) {
+            Py_DECREF(types[i]);
+            Py_DECREF(module);
+            return NULL;
+        }
+    }
+    return module;
+}
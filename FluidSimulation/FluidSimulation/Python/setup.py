@@ -0,0 +1,9 @@
+# Build the fluidsim module next to this file : python3 setup.py build_ext --inplace
+# glm has to be on the include path, as for the app (CPPFLAGS=-I/path/to/glm if it isn't installed)
+from setuptools import setup, Extension
+
+setup(
+    name="fluidsim",
+    ext_modules=[Extension("fluidsim", ["fluidsim.cpp"], include_dirs=[".."], language="c++",
+                           extra_compile_args=["-std=c++14", "-O2", "-pthread"], extra_link_args=["-pthread"])],
+)
@@ -0,0 +1,52 @@
+#!/bin/sh
+# Checks the kernels, then every golden trajectory in Goldens/ against its scene of the same name in Scenes/, once with
+# the reference path and once for each configuration that has to reproduce it. Exits with 1 if any check failed.
+# Usage : Scripts/check.sh path/to/FluidSimulation [threads]
+
+if [ $# -lt 1 ]; then
+    echo "Usage: $0 path/to/FluidSimulation [threads]"
+    exit 2
+fi
+binary="$(cd "$(dirname "$1")" && pwd)/$(basename "$1")"
+threads=${2:-4}
+cd "$(dirname "$0")/.." || exit 2
+
+# Kernel tables diverge like any rounding change and are left out, --golden check kernelTable=N reports their error
+configurations="threads=$threads
+threads=$threads deterministic=1
+threads=$threads taskGraph=1
+threads=$threads numa=20"
+
+log=$(mktemp)
+failed=0
+check() # label, command...
+{
+    label=$1
+    shift
+    if "$@" > "$log" 2>&1; then
+        echo "PASS  $label"
+    else
+        echo "FAIL  $label"
+        tail -n 12 "$log"
+        failed=1
+    fi
+}
+
+check "kernels" "$binary" --check kernels
+for golden in Goldens/*.gld; do
+    name=$(basename "$golden" .gld)
+    scene=Scenes/$name.scene
+    if [ ! -f "$scene" ]; then
+        echo "FAIL  $name : no $scene"
+        failed=1
+        continue
+    fi
+    check "$name" "$binary" --scene "$scene" --golden check "$golden"
+    while read -r configuration; do
+        check "$name $configuration" "$binary" --scene "$scene" --golden check "$golden" $configuration
+    done <<END
+$configurations
+END
+done
+rm -f "$log"
+exit $failed
@@ -2,6 +2,7 @@
 
 layout (location = 0) in vec3 vsPosition;
 layout (location = 1) in vec3 vsColor;
+layout (location = 2) in float vsSize; // Point size in pixels
 
 out vec3 fsColor;
 
@@ -13,4 +14,5 @@ void main()
 {
     fsColor = vsColor;
     gl_Position = uniProjMatrix * uniViewMatrix * uniModelMatrix * vec4(vsPosition, 1.0f);
+    gl_PointSize = vsSize;
 }
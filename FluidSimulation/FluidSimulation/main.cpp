@@ -7,47 +7,176 @@
 
 #include <iostream>
 #include <cmath>
+#include <cstring>
 
 #include "Headers/Fluid.h"
 #include "Headers/Display.h"
+#include "Headers/Domain.h"
+#include "Headers/Surface.h"
+#include "Headers/Scene.h"
+#include "Headers/Sweep.h"
+#include "Headers/Golden.h"
+#include "Headers/Benchmark.h"
+#include "Headers/Metrics.h"
+#include "Headers/PerfCounters.h"
+#include "Headers/CellProfiler.h"
+#include "Headers/Soak.h"
 
 #define WIDTH 800
 #define HEIGHT 800
 
-#define TIME_STEP 0.04
-
 /** Functions **/
 void processInput(GLFWwindow *window);
 
 /** Callback functions **/
 void framebuffer_size_callback(GLFWwindow *window, int width, int height);
 
+int runSweep(int argc, const char * argv[]);
+int runGolden(int argc, const char * argv[]);
+int runBenchmark(int argc, const char * argv[]);
+int runSoak(int argc, const char * argv[]);
+int runCheck(int argc, const char * argv[]);
+// Micro-benchmarks : FluidSimulation --bench vec3 [particles] [rounds]
+int runBenchmark(int argc, const char * argv[])
+{
+    if (argc < 2 || strcmp(argv[1], "vec3") != 0) {
+        std::cout << "Usage: FluidSimulation --bench vec3 [particles] [rounds]" << std::endl;
+        return -1;
+    }
+    int count = argc > 2 ? atoi(argv[2]) : 4096;
+    int rounds = argc > 3 ? atoi(argv[3]) : 20;
+    if (count < 1 || rounds < 1) {
+        std::cout << "Particles and rounds have to be positive." << std::endl;
+        return -1;
+    }
+    VectorBenchmark::run(count, rounds);
+    return 0;
+}
+// Self checks : FluidSimulation --check kernels [radius]
+int runCheck(int argc, const char * argv[])
+{
+    if (argc < 2 || strcmp(argv[1], "kernels") != 0) {
+        std::cout << "Usage: FluidSimulation --check kernels [radius]" << std::endl;
+        return -1;
+    }
+    double radius = argc > 2 ? atof(argv[2]) : 1.0;
+    if (radius <= 0) {
+        std::cout << "Radius has to be positive." << std::endl;
+        return -1;
+    }
+    bool pass = KernelCheck::run(1.0);
+    if (radius != 1.0) pass = KernelCheck::run(radius) && pass;
+    return pass ? 0 : 1;
+}
+
+#ifdef FLUID_USE_MPI
+int runDistributed(int argc, const char * argv[]);
+#endif
+void placeOnNodes(Fluid* fluid, ThreadPool* pool);
+
 /** Global **/
 // Flow control
 int running = 0;
+int exportSurface = 0; // Write the surface mesh of every simulated frame as an OBJ file
+int showHeatmap = 0; // Overlay the time every cell takes, with profile.cells in the scene
+int surfaceOnly = 0; // Draw only the particles of cells at the fluid's surface, render.surface in the scene
 // Window and world
 GLFWwindow *window;
 glm::vec3 bgColor(200/255.0, 200/255.0, 200/255.0);
+// Scene : positions, sizes and physical constants, built-in or loaded with --scene
+Scene scene;
 // Fluid
-Boundary boundary(Vec3(-3.25, -2, -12), Vec3(13, 13, 13));
-Vec3 fluidSize(6, 6, 6);
-Vec3 fluidPosOffset(0, 6, 2);
-Vec3 fluidInitVelocity(7, 0, 0);
-Fluid fluid(&boundary, fluidSize, fluidPosOffset, fluidInitVelocity);
-Vec3 gravity(0, -1, 0);
+Boundary* boundary;
+Fluid* fluid;
 // Ground
-Vec3 groundPos(-20, -6.5, -8);
 Vec2 groundSize(40, 40);
 glm::vec4 groundColor(16/255.0, 176/255.0, 202/255.0, 0.3);
-Ground ground(groundPos, groundSize, groundColor);
+Ground* ground;
 // Ball
-Vec3 ballPos(5, 5, -17);
-int ballRadius = 2;
 glm::vec4 ballColor(150/255.0, 150/255.0, 240/255.0, 1.0f);
-Ball ball(ballPos, ballRadius, ballColor);
+Ball* ball;
+// Colliders
+ColliderSet colliders;
+
+// With numa = N in the scene : pin threads node by node, place particles on the nodes of the threads
+// computing them (again every N steps) and print where their memory ended up
+void placeOnNodes(Fluid* fluid, ThreadPool* pool)
+{
+    fluid->placeInterval = scene.numa;
+    fluid->hugePages = scene.hugePages;
+    if (scene.numa <= 0) return;
+    if (!pool->pinThreads()) {
+        printf("Numa: threads can't be pinned here, placement follows the scheduler\n");
+    }
+    fluid->placeParticles();
+    fluid->reportPlacement();
+}
 
 int main(int argc, const char * argv[])
 {
+    /** Command line **/
+    // FluidSimulation [--scene file] [--mpi [steps]]
+    // FluidSimulation --sweep file [threads] [results]
+    // FluidSimulation [--scene file] --golden record golden [steps] [interval]
+    // FluidSimulation [--scene file] --golden check golden [key=value ...]
+    // FluidSimulation --bench vec3 [particles] [rounds]
+    // FluidSimulation --check kernels [radius]
+    // FluidSimulation [--scene file] --soak [steps] [cycle interval] [bound MB]
+    int arg = 1;
+    if (argc > 2 && strcmp(argv[1], "--scene") == 0) {
+        if (!scene.load(argv[2])) {
+            return -1;
+        }
+        if (!scene.sweep.empty()) {
+            printf("Scene: sweep axes are only used with --sweep.\n");
+        }
+        arg = 3;
+    }
+    Log::level() = scene.log;
+    if (argc > arg && strcmp(argv[arg], "--sweep") == 0) {
+        return runSweep(argc - arg, argv + arg);
+    }
+    if (argc > arg && strcmp(argv[arg], "--golden") == 0) {
+        return runGolden(argc - arg, argv + arg);
+    }
+    if (argc > arg && strcmp(argv[arg], "--bench") == 0) {
+        return runBenchmark(argc - arg, argv + arg);
+    }
+    if (argc > arg && strcmp(argv[arg], "--check") == 0) {
+        return runCheck(argc - arg, argv + arg);
+    }
+    if (argc > arg && strcmp(argv[arg], "--soak") == 0) {
+        return runSoak(argc - arg, argv + arg);
+    }
+#ifdef FLUID_USE_MPI
+    if (argc > arg && strcmp(argv[arg], "--mpi") == 0) {
+        return runDistributed(argc - arg, argv + arg);
+    }
+#endif
+    boundary = new Boundary(scene.boundaryPosition, scene.boundarySize);
+    ThreadPool threadPool(scene.threads);
+    fluid = new Fluid(boundary, scene.fluidSize, scene.fluidPosOffset, scene.fluidInitVelocity, scene.params, Subdomain(), &threadPool);
+    ground = new Ground(scene.groundPosition, groundSize, groundColor);
+    ball = new Ball(scene.ballPosition, scene.ballRadius, ballColor);
+    fluid->deterministic = scene.deterministic;
+    fluid->taskGraph = scene.taskGraph;
+    scene.addSources(fluid);
+    placeOnNodes(fluid, &threadPool);
+    MetricsServer metrics;
+    if (scene.metrics != "0" && metrics.start(scene.metrics)) {
+        fluid->observers.push_back(&metrics);
+    }
+    PerfCounters* perf = NULL;
+    if (scene.perf != 0) {
+        perf = new PerfCounters(&threadPool, scene.perf > 0 ? scene.perf : 0);
+        fluid->observers.push_back(perf);
+    }
+    CellProfiler* profiler = NULL;
+    if (scene.profileCells > 0) {
+        profiler = new CellProfiler(fluid, scene.profileCells);
+        fluid->observers.push_back(profiler);
+    }
+    
     /** Prepare for rendering **/
     // Initialize GLFW
     glfwInit();
@@ -82,12 +211,24 @@ int main(int argc, const char * argv[])
     // Callback functions should be registered after creating window and before initializing render loop
     glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
     
+    /** Colliders **/
+    colliders.add(new SphereCollider(ball));
+    colliders.add(new PlaneCollider(ground));
+    scene.addMesh(&colliders); // Not drawn, the fluid shows its shape
+    
     /** Renderers **/
     // Render program definitions
-    GroundRender groundRender(&ground);
-    FluidRender fluidRender(&fluid);
-    BoundaryRender boundaryRender(&boundary);
-    BallRender ballRender(&ball);
+    GroundRender groundRender(ground);
+    FluidRender fluidRender(fluid);
+    fluidRender.culling = scene.renderCull;
+    fluidRender.lodDistance = scene.renderLod;
+    surfaceOnly = scene.renderSurface;
+    BoundaryRender boundaryRender(boundary);
+    BallRender ballRender(ball);
+    
+    /** Surface extraction **/
+    SurfaceExtractor surfaceExtractor(fluid, &threadPool);
+    int frame = 0;
     
     glEnable(GL_DEPTH_TEST);
     
@@ -104,10 +245,21 @@ int main(int argc, const char * argv[])
         /** -------------------------------- Simulation & Rendering -------------------------------- **/
         
         if (running) { // Anything that affects the simulation should be added here
-            fluid.update(TIME_STEP, gravity, &ball);
+            fluid->update(scene.timestep, scene.gravity, &colliders);
+            if (exportSurface) {
+                char path[64];
+                sprintf(path, "surface_%05d.obj", frame);
+                surfaceExtractor.extract();
+                surfaceExtractor.mesh.writeObj(path);
+            }
+            frame ++;
         }
         groundRender.flush();
+        if (perf) perf->begin(PerfCounters::SLOT_RENDER);
+        fluidRender.surfaceOnly = surfaceOnly;
         fluidRender.flush();
+        if (perf) perf->end(PerfCounters::SLOT_RENDER);
+        if (profiler) boundaryRender.setHeatmap(showHeatmap ? profiler->meanSeconds : std::vector<double>());
         boundaryRender.flush();
         ballRender.flush();
         
@@ -116,12 +268,183 @@ int main(int argc, const char * argv[])
         glfwSwapBuffers(window);
         glfwPollEvents(); // Update the status of window
     }
+    if (perf) {
+        perf->reportTotals();
+        delete perf;
+    }
+    delete profiler;
 
     glfwTerminate();
     
     return 0;
 }
 
+// Headless parameter sweep : FluidSimulation --sweep file [threads] [results]
+// Every combination of the sweep axes in the scene file is run once, threads default to one per core.
+int runSweep(int argc, const char * argv[])
+{
+    if (argc < 2) {
+        std::cout << "Usage: FluidSimulation --sweep file [threads] [results]" << std::endl;
+        return -1;
+    }
+    Scene sweepScene;
+    if (!sweepScene.load(argv[1])) {
+        return -1;
+    }
+    int threads = argc > 2 ? atoi(argv[2]) : 0;
+    const char* resultsPath = argc > 3 ? argv[3] : "sweep_results.jsonl";
+    
+    SweepRunner runner(sweepScene);
+    return runner.run(threads, resultsPath) ? 0 : -1;
+}
+
+// Golden trajectory of the scene : record it with the reference path, or check a configuration against it.
+// Check takes scene keys to override (e.g. threads=4 deterministic=1) and tolerances (e.g. tolerance.density=1e-4).
+int runGolden(int argc, const char * argv[])
+{
+    if (argc < 3 || (strcmp(argv[1], "record") != 0 && strcmp(argv[1], "check") != 0)) {
+        std::cout << "Usage: FluidSimulation [--scene file] --golden record golden [steps] [interval]" << std::endl;
+        std::cout << "       FluidSimulation [--scene file] --golden check golden [key=value ...]" << std::endl;
+        return -1;
+    }
+    if (strcmp(argv[1], "record") == 0) {
+        int steps = argc > 3 ? atoi(argv[3]) : 200;
+        int interval = argc > 4 ? atoi(argv[4]) : 20;
+        return GoldenTrajectory::record(scene, argv[2], steps, interval > 0 ? interval : 1) ? 0 : -1;
+    }
+    
+    Scene checked = scene;
+    GoldenTrajectory::Tolerance tolerance;
+    for (int i = 3; i < argc; i ++) {
+        const char* equal = strchr(argv[i], '=');
+        std::string key(argv[i], equal ? equal - argv[i] : strlen(argv[i]));
+        std::string value = equal ? equal + 1 : "";
+        bool ok = true;
+        if (key == "tolerance.density") ok = sscanf(value.c_str(), "%lf", &tolerance.density) == 1;
+        else if (key == "tolerance.velocity") ok = sscanf(value.c_str(), "%lf", &tolerance.velocity) == 1;
+        else if (key == "tolerance.mass") ok = sscanf(value.c_str(), "%lf", &tolerance.mass) == 1;
+        else if (key == "tolerance.momentum") ok = sscanf(value.c_str(), "%lf", &tolerance.momentum) == 1;
+        else ok = checked.set(key, value);
+        if (!ok) {
+            std::cout << "Bad option " << argv[i] << std::endl;
+            return -1;
+        }
+    }
+    return GoldenTrajectory::check(checked, argv[2], tolerance) ? 0 : 1;
+}
+
+// Soak test of the scene : FluidSimulation [--scene file] --soak [steps] [cycle interval] [bound MB]
+// Renderers are cycled too when a hidden window can be made, e.g. under xvfb-run with LIBGL_ALWAYS_SOFTWARE=1.
+// Exits with 1 when memory grew past the bound.
+int runSoak(int argc, const char * argv[])
+{
+    long long steps = argc > 1 ? atoll(argv[1]) : 1000000;
+    int cycleInterval = argc > 2 ? atoi(argv[2]) : 100;
+    double bound = (argc > 3 ? atof(argv[3]) : 16) * 1048576;
+    if (steps <= 0 || bound <= 0) {
+        std::cout << "Usage: FluidSimulation [--scene file] --soak [steps] [cycle interval] [bound MB]" << std::endl;
+        return -1;
+    }
+    
+    bool render = false;
+    GLFWwindow* hidden = NULL;
+    if (glfwInit()) {
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+        glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+#ifdef __APPLE__
+        glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+#endif
+        glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+        hidden = glfwCreateWindow(WIDTH, HEIGHT, "Fluid Simulation", NULL, NULL);
+        if (hidden) {
+            glfwMakeContextCurrent(hidden);
+            render = gladLoadGLLoader((GLADloadproc)glfwGetProcAddress) != 0;
+        }
+    }
+    
+    int result;
+    {
+        SoakTest soak;
+        result = soak.run(scene, steps, cycleInterval, bound, render) ? 0 : 1;
+    }
+    if (hidden) glfwDestroyWindow(hidden);
+    glfwTerminate();
+    return result;
+}
+
+#ifdef FLUID_USE_MPI
+// Headless run split over MPI ranks : mpirun -np 4 FluidSimulation [--scene file] --mpi [steps]
+int runDistributed(int argc, const char * argv[])
+{
+    MPI_Init(NULL, NULL);
+    int rank, numRanks;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &numRanks);
+    int steps = argc > 1 ? atoi(argv[1]) : scene.steps;
+    int result = 0;
+    
+    {
+        Boundary localBoundary(scene.boundaryPosition, scene.boundarySize);
+        ThreadPool threadPool(scene.threads);
+        Fluid localFluid(&localBoundary, scene.fluidSize, scene.fluidPosOffset, scene.fluidInitVelocity, scene.params,
+                         DomainDecomposition::split(&localBoundary, rank, numRanks), &threadPool);
+        localFluid.deterministic = scene.deterministic;
+        scene.addSources(&localFluid);
+        placeOnNodes(&localFluid, &threadPool);
+        DomainDecomposition domain(&localFluid);
+        MetricsServer metrics; // Every rank serves its own : port + rank, or path.rank
+        if (scene.metrics != "0") {
+            bool port = scene.metrics.find_first_not_of("0123456789") == std::string::npos;
+            std::string address = port ? std::to_string(atoi(scene.metrics.c_str()) + rank) : scene.metrics + "." + std::to_string(rank);
+            if (metrics.start(address)) localFluid.observers.push_back(&metrics);
+        }
+        PerfCounters* perf = NULL; // Counted on rank 0
+        if (scene.perf != 0 && rank == 0) {
+            perf = new PerfCounters(&threadPool, scene.perf > 0 ? scene.perf : 0);
+            localFluid.observers.push_back(perf);
+        }
+        CellProfiler* profiler = NULL; // cells_r<rank>_#####.vtk
+        if (scene.profileCells > 0) {
+            profiler = new CellProfiler(&localFluid, scene.profileCells, "cells_r" + std::to_string(rank));
+            localFluid.observers.push_back(profiler);
+        }
+        
+        scene.addColliders(&colliders);
+        
+        for (int i = 0; i < steps; i ++) {
+            domain.update(scene.timestep, scene.gravity, &colliders);
+        }
+        if (perf) {
+            perf->reportTotals();
+            delete perf;
+        }
+        delete profiler;
+        
+        // Sinks have to remove what one process would, rank 0 steps the scene alone to compare
+        if (!localFluid.sinks.empty()) {
+            long long removed = domain.sinkRemoved();
+            if (rank == 0) {
+                Boundary boundary(scene.boundaryPosition, scene.boundarySize);
+                Fluid alone(&boundary, scene.fluidSize, scene.fluidPosOffset, scene.fluidInitVelocity, scene.params, Subdomain(), &threadPool);
+                alone.deterministic = scene.deterministic;
+                scene.addSources(&alone);
+                for (int i = 0; i < steps; i ++) {
+                    alone.update(scene.timestep, scene.gravity, &colliders);
+                }
+                bool same = removed == alone.sinkRemoved;
+                printf("DomainDecomposition: sinks removed %lld particles over %d ranks, %lld in one process%s\n", removed, numRanks,
+                       alone.sinkRemoved, same ? "" : (scene.deterministic ? "  FAIL" : "  (runs only match with deterministic = 1)"));
+                if (!same && scene.deterministic) result = 1;
+            }
+        }
+    }
+    
+    MPI_Finalize();
+    return result;
+}
+#endif
+
 void framebuffer_size_callback(GLFWwindow *window, int width, int height)
 {
     glViewport(0, 0, width, height);
@@ -140,6 +463,24 @@ void processInput(GLFWwindow *window)
     if (glfwGetKey(window, GLFW_KEY_T) == GLFW_PRESS) {
         running = 0;
     }
+    if (glfwGetKey(window, GLFW_KEY_M) == GLFW_PRESS) {
+        exportSurface = 1;
+    }
+    if (glfwGetKey(window, GLFW_KEY_N) == GLFW_PRESS) {
+        exportSurface = 0;
+    }
+    if (glfwGetKey(window, GLFW_KEY_H) == GLFW_PRESS) {
+        showHeatmap = 1;
+    }
+    if (glfwGetKey(window, GLFW_KEY_J) == GLFW_PRESS) {
+        showHeatmap = 0;
+    }
+    if (glfwGetKey(window, GLFW_KEY_V) == GLFW_PRESS) {
+        surfaceOnly = 1;
+    }
+    if (glfwGetKey(window, GLFW_KEY_B) == GLFW_PRESS) {
+        surfaceOnly = 0;
+    }
     
     if (glfwGetKey(window, GLFW_KEY_1) == GLFW_PRESS) {
         cam.pos = glm::vec3(-14.0f, 10.0f, 1.0f);